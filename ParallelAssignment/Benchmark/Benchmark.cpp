@@ -0,0 +1,377 @@
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+#include "Parser.h"
+#include "Statistics.h"
+#include "Reduction.h"
+#include "MultiDevice.h"
+#include "CpuBackend.h"
+#include "ProgramCache.h"
+#include "DataGenerator.h"
+
+///
+/// One benchmark configuration and its timings over every repeat [ns]
+///
+struct BenchmarkResult
+{
+	std::string device;
+	std::string variant;
+	size_t size;
+	size_t local_size;
+	std::vector<cl_ulong> times;
+
+	// Nearest rank percentile of the repeats
+	cl_ulong Percentile(double p) const
+	{
+		std::vector<cl_ulong> sorted(times);
+		std::sort(sorted.begin(), sorted.end());
+		size_t rank = (size_t)std::ceil(p / 100.0 * sorted.size());
+		return sorted[std::min(sorted.size() - 1, rank ? rank - 1 : 0)];
+	}
+
+	cl_ulong Median() const { return Percentile(50); }
+	cl_ulong Min() const { return *std::min_element(times.begin(), times.end()); }
+	double Mean() const
+	{
+		double total = 0.0;
+		for (size_t i = 0; i < times.size(); i++)
+			total += (double)times[i];
+		return total / times.size();
+	}
+};
+
+///
+/// Splits a comma separated list of whole numbers or names
+///
+std::vector<std::string> splitList(const std::string& list)
+{
+	std::vector<std::string> items;
+	std::stringstream stream(list);
+	std::string item;
+	while (std::getline(stream, item, ','))
+	{
+		if (!item.empty())
+			items.push_back(item);
+	}
+	return items;
+}
+
+std::vector<size_t> parseSizes(const std::string& list)
+{
+	std::vector<size_t> sizes;
+	std::vector<std::string> items = splitList(list);
+	for (size_t i = 0; i < items.size(); i++)
+		sizes.push_back((size_t)std::stoull(items[i]));
+	return sizes;
+}
+
+// Quotes a string for the JSON output, the names only ever need quotes and backslashes escaping
+std::string jsonString(const std::string& s)
+{
+	std::string quoted = "\"";
+	for (size_t i = 0; i < s.size(); i++)
+	{
+		if (s[i] == '"' || s[i] == '\\')
+			quoted += '\\';
+		quoted += s[i];
+	}
+	return quoted + "\"";
+}
+
+void writeCsv(const std::string& filename, const std::vector<BenchmarkResult>& results)
+{
+	std::ofstream file(filename);
+	file << "device,variant,size,local_size,repeats,median_ns,p95_ns,min_ns,mean_ns" << std::endl;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchmarkResult& r = results[i];
+		file << "\"" << r.device << "\"," << r.variant << "," << r.size << "," << r.local_size << "," << r.times.size() << ",";
+		file << r.Median() << "," << r.Percentile(95) << "," << r.Min() << "," << (cl_ulong)r.Mean() << std::endl;
+	}
+}
+
+void writeJson(const std::string& filename, const std::vector<BenchmarkResult>& results)
+{
+	std::ofstream file(filename);
+	file << "[" << std::endl;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchmarkResult& r = results[i];
+		file << "  { \"device\": " << jsonString(r.device) << ", \"variant\": " << jsonString(r.variant);
+		file << ", \"size\": " << r.size << ", \"local_size\": " << r.local_size << ", \"repeats\": " << r.times.size();
+		file << ", \"median_ns\": " << r.Median() << ", \"p95_ns\": " << r.Percentile(95) << ", \"min_ns\": " << r.Min();
+		file << ", \"mean_ns\": " << (cl_ulong)r.Mean() << ", \"times_ns\": [";
+		for (size_t t = 0; t < r.times.size(); t++)
+			file << (t ? ", " : "") << r.times[t];
+		file << "] }" << (i + 1 < results.size() ? "," : "") << std::endl;
+	}
+	file << "]" << std::endl;
+}
+
+///
+/// Runs one variant once over the first N values of input and returns its device time [ns].
+/// Only kernel time is measured (from the profiling events), the upload is done once per size beforehand.
+///
+cl_ulong RunVariant(const std::string& variant, cl::Context& context, cl::CommandQueue& queue, cl::Program& program,
+	ReduceRegistry& reductions, cl::Buffer& input, cl_int first, size_t N, size_t local_size)
+{
+	if (variant == "reduce_min" || variant == "reduce_max" || variant == "reduce_sum")
+	{
+		ReduceOp op = variant == "reduce_min" ? REDUCE_MIN : variant == "reduce_max" ? REDUCE_MAX : REDUCE_SUM;
+		cl::Event stage1, stage2;
+		RunTwoStageReduce<cl_long>(reductions, queue, op, REDUCE_INT32, input, N, local_size, &stage1, &stage2);
+		return GetExecutionTime(stage1) + GetExecutionTime(stage2);
+	}
+	else if (variant == "atomic_min" || variant == "atomic_max")
+	{
+		cl::Buffer output(context, CL_MEM_READ_WRITE, sizeof(cl_int));
+		queue.enqueueFillBuffer(output, first, 0, sizeof(cl_int));
+
+		cl::Kernel kernel(program, variant == "atomic_min" ? "at_find_min" : "at_find_max");
+		kernel.setArg(0, input);
+		kernel.setArg(1, output);
+		kernel.setArg(2, cl::Local(local_size * sizeof(cl_int)));
+		kernel.setArg(3, (cl_int)N);
+
+		cl::Event event;
+		size_t global = ((N + local_size - 1) / local_size) * local_size;
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global), cl::NDRange(local_size), NULL, &event);
+		queue.finish();
+		return GetExecutionTime(event);
+	}
+	else if (variant == "fused_stats")
+	{
+		cl::Event event;
+		RunFusedStats(context, queue, program, input, N, local_size, &event);
+		return GetExecutionTime(event);
+	}
+	throw std::runtime_error("Unknown variant " + variant);
+}
+
+///
+/// The work group size variant runs at when local_size is asked for, or 0 if it can't run at that size on the
+/// context's device. The atomics and fused_stats run at most at their kernel's CL_KERNEL_WORK_GROUP_SIZE (which
+/// EnqueueFusedStats() would clamp to), a reduction is specialised for local_size so it has to fit as it is.
+///
+size_t VariantLocalSize(const std::string& variant, cl::Context& context, cl::Program& program, ReduceRegistry& reductions, size_t local_size)
+{
+	if (variant == "reduce_min" || variant == "reduce_max" || variant == "reduce_sum")
+	{
+		std::vector<size_t> sizes = reductions.WorkGroupSizes(REDUCE_INT32);
+		if ((local_size & (local_size - 1)) != 0 || local_size > sizes.back())
+			return 0;
+		ReduceOp op = variant == "reduce_min" ? REDUCE_MIN : variant == "reduce_max" ? REDUCE_MAX : REDUCE_SUM;
+		cl::Kernel kernel(reductions.Get(op, REDUCE_INT32, local_size), "reduce_stage1");
+		return KernelLocalSize(context, kernel, local_size) == local_size ? local_size : 0;
+	}
+	const char* name = variant == "atomic_min" ? "at_find_min" : variant == "atomic_max" ? "at_find_max" : variant == "fused_stats" ? "reduce_stats" : NULL;
+	if (!name)
+		throw std::runtime_error("Unknown variant " + variant);
+	return KernelLocalSize(context, cl::Kernel(program, name), local_size);
+}
+
+void print_help()
+{
+	std::cerr << "Application usage:" << std::endl;
+
+	std::cerr << "  -g : generate this many synthetic records into the -f file and exit" << std::endl;
+	std::cerr << "  -f : data file, written by -g, or benchmarked instead of synthetic data (default: temp_synthetic.txt)" << std::endl;
+	std::cerr << "  -n : data sizes to sweep, comma separated (default: 10000,100000,1000000,10000000)" << std::endl;
+	std::cerr << "  -w : work group sizes to sweep, comma separated (default: 64,128,256,512,1024)" << std::endl;
+	std::cerr << "  -v : variants, comma separated (default: reduce_min,atomic_min,reduce_max,atomic_max,reduce_sum,fused_stats,cpu)" << std::endl;
+	std::cerr << "  -p : only benchmark the devices on this platform (default: every device)" << std::endl;
+	std::cerr << "  -u : warm-up runs before timing (default: 2)" << std::endl;
+	std::cerr << "  -r : timed runs (default: 10)" << std::endl;
+	std::cerr << "  -s : seed for the synthetic data (default: 1)" << std::endl;
+	std::cerr << "  -o : output name, results are written to <name>.csv and <name>.json (default: benchmark)" << std::endl;
+	std::cerr << "  -h : print this message" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	size_t generate = 0;
+	std::string dataFile = "temp_synthetic.txt";
+	bool useFile = false;
+	std::vector<size_t> sizes = { 10000, 100000, 1000000, 10000000 };
+	std::vector<size_t> localSizes = { 64, 128, 256, 512, 1024 };
+	std::vector<std::string> variants = splitList("reduce_min,atomic_min,reduce_max,atomic_max,reduce_sum,fused_stats,cpu");
+	int platform_id = -1;
+	size_t warmups = 2;
+	size_t repeats = 10;
+	unsigned long long seed = 1;
+	std::string output = "benchmark";
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "-g") == 0) && (i < (argc - 1))) { generate = (size_t)std::stoull(argv[++i]); }
+		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { dataFile = argv[++i]; useFile = true; }
+		else if ((strcmp(argv[i], "-n") == 0) && (i < (argc - 1))) { sizes = parseSizes(argv[++i]); }
+		else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { localSizes = parseSizes(argv[++i]); }
+		else if ((strcmp(argv[i], "-v") == 0) && (i < (argc - 1))) { variants = splitList(argv[++i]); }
+		else if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-u") == 0) && (i < (argc - 1))) { warmups = strtoul(argv[++i], NULL, 10); }
+		else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { repeats = std::max(1ul, strtoul(argv[++i], NULL, 10)); }
+		else if ((strcmp(argv[i], "-s") == 0) && (i < (argc - 1))) { seed = std::stoull(argv[++i]); }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output = argv[++i]; }
+		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+	}
+
+	try
+	{
+		if (generate)
+		{
+			auto start = std::chrono::steady_clock::now();
+			GenerateFile(dataFile, generate, seed);
+			auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+			std::cout << "Wrote " << generate << " records to " << dataFile << " in " << (ms / 1000.0f) << " seconds" << std::endl;
+			return 0;
+		}
+
+		// A real file is benchmarked as a single size, otherwise one synthetic set is made at the largest size
+		// and the smaller sizes use the start of it
+		TemperatureColumn* data;
+		if (useFile)
+		{
+			data = readFileMapped(dataFile);
+			sizes.assign(1, data->size());
+		}
+		else
+		{
+			std::vector<int> generated = GenerateTemperatures(*std::max_element(sizes.begin(), sizes.end()), seed);
+			data = new TemperatureColumn(generated.begin(), generated.end());
+		}
+
+		std::vector<BenchmarkResult> results;
+
+		// The native backend doesn't depend on the device or work group size, so it is only swept over the sizes
+		if (std::find(variants.begin(), variants.end(), "cpu") != variants.end())
+		{
+			for (size_t s = 0; s < sizes.size(); s++)
+			{
+				BenchmarkResult result = { "cpu (" + std::string(CpuSimdName()) + ")", "cpu", sizes[s], 0, {} };
+				for (size_t run = 0; run < warmups + repeats; run++)
+				{
+					auto start = std::chrono::steady_clock::now();
+					RunCpuStats(&(*data)[0], sizes[s]);
+					auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+					if (run >= warmups)
+						result.times.push_back((cl_ulong)ns);
+				}
+				std::cout << result.device << "	" << result.variant << "	n=" << result.size << "	median " << result.Median() << " [ns]	p95 " << result.Percentile(95) << " [ns]" << std::endl;
+				results.push_back(result);
+			}
+		}
+
+		std::vector<std::pair<int, int> > devices = GetDeviceIds(platform_id);
+		for (size_t d = 0; d < devices.size(); d++)
+		{
+			std::string name = GetPlatformName(devices[d].first) + ", " + GetDeviceName(devices[d].first, devices[d].second);
+			cl::Context context = GetContext(devices[d].first, devices[d].second);
+			cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+			cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+
+			// The kernels are next to the executable after a build, or in the main project when run from the IDE
+			std::string kernelDir = std::ifstream("my_kernels3.cl").good() ? "" : "../ParallelAssignment/";
+			cl::Program program;
+			ReduceRegistry reductions(context, kernelDir + "reduce_template.cl");
+			try
+			{
+				program = BuildProgram(context, kernelDir + "my_kernels3.cl");
+			}
+			catch (const cl::Error&)
+			{
+				std::cerr << "Skipping " << name << ", the kernels failed to build" << std::endl;
+				continue;
+			}
+
+			size_t maxWorkGroup = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+			cl_ulong maxAlloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+
+			for (size_t s = 0; s < sizes.size(); s++)
+			{
+				size_t N = sizes[s];
+				if (N * sizeof(cl_int) > maxAlloc)
+				{
+					std::cerr << "Skipping " << N << " values on " << name << ", larger than its maximum allocation" << std::endl;
+					continue;
+				}
+
+				cl::Buffer input(context, CL_MEM_READ_ONLY, N * sizeof(cl_int));
+				queue.enqueueWriteBuffer(input, CL_TRUE, 0, N * sizeof(cl_int), &(*data)[0]);
+
+				for (size_t l = 0; l < localSizes.size(); l++)
+				{
+					size_t local_size = localSizes[l];
+					if (local_size > maxWorkGroup)
+						continue;
+
+					for (size_t v = 0; v < variants.size(); v++)
+					{
+						if (variants[v] == "cpu")
+							continue;
+
+						// A configuration that fails is skipped, the rest of the sweep (and what it has found so far) still counts.
+						// A variant that would be clamped to a smaller work group is skipped too, that size has its own rows.
+						try
+						{
+							size_t ran = VariantLocalSize(variants[v], context, program, reductions, local_size);
+							if (ran != local_size)
+							{
+								std::cerr << "Skipping " << variants[v] << " at local=" << local_size << " on " << name;
+								std::cerr << (ran ? ", its kernel allows at most " + std::to_string(ran) : ", the device can't run it at that size") << std::endl;
+								continue;
+							}
+
+							BenchmarkResult result = { name, variants[v], N, local_size, {} };
+							for (size_t run = 0; run < warmups + repeats; run++)
+							{
+								cl_ulong ns = RunVariant(variants[v], context, queue, program, reductions, input, (*data)[0], N, local_size);
+								if (run >= warmups)
+									result.times.push_back(ns);
+							}
+							std::cout << name << "	" << result.variant << "	n=" << N << "	local=" << local_size;
+							std::cout << "	median " << result.Median() << " [ns]	p95 " << result.Percentile(95) << " [ns]" << std::endl;
+							results.push_back(result);
+						}
+						catch (const cl::Error& err)
+						{
+							std::cerr << "Skipping " << variants[v] << " at local=" << local_size << " on " << name << ", ";
+							std::cerr << err.what() << ", " << getErrorString(err.err()) << std::endl;
+						}
+					}
+				}
+			}
+		}
+
+		writeCsv(output + ".csv", results);
+		writeJson(output + ".json", results);
+		std::cout << "\nWrote " << results.size() << " results to " << output << ".csv and " << output << ".json" << std::endl;
+	}
+	catch (const cl::Error& err)
+	{
+		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+		return 1;
+	}
+	catch (const std::exception& err)
+	{
+		std::cerr << "ERROR: " << err.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
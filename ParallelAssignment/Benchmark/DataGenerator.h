@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+
+///
+/// Deterministic synthetic weather records in the temp_lincolnshire format, for benchmarking at any size.
+/// The random numbers come from a fixed xorshift generator rather than <random>'s distributions, so the same
+/// seed gives the same file on every compiler and platform.
+///
+struct SyntheticRecord
+{
+	int station;		// index into SyntheticStations()
+	int year;
+	int month;
+	int day;
+	int time;			// HHMM
+	int tenths;			// air temperature in 0.1 degrees
+};
+
+const std::vector<std::string>& SyntheticStations()
+{
+	static const std::vector<std::string> stations = { "BARKSTON_HEATH", "SCAMPTON", "WADDINGTON", "CRANWELL", "CONINGSBY" };
+	return stations;
+}
+
+class WeatherGenerator
+{
+public:
+	explicit WeatherGenerator(unsigned long long seed = 1) : state(seed ? seed : 1) {}
+
+	///
+	/// Random date and time between 1938 and 2018, with a temperature that follows the season and time of day
+	/// plus noise, clamped to the range seen in the real data
+	///
+	void Next(SyntheticRecord& r)
+	{
+		static const int daysInMonth[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+		r.station = (int)(NextInt() % SyntheticStations().size());
+		r.year = 1938 + (int)(NextInt() % 81);
+		r.month = 1 + (int)(NextInt() % 12);
+		bool leap = (r.year % 4 == 0 && r.year % 100 != 0) || r.year % 400 == 0;
+		r.day = 1 + (int)(NextInt() % (daysInMonth[r.month - 1] + (r.month == 2 && leap ? 1 : 0)));
+		int minutes = (int)(NextInt() % 48) * 30 + 20;
+		r.time = (minutes / 60) * 100 + minutes % 60;
+
+		const double pi = 3.14159265358979323846;
+		double season = -7.0 * std::cos(2.0 * pi * (r.month - 1.5) / 12.0);
+		double daily = -3.0 * std::cos(2.0 * pi * (minutes - 240) / 1440.0);
+		double noise = (NextUniform() + NextUniform() + NextUniform() + NextUniform() - 2.0) * 6.0;	// roughly normal, sd ~3.5
+		double temperature = std::min(std::max(9.7 + season + daily + noise, -25.0), 35.0);
+		r.tenths = (int)std::floor(temperature * 10.0 + 0.5);
+	}
+
+private:
+	unsigned long long state;
+
+	// xorshift64*
+	unsigned long long NextInt()
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 2685821657736338717ULL;
+	}
+
+	double NextUniform() { return (NextInt() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+///
+/// The temperature column (* 100, like the parser) of the first n records a generator with this seed produces,
+/// i.e. the same values GenerateFile() would write
+///
+std::vector<int> GenerateTemperatures(size_t n, unsigned long long seed = 1)
+{
+	std::vector<int> values(n);
+	WeatherGenerator generator(seed);
+	SyntheticRecord record;
+	for (size_t i = 0; i < n; i++)
+	{
+		generator.Next(record);
+		values[i] = record.tenths * 10;
+	}
+	return values;
+}
+
+// Writes n as a zero padded decimal of the given width, returns the end
+inline char* writeDigits(char* out, int n, int width)
+{
+	for (int i = width - 1; i >= 0; i--, n /= 10)
+		out[i] = (char)('0' + n % 10);
+	return out + width;
+}
+
+///
+/// Writes n records to filename, formatted by hand into a large buffer as printf is far too slow for 500M lines
+///
+void GenerateFile(const std::string& filename, size_t n, unsigned long long seed = 1)
+{
+	FILE* file = fopen(filename.c_str(), "wb");
+	if (!file)
+		throw std::runtime_error("Unable to create " + filename);
+
+	const std::vector<std::string>& stations = SyntheticStations();
+	std::vector<char> buffer(1 << 22);
+	size_t used = 0;
+
+	WeatherGenerator generator(seed);
+	SyntheticRecord r;
+	for (size_t i = 0; i < n; i++)
+	{
+		if (used + 64 > buffer.size())
+		{
+			fwrite(&buffer[0], 1, used, file);
+			used = 0;
+		}
+
+		generator.Next(r);
+		char* out = &buffer[used];
+		const std::string& station = stations[r.station];
+		out = std::copy(station.begin(), station.end(), out);
+		*out++ = ' ';
+		out = writeDigits(out, r.year, 4);
+		*out++ = ' ';
+		out = writeDigits(out, r.month, 2);
+		*out++ = ' ';
+		out = writeDigits(out, r.day, 2);
+		*out++ = ' ';
+		out = writeDigits(out, r.time, 4);
+		*out++ = ' ';
+
+		int tenths = r.tenths;
+		if (tenths < 0)
+		{
+			*out++ = '-';
+			tenths = -tenths;
+		}
+		int whole = tenths / 10;
+		out = writeDigits(out, whole, whole >= 10 ? 2 : 1);
+		*out++ = '.';
+		*out++ = (char)('0' + tenths % 10);
+		*out++ = '\n';
+
+		used = out - &buffer[0];
+	}
+
+	fwrite(&buffer[0], 1, used, file);
+	if (fclose(file) != 0)
+		throw std::runtime_error("Unable to write " + filename);
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#ifndef _WIN32
+#include <glob.h>
+#endif
+
+#include "Utils.h"
+#include "Parser.h"
+#include "Statistics.h"
+#include "HostBuffer.h"
+#include "Tuning.h"
+
+///
+/// The files named by a comma separated list, e.g. "a.txt,feeds/*.txt". * and ? match in the file name part of an
+/// entry (not its directories), each pattern's matches are sorted. An entry without either is kept as it is, so a
+/// missing file is reported when it is read rather than dropped here.
+///
+std::vector<std::string> ExpandFileList(const std::string& list)
+{
+	std::vector<std::string> files;
+	std::stringstream stream(list);
+	std::string entry;
+	while (std::getline(stream, entry, ','))
+	{
+		if (entry.empty())
+			continue;
+		if (entry.find_first_of("*?") == std::string::npos)
+		{
+			files.push_back(entry);
+			continue;
+		}
+
+		std::vector<std::string> matches;
+#ifdef _WIN32
+		// FindFirstFile only returns the names, the directory is put back in front of them
+		size_t slash = entry.find_last_of("/\\");
+		std::string directory = slash == std::string::npos ? "" : entry.substr(0, slash + 1);
+		WIN32_FIND_DATAA found;
+		HANDLE search = FindFirstFileA(entry.c_str(), &found);
+		if (search != INVALID_HANDLE_VALUE)
+		{
+			do
+			{
+				if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+					matches.push_back(directory + found.cFileName);
+			} while (FindNextFileA(search, &found));
+			FindClose(search);
+		}
+#else
+		glob_t found;
+		if (glob(entry.c_str(), 0, NULL, &found) == 0)
+		{
+			for (size_t i = 0; i < found.gl_pathc; i++)
+				matches.push_back(found.gl_pathv[i]);
+		}
+		globfree(&found);
+#endif
+		std::sort(matches.begin(), matches.end());
+		files.insert(files.end(), matches.begin(), matches.end());
+	}
+	return files;
+}
+
+///
+/// One file of a batch run and its own statistics
+///
+struct BatchFile
+{
+	std::string filename;
+	std::string error;		// why the file couldn't be processed, empty if it was
+	bool compact;			// reduced as 16 bit values
+	Stats stats;
+	cl::Event upload, kernel;
+	double parseTime;		// host parse [ms]
+};
+
+///
+/// Every file of a batch run, and their statistics combined
+///
+struct BatchResult
+{
+	std::vector<BatchFile> files;
+	Stats total;
+	size_t failed;
+	unsigned int workers;
+	unsigned int threadsPerFile;
+
+	// Sums of every file's own times [ns], which overlap each other. Zero copy files have no upload.
+	cl_ulong UploadTime() const
+	{
+		cl_ulong total = 0;
+		for (size_t i = 0; i < files.size(); i++)
+			total += files[i].upload() ? GetExecutionTime(files[i].upload) : 0;
+		return total;
+	}
+
+	cl_ulong KernelTime() const
+	{
+		cl_ulong total = 0;
+		for (size_t i = 0; i < files.size(); i++)
+			total += files[i].kernel() ? GetExecutionTime(files[i].kernel) : 0;
+		return total;
+	}
+};
+
+///
+/// Parses and reduces every file, sharing one context and program. A pool of workers (threadCount in all, 0 for one
+/// per hardware thread) takes the files in turn: each file is parsed by the memory-mapped reader (with the threads
+/// left over when there are fewer files than workers), uploaded (or wrapped, with zeroCopy) and reduced by
+/// reduce_stats on a queue of its own, so one file's kernels run while the other workers are still parsing theirs.
+/// With a filter only the matching records of each file are kept, compact reduces 16 bit values where they fit.
+///
+/// A file that can't be read or has a malformed line gets its error and is left out of the total, the rest carry on.
+/// The total merges the files in list order, so it doesn't depend on which worker finished first.
+///
+BatchResult RunBatch(cl::Context& context, cl::Program& program, const std::vector<std::string>& filenames, const LaunchConfig& launch,
+	unsigned int threadCount = 0, bool zeroCopy = false, bool compact = false, const RecordFilter* filter = NULL)
+{
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	BatchResult result;
+	result.failed = 0;
+	result.workers = std::max(1u, std::min(threadCount, (unsigned int)filenames.size()));
+	result.threadsPerFile = std::max(1u, threadCount / result.workers);
+	result.files.resize(filenames.size());
+
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> workers;
+	for (unsigned int w = 0; w < result.workers; w++)
+	{
+		workers.push_back(std::thread([&]() {
+			for (size_t f = next++; f < filenames.size(); f = next++)
+			{
+				BatchFile& file = result.files[f];
+				file.filename = filenames[f];
+				file.compact = false;
+				file.parseTime = 0.0;
+				try
+				{
+					std::chrono::steady_clock::time_point parseStart = std::chrono::steady_clock::now();
+					std::unique_ptr<WeatherData> records;
+					std::unique_ptr<TemperatureColumn> column;
+					if (filter)
+						records.reset(readRecordsMapped(file.filename, result.threadsPerFile, filter));
+					else
+						column.reset(readFileMapped(file.filename, result.threadsPerFile));
+					TemperatureColumn& values = filter ? records->temperature : *column;
+					Column<short> values16;
+					file.compact = compact && narrowTemperatures(values, values16);
+					file.parseTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - parseStart).count();
+					if (values.empty())
+						continue;
+
+					// The queue (and the buffer) only live as long as this file, the column outlives both
+					cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+					cl::Buffer input = file.compact ? ColumnBuffer(context, queue, values16, zeroCopy, CL_MEM_READ_ONLY, &file.upload)
+						: ColumnBuffer(context, queue, values, zeroCopy, CL_MEM_READ_ONLY, &file.upload);
+					file.stats = RunFusedStats(context, queue, program, input, values.size(), launch.local_size, &file.kernel,
+						launch.Groups(values.size()), file.compact);
+				}
+				catch (const std::exception& err)
+				{
+					file.error = err.what();
+				}
+			}
+		}));
+	}
+	for (size_t w = 0; w < workers.size(); w++)
+		workers[w].join();
+
+	for (size_t f = 0; f < result.files.size(); f++)
+	{
+		if (result.files[f].error.empty())
+			result.total.merge(result.files[f].stats);
+		else
+			result.failed++;
+	}
+	return result;
+}
+
+///
+/// Writes one CSV line of statistics per file and a last one for all of them combined. A file that failed has its
+/// error in place of the statistics, one with no records only its count. Returns false if the file can't be written.
+///
+bool WriteBatchCsv(const std::string& filename, const BatchResult& batch)
+{
+	std::ofstream out(filename);
+	if (!out)
+		return false;
+
+	out << std::fixed << std::setprecision(2);
+	out << "file,count,min,max,mean,variance,std_dev,error" << std::endl;
+	for (size_t i = 0; i <= batch.files.size(); i++)
+	{
+		bool combined = i == batch.files.size();
+		const Stats& stats = combined ? batch.total : batch.files[i].stats;
+		out << (combined ? "combined" : batch.files[i].filename) << ",";
+		if (!combined && !batch.files[i].error.empty())
+		{
+			std::string error = batch.files[i].error;
+			for (size_t q = error.find('"'); q != std::string::npos; q = error.find('"', q + 2))
+				error.insert(q, 1, '"');
+			out << ",,,,,,\"" << error << "\"" << std::endl;
+			continue;
+		}
+		if (stats.count == 0)
+		{
+			out << "0,,,,,," << std::endl;
+			continue;
+		}
+		out << stats.count << "," << stats.Min() << "," << stats.Max() << "," << stats.Mean() << "," << stats.Variance() << "," << stats.StdDev() << "," << std::endl;
+	}
+	return (bool)out;
+}
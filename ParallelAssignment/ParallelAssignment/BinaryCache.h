@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "Parser.h"
+
+///
+/// Binary column store for parsed weather files.
+/// The first run parses the text file and writes <file>.bin next to it, later runs map the .bin file instead and the
+/// columns are used where they are in the mapping, so start-up is limited by how fast the pages can be read rather
+/// than by text parsing or copying.
+///
+/// Layout (all little-endian, every section starts on an 8 byte boundary, the temperatures on a page so the device
+/// can wrap them in place):
+///   CacheHeader
+///   station names, each one as a uint16 length followed by the characters
+///   station column      uint16 x records
+///   date column         int32  x records  (yyyymmdd)
+///   time column         int16  x records  (HHMM)
+///   temperature column  int32  x records  (degrees * 100)
+///
+struct CacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t records;
+	uint64_t sourceSize;	// size and modification time of the text file the cache was built from,
+	int64_t sourceTime;		// if either has changed the cache is stale and gets rebuilt
+	uint32_t stationCount;
+	uint32_t reserved;
+};
+
+const char CACHE_MAGIC[4] = { 'P', 'A', 'W', 'C' };
+const uint32_t CACHE_VERSION = 2;
+
+///
+/// Gets the size and last modified time of a file, returns false if it doesn't exist
+///
+bool getFileStamp(const std::string& filename, uint64_t& size, int64_t& modified)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(filename.c_str(), &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0)
+		return false;
+#endif
+	size = (uint64_t)st.st_size;
+	modified = (int64_t)st.st_mtime;
+	return true;
+}
+
+inline size_t alignCache(size_t offset, size_t alignment = 8)
+{
+	return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+///
+/// Pads the file out to the next alignment byte boundary
+///
+void padCache(std::ofstream& file, size_t alignment = 8)
+{
+	size_t offset = (size_t)file.tellp();
+	std::vector<char> zeros(alignCache(offset, alignment) - offset, 0);
+	if (!zeros.empty())
+		file.write(zeros.data(), zeros.size());
+}
+
+///
+/// Writes one column and pads the file out to the next 8 byte boundary
+///
+template <typename Values>
+void writeColumn(std::ofstream& file, const Values& column)
+{
+	if (!column.empty())
+		file.write((const char*)column.data(), column.size() * sizeof(column[0]));
+	padCache(file);
+}
+
+///
+/// Saves the parsed records to cacheName, stamped with the size and time of sourceName.
+/// Written to a temporary file first and renamed so a crashed run can't leave half a cache behind.
+///
+bool writeCache(const std::string& cacheName, const std::string& sourceName, const WeatherData& data)
+{
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	header.records = data.size();
+	header.stationCount = (uint32_t)data.stations.size();
+	if (!getFileStamp(sourceName, header.sourceSize, header.sourceTime))
+		return false;
+
+	std::string tempName = cacheName + ".tmp";
+	{
+		std::ofstream file(tempName, std::ios::binary | std::ios::trunc);
+		if (!file)
+			return false;
+
+		file.write((const char*)&header, sizeof(header));
+
+		std::vector<char> names;
+		for (size_t s = 0; s < data.stations.size(); s++)
+		{
+			uint16_t length = (uint16_t)data.stations[s].size();
+			names.insert(names.end(), (const char*)&length, (const char*)&length + sizeof(length));
+			names.insert(names.end(), data.stations[s].begin(), data.stations[s].end());
+		}
+		writeColumn(file, names);
+
+		writeColumn(file, data.station);
+		writeColumn(file, data.date);
+		writeColumn(file, data.time);
+		padCache(file, PageAllocator<int>::PAGE_SIZE);
+		writeColumn(file, data.temperature);
+
+		if (!file)
+			return false;
+	}
+
+	std::remove(cacheName.c_str());
+	return std::rename(tempName.c_str(), cacheName.c_str()) == 0;
+}
+
+///
+/// Points column at its values in the mapped file, nothing is copied. Returns false if the file is too short to hold it.
+///
+template <typename T>
+bool mapColumn(const std::shared_ptr<MappedFile>& file, size_t& offset, size_t count, Column<T>& column, size_t alignment = 8)
+{
+	offset = alignCache(offset, alignment);
+	size_t bytes = count * sizeof(T);
+	if (offset + bytes > file->size())
+		return false;
+
+	column = Column<T>(file, offset, count);
+	offset = alignCache(offset + bytes);
+	return true;
+}
+
+///
+/// Loads the records from cacheName if it exists and was built from the current version of sourceName.
+/// The file stays mapped (copy-on-write, so the records can still be filtered in place) for as long as any of the
+/// columns are alive, and they are views of it, only the station names are copied out.
+/// Returns NULL when there is no usable cache, the caller should then parse the text file and call writeCache().
+///
+WeatherData* readCache(const std::string& cacheName, const std::string& sourceName)
+{
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	uint64_t cacheSize;
+	int64_t cacheTime;
+	if (!getFileStamp(sourceName, sourceSize, sourceTime) || !getFileStamp(cacheName, cacheSize, cacheTime) || cacheSize < sizeof(CacheHeader))
+		return NULL;
+
+	try
+	{
+		std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(cacheName, true);
+
+		CacheHeader header;
+		memcpy(&header, file->data(), sizeof(header));
+		if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != CACHE_VERSION ||
+			header.sourceSize != sourceSize || header.sourceTime != sourceTime)
+			return NULL;
+
+		WeatherData* data = new WeatherData;
+		size_t offset = sizeof(header);
+		for (uint32_t s = 0; s < header.stationCount; s++)
+		{
+			uint16_t length;
+			if (offset + sizeof(length) > file->size())
+				break;
+			memcpy(&length, file->data() + offset, sizeof(length));
+			offset += sizeof(length);
+			if (offset + length > file->size())
+				break;
+			data->stations.push_back(std::string(file->data() + offset, length));
+			offset += length;
+		}
+		offset = alignCache(offset);
+
+		size_t n = (size_t)header.records;
+		if (data->stations.size() != header.stationCount ||
+			!mapColumn(file, offset, n, data->station) || !mapColumn(file, offset, n, data->date) ||
+			!mapColumn(file, offset, n, data->time) || !mapColumn(file, offset, n, data->temperature, PageAllocator<int>::PAGE_SIZE))
+		{
+			delete data;
+			return NULL;
+		}
+		return data;
+	}
+	catch (const std::exception&)
+	{
+		return NULL;
+	}
+}
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <climits>
+#include <algorithm>
+
+// The SIMD loops are built for x86 whatever the compiler flags are, and the one the CPU supports is picked at run time
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CPU_BACKEND_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CPU_TARGET(isa)
+#else
+#define CPU_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+#include "Statistics.h"
+
+// Below this many values the auto backend skips OpenCL, building the program and setting up buffers costs more than the kernels save
+const size_t CPU_AUTO_THRESHOLD = 1 << 20;
+
+enum CpuSimd { CPU_SIMD_SCALAR, CPU_SIMD_SSE41, CPU_SIMD_AVX2 };
+
+///
+/// The widest instruction set CpuReduce() can use on this CPU (and OS, for AVX2's registers), looked up once
+///
+CpuSimd CpuSimdLevel()
+{
+	static const CpuSimd level = []() {
+#if defined(CPU_BACKEND_X86) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		int maxLeaf = info[0];
+		__cpuid(info, 1);
+		bool sse41 = (info[2] & (1 << 19)) != 0;
+		bool avxEnabled = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;	// OSXSAVE, AVX, XMM + YMM state
+		bool avx2 = false;
+		if (avxEnabled && maxLeaf >= 7)
+		{
+			__cpuidex(info, 7, 0);
+			avx2 = (info[1] & (1 << 5)) != 0;
+		}
+		return avx2 ? CPU_SIMD_AVX2 : sse41 ? CPU_SIMD_SSE41 : CPU_SIMD_SCALAR;
+#elif defined(CPU_BACKEND_X86)
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") ? CPU_SIMD_AVX2 : __builtin_cpu_supports("sse4.1") ? CPU_SIMD_SSE41 : CPU_SIMD_SCALAR;
+#else
+		return CPU_SIMD_SCALAR;
+#endif
+	}();
+	return level;
+}
+
+///
+/// Instruction set the CPU backend runs with on this machine
+///
+const char* CpuSimdName()
+{
+	switch (CpuSimdLevel())
+	{
+	case CPU_SIMD_AVX2: return "AVX2";
+	case CPU_SIMD_SSE41: return "SSE4.1";
+	default: return "scalar";
+	}
+}
+
+///
+/// Exact integer totals over a range of values (* 100). The sums are 64 bit so nothing is lost before the merge.
+///
+struct CpuPartial
+{
+	size_t count;
+	int min;
+	int max;
+	long long sum;
+	long long sumSquares;
+};
+
+#ifdef CPU_BACKEND_X86
+
+///
+/// The AVX2 part of CpuReduce(), 8 values per step. Sums are widened to 64 bit lanes, squares use _mm256_mul_epi32
+/// (even lanes) so they can't overflow. Returns how many values it took, the rest are left to the scalar loop.
+///
+CPU_TARGET("avx2") size_t CpuReduceAvx2(const int* values, size_t n, CpuPartial& partial)
+{
+	size_t i = 0;
+	__m256i vmin = _mm256_set1_epi32(INT_MAX);
+	__m256i vmax = _mm256_set1_epi32(INT_MIN);
+	__m256i vsum = _mm256_setzero_si256();
+	__m256i vsq = _mm256_setzero_si256();
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(values + i));
+		vmin = _mm256_min_epi32(vmin, v);
+		vmax = _mm256_max_epi32(vmax, v);
+		vsum = _mm256_add_epi64(vsum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+		vsum = _mm256_add_epi64(vsum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+		__m256i odd = _mm256_srli_epi64(v, 32);
+		vsq = _mm256_add_epi64(vsq, _mm256_mul_epi32(v, v));
+		vsq = _mm256_add_epi64(vsq, _mm256_mul_epi32(odd, odd));
+	}
+
+	int lanes[8];
+	long long wide[4];
+	_mm256_storeu_si256((__m256i*)lanes, vmin);
+	for (int l = 0; l < 8; l++) partial.min = std::min(partial.min, lanes[l]);
+	_mm256_storeu_si256((__m256i*)lanes, vmax);
+	for (int l = 0; l < 8; l++) partial.max = std::max(partial.max, lanes[l]);
+	_mm256_storeu_si256((__m256i*)wide, vsum);
+	for (int l = 0; l < 4; l++) partial.sum += wide[l];
+	_mm256_storeu_si256((__m256i*)wide, vsq);
+	for (int l = 0; l < 4; l++) partial.sumSquares += wide[l];
+	_mm256_zeroupper();
+	return i;
+}
+
+///
+/// The SSE4.1 part of CpuReduce(), 4 values per step with the same widening as CpuReduceAvx2()
+///
+CPU_TARGET("sse4.1") size_t CpuReduceSse41(const int* values, size_t n, CpuPartial& partial)
+{
+	size_t i = 0;
+	__m128i vmin = _mm_set1_epi32(INT_MAX);
+	__m128i vmax = _mm_set1_epi32(INT_MIN);
+	__m128i vsum = _mm_setzero_si128();
+	__m128i vsq = _mm_setzero_si128();
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(values + i));
+		vmin = _mm_min_epi32(vmin, v);
+		vmax = _mm_max_epi32(vmax, v);
+		vsum = _mm_add_epi64(vsum, _mm_cvtepi32_epi64(v));
+		vsum = _mm_add_epi64(vsum, _mm_cvtepi32_epi64(_mm_srli_si128(v, 8)));
+		__m128i odd = _mm_srli_epi64(v, 32);
+		vsq = _mm_add_epi64(vsq, _mm_mul_epi32(v, v));
+		vsq = _mm_add_epi64(vsq, _mm_mul_epi32(odd, odd));
+	}
+
+	int lanes[4];
+	long long wide[2];
+	_mm_storeu_si128((__m128i*)lanes, vmin);
+	for (int l = 0; l < 4; l++) partial.min = std::min(partial.min, lanes[l]);
+	_mm_storeu_si128((__m128i*)lanes, vmax);
+	for (int l = 0; l < 4; l++) partial.max = std::max(partial.max, lanes[l]);
+	_mm_storeu_si128((__m128i*)wide, vsum);
+	partial.sum += wide[0] + wide[1];
+	_mm_storeu_si128((__m128i*)wide, vsq);
+	partial.sumSquares += wide[0] + wide[1];
+	return i;
+}
+
+#endif
+
+///
+/// Adds values[i..n) to partial one at a time
+///
+template <typename T>
+void CpuReduceScalar(const T* values, size_t i, size_t n, CpuPartial& partial)
+{
+	for (; i < n; i++)
+	{
+		int v = values[i];
+		partial.min = std::min(partial.min, v);
+		partial.max = std::max(partial.max, v);
+		partial.sum += v;
+		partial.sumSquares += (long long)v * v;
+	}
+}
+
+inline CpuPartial CpuEmptyPartial(size_t n)
+{
+	CpuPartial partial;
+	partial.count = n;
+	partial.min = INT_MAX;
+	partial.max = INT_MIN;
+	partial.sum = 0;
+	partial.sumSquares = 0;
+	return partial;
+}
+
+///
+/// Min, max, sum and sum of squares of values[0..n) in a single pass, vectorised with CpuSimdLevel()
+///
+CpuPartial CpuReduce(const int* values, size_t n)
+{
+	CpuPartial partial = CpuEmptyPartial(n);
+	size_t i = 0;
+
+#ifdef CPU_BACKEND_X86
+	switch (CpuSimdLevel())
+	{
+	case CPU_SIMD_AVX2: i = CpuReduceAvx2(values, n, partial); break;
+	case CPU_SIMD_SSE41: i = CpuReduceSse41(values, n, partial); break;
+	default: break;
+	}
+#endif
+
+	// Whatever is left over (or everything, without SIMD)
+	CpuReduceScalar(values, i, n, partial);
+	return partial;
+}
+
+///
+/// CpuReduce() over the 16 bit values of -z 16, left to the compiler to vectorise
+///
+CpuPartial CpuReduce(const short* values, size_t n)
+{
+	CpuPartial partial = CpuEmptyPartial(n);
+	CpuReduceScalar(values, 0, n, partial);
+	return partial;
+}
+
+///
+/// Native equivalent of RunFusedStats(): the values are split into one contiguous range per std::thread, each
+/// range is reduced with CpuReduce() and the results merged into a Stats, so it prints exactly like the kernels.
+/// Small inputs use fewer threads, there is no point starting a thread for a few thousand values.
+/// T is int, or short for the 16 bit values of -z 16.
+///
+template <typename T>
+Stats RunCpuStats(const T* values, size_t N, unsigned int threadCount = 0, size_t min_per_thread = 1 << 16)
+{
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	threadCount = (unsigned int)std::max((size_t)1, std::min((size_t)threadCount, N / min_per_thread));
+
+	std::vector<CpuPartial> partials(threadCount);
+	std::vector<std::thread> workers;
+	size_t per_thread = (N + threadCount - 1) / threadCount;
+	for (unsigned int t = 0; t < threadCount; t++)
+	{
+		size_t begin = std::min(N, t * per_thread);
+		size_t end = std::min(N, begin + per_thread);
+		if (t + 1 == threadCount)
+			partials[t] = CpuReduce(values + begin, end - begin);
+		else
+			workers.push_back(std::thread([&partials, values, t, begin, end]() { partials[t] = CpuReduce(values + begin, end - begin); }));
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	Stats stats;
+	for (unsigned int t = 0; t < threadCount; t++)
+	{
+		const CpuPartial& p = partials[t];
+		if (p.count == 0)
+			continue;
+		double mean = (double)p.sum / p.count;
+		double m2 = (double)p.sumSquares - (double)p.sum * mean;
+		stats.merge(p.count, p.min, p.max, mean, std::max(0.0, m2));
+	}
+	return stats;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <climits>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+#include "Parser.h"
+
+///
+/// The temperature column of a text file parsed by the device
+///
+struct DeviceParse
+{
+	size_t count;
+	size_t chunks;					// uploads the text went up in
+	cl::Buffer temperature;			// int, degrees * 100 in file order, ready for the kernels that take buffer_A
+	std::vector<cl::Event> uploads;
+	std::vector<cl::Event> kernels;	// every launch, for profiling
+};
+
+///
+/// Parses the temperatures of a file on the device instead of the host. The raw bytes are uploaded chunk_bytes at a
+/// time through their own queue, line_count counts each chunk's records as soon as it (and the chunk before it, for the
+/// byte ahead of its first line) has arrived, scan_counts turns the counts into offsets, line_scatter writes every
+/// record's offset and parse_temperatures parses the 6th column of every record at once. Only the record count and the
+/// malformed line check (an int each) come back to the host, nothing is parsed into host memory.
+///
+/// Each work group of line_count and line_scatter walks block bytes of the text, chunk_bytes is rounded down to whole
+/// blocks so no block spans two uploads. Each kernel runs with local_size lowered to what it allows.
+/// queue must be in order. Throws the same errors as the host parsers for a file that can't be read or a malformed line.
+///
+DeviceParse ParseOnDevice(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, const std::string& filename,
+	size_t local_size, size_t chunk_bytes = 16 << 20, size_t block = 64 << 10)
+{
+	MappedFile file(filename);
+	size_t size = file.size();
+	if (size > (size_t)INT_MAX)
+		throw std::runtime_error(filename + " is too large to parse on the device");
+
+	DeviceParse parsed;
+	parsed.count = 0;
+	parsed.chunks = 0;
+	if (size == 0)
+	{
+		parsed.temperature = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int));	// a zero sized buffer is an error
+		return parsed;
+	}
+
+	block = std::max(local_size, block);
+	chunk_bytes = std::max(block, chunk_bytes / block * block);
+	size_t nr_groups = (size + block - 1) / block;
+
+	cl::Buffer text(context, CL_MEM_READ_ONLY, size);
+	cl::Buffer counts(context, CL_MEM_READ_WRITE, (nr_groups + 1) * sizeof(cl_int));
+	cl::CommandQueue upload_queue(context, CL_QUEUE_PROFILING_ENABLE);
+
+	// Pass 1 - upload and count chunk by chunk
+	cl::Kernel kernel_count = cl::Kernel(program, "line_count");
+	kernel_count.setArg(0, text);
+	kernel_count.setArg(1, (cl_int)size);
+	kernel_count.setArg(2, (cl_int)block);
+	kernel_count.setArg(4, counts);
+	size_t count_local = KernelLocalSize(context, kernel_count, local_size);
+	kernel_count.setArg(5, cl::Local(count_local * sizeof(cl_int)));
+	for (size_t offset = 0; offset < size; offset += chunk_bytes)
+	{
+		size_t bytes = std::min(chunk_bytes, size - offset);
+		parsed.uploads.push_back(cl::Event());
+		upload_queue.enqueueWriteBuffer(text, CL_FALSE, offset, bytes, file.data() + offset, NULL, &parsed.uploads.back());
+		upload_queue.flush();
+
+		std::vector<cl::Event> uploaded(parsed.uploads.end() - std::min((size_t)2, parsed.uploads.size()), parsed.uploads.end());
+		kernel_count.setArg(3, (cl_int)(offset / block));
+		parsed.kernels.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel_count, cl::NullRange, cl::NDRange(((bytes + block - 1) / block) * count_local), cl::NDRange(count_local),
+			&uploaded, &parsed.kernels.back());
+		queue.flush();
+		parsed.chunks++;
+	}
+
+	// Pass 2 - the offsets, and the total to size the outputs
+	cl::Kernel kernel_scan = cl::Kernel(program, "scan_counts");
+	kernel_scan.setArg(0, counts);
+	kernel_scan.setArg(1, (cl_int)nr_groups);
+	size_t scan_local = KernelLocalSize(context, kernel_scan, local_size);
+	kernel_scan.setArg(2, cl::Local(scan_local * sizeof(cl_int)));
+	parsed.kernels.push_back(cl::Event());
+	queue.enqueueNDRangeKernel(kernel_scan, cl::NullRange, cl::NDRange(scan_local), cl::NDRange(scan_local), NULL, &parsed.kernels.back());
+
+	cl_int total = 0;
+	queue.enqueueReadBuffer(counts, CL_TRUE, nr_groups * sizeof(cl_int), sizeof(cl_int), &total);
+	parsed.count = (size_t)total;
+	size_t n = std::max((size_t)1, parsed.count);
+	parsed.temperature = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_int));
+	if (parsed.count == 0)
+		return parsed;
+
+	// Pass 3 - every record's offset, then every record's temperature
+	cl::Buffer lineStarts(context, CL_MEM_READ_WRITE, parsed.count * sizeof(cl_int));
+	cl::Kernel kernel_scatter = cl::Kernel(program, "line_scatter");
+	kernel_scatter.setArg(0, text);
+	kernel_scatter.setArg(1, (cl_int)size);
+	kernel_scatter.setArg(2, (cl_int)block);
+	kernel_scatter.setArg(3, counts);
+	kernel_scatter.setArg(4, lineStarts);
+	size_t scatter_local = KernelLocalSize(context, kernel_scatter, local_size);
+	kernel_scatter.setArg(5, cl::Local(scatter_local * sizeof(cl_int)));
+	parsed.kernels.push_back(cl::Event());
+	queue.enqueueNDRangeKernel(kernel_scatter, cl::NullRange, cl::NDRange(nr_groups * scatter_local), cl::NDRange(scatter_local), NULL, &parsed.kernels.back());
+
+	cl_int malformed = INT_MAX;
+	cl::Buffer buffer_malformed(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_int), &malformed);
+	cl::Kernel kernel_parse = cl::Kernel(program, "parse_temperatures");
+	kernel_parse.setArg(0, text);
+	kernel_parse.setArg(1, (cl_int)size);
+	kernel_parse.setArg(2, lineStarts);
+	kernel_parse.setArg(3, (cl_int)parsed.count);
+	kernel_parse.setArg(4, parsed.temperature);
+	kernel_parse.setArg(5, buffer_malformed);
+	size_t parse_local = KernelLocalSize(context, kernel_parse, local_size);
+	parsed.kernels.push_back(cl::Event());
+	queue.enqueueNDRangeKernel(kernel_parse, cl::NullRange, cl::NDRange(((parsed.count + parse_local - 1) / parse_local) * parse_local), cl::NDRange(parse_local),
+		NULL, &parsed.kernels.back());
+
+	queue.enqueueReadBuffer(buffer_malformed, CL_TRUE, 0, sizeof(cl_int), &malformed);
+	if (malformed != INT_MAX)
+	{
+		cl_int start = 0;
+		queue.enqueueReadBuffer(lineStarts, CL_TRUE, malformed * sizeof(cl_int), sizeof(cl_int), &start);
+		const char* line = file.data() + start;
+		const char* lineEnd = (const char*)memchr(line, '\n', size - start);
+		throw std::runtime_error("Malformed line: " + std::string(line, lineEnd ? lineEnd : file.data() + size));
+	}
+	return parsed;
+}
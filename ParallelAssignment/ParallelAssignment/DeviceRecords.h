@@ -0,0 +1,178 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Parser.h"
+#include "Statistics.h"
+
+///
+/// Every column of a WeatherData uploaded to the device, so statistics over any subset of the records can be
+/// worked out without sending anything but the filter to the device again
+///
+struct DeviceRecords
+{
+	size_t count;
+	cl::Buffer temperature;	// int
+	cl::Buffer station;		// ushort
+	cl::Buffer date;		// int, yyyymmdd
+	cl::Buffer time;		// short, HHMM
+	std::vector<cl::Event> uploads;
+};
+
+///
+/// Uploads the columns with non-blocking writes, the returned upload events must finish before the records are used
+/// (anything queued after them on the same in-order queue is fine).
+/// If the temperatures are already on the device (buffer_A) pass that buffer in and they aren't uploaded again.
+///
+DeviceRecords UploadRecords(cl::Context& context, cl::CommandQueue& queue, const WeatherData& records, const cl::Buffer* temperature = NULL)
+{
+	DeviceRecords device;
+	device.count = records.size();
+	size_t n = std::max((size_t)1, device.count);	// a zero sized buffer is an error
+
+	device.temperature = temperature ? *temperature : cl::Buffer(context, CL_MEM_READ_ONLY, n * sizeof(cl_int));
+	device.station = cl::Buffer(context, CL_MEM_READ_ONLY, n * sizeof(cl_ushort));
+	device.date = cl::Buffer(context, CL_MEM_READ_ONLY, n * sizeof(cl_int));
+	device.time = cl::Buffer(context, CL_MEM_READ_ONLY, n * sizeof(cl_short));
+
+	if (device.count == 0)
+		return device;
+
+	device.uploads.resize(3);
+	queue.enqueueWriteBuffer(device.station, CL_FALSE, 0, device.count * sizeof(cl_ushort), &records.station[0], NULL, &device.uploads[0]);
+	queue.enqueueWriteBuffer(device.date, CL_FALSE, 0, device.count * sizeof(cl_int), &records.date[0], NULL, &device.uploads[1]);
+	queue.enqueueWriteBuffer(device.time, CL_FALSE, 0, device.count * sizeof(cl_short), &records.time[0], NULL, &device.uploads[2]);
+	if (!temperature)
+	{
+		device.uploads.push_back(cl::Event());
+		queue.enqueueWriteBuffer(device.temperature, CL_FALSE, 0, device.count * sizeof(cl_int), &records.temperature[0], NULL, &device.uploads.back());
+	}
+	queue.flush();
+	return device;
+}
+
+///
+/// Sets the 7 filter arguments record_matches() takes (station, date, month and time ranges) from index first on
+///
+void SetFilterArgs(cl::Kernel& kernel, cl_uint first, const RecordFilter& filter)
+{
+	kernel.setArg(first, (cl_int)filter.station);
+	kernel.setArg(first + 1, (cl_int)filter.dateFrom);
+	kernel.setArg(first + 2, (cl_int)filter.dateTo);
+	kernel.setArg(first + 3, (cl_int)filter.monthFrom);
+	kernel.setArg(first + 4, (cl_int)filter.monthTo);
+	kernel.setArg(first + 5, (cl_int)filter.timeFrom);
+	kernel.setArg(first + 6, (cl_int)filter.timeTo);
+}
+
+///
+/// Queues reduce_stats_where over the records that pass filter, the same way EnqueueFusedStats() queues reduce_stats.
+/// Without a filter the plain reduce_stats kernel is used as it only has to read the temperature column.
+///
+PendingStats EnqueueFilteredStats(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, DeviceRecords& records,
+	const RecordFilter& filter, size_t local_size, cl::Event* prof_event = NULL, size_t max_groups = 1024)
+{
+	if (!filter.Any())
+		return EnqueueFusedStats(context, queue, program, records.temperature, records.count, local_size, prof_event, NULL, max_groups);
+
+	cl::Kernel kernel = cl::Kernel(program, "reduce_stats_where");
+	local_size = KernelLocalSize(context, kernel, local_size);
+	size_t nr_groups = std::max((size_t)1, std::min((records.count + local_size - 1) / local_size, max_groups));
+
+	PendingStats pending;
+	pending.partials = cl::Buffer(context, CL_MEM_WRITE_ONLY, nr_groups * sizeof(StatsPartial));
+	pending.results = std::make_shared<std::vector<StatsPartial> >(nr_groups);
+
+	kernel.setArg(0, records.temperature);
+	kernel.setArg(1, records.station);
+	kernel.setArg(2, records.date);
+	kernel.setArg(3, records.time);
+	kernel.setArg(4, (cl_int)records.count);
+	SetFilterArgs(kernel, 5, filter);
+	kernel.setArg(12, pending.partials);
+	kernel.setArg(13, cl::Local(local_size * sizeof(StatsPartial)));
+
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), NULL, prof_event);
+	queue.enqueueReadBuffer(pending.partials, CL_FALSE, 0, nr_groups * sizeof(StatsPartial), &(*pending.results)[0], NULL, &pending.read);
+	queue.flush();
+
+	return pending;
+}
+
+///
+/// Stream compaction of the records that pass filter into new, packed device columns, in their original order.
+/// filter_count counts the matches in each work group's block, scan_counts turns the counts into output offsets
+/// and filter_scatter writes every match to its place. Only the total (one int) is read back, to size the output,
+/// so everything after this only reads and reduces the matching records. The filter's station must be resolved.
+/// The three passes walk the same blocks, so they all run with the smallest work group size any of them allows.
+///
+DeviceRecords CompactRecords(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, DeviceRecords& records,
+	const RecordFilter& filter, size_t local_size, std::vector<cl::Event>* events = NULL, size_t max_groups = 256)
+{
+	cl::Kernel kernel_count = cl::Kernel(program, "filter_count");
+	cl::Kernel kernel_scan = cl::Kernel(program, "scan_counts");
+	cl::Kernel kernel_scatter = cl::Kernel(program, "filter_scatter");
+	local_size = KernelLocalSize(context, kernel_count, KernelLocalSize(context, kernel_scan, KernelLocalSize(context, kernel_scatter, local_size)));
+
+	size_t nr_groups = std::max((size_t)1, std::min((records.count + local_size - 1) / local_size, max_groups));
+	size_t chunk = (records.count + nr_groups - 1) / nr_groups;
+	chunk = std::max((size_t)1, (chunk + local_size - 1) / local_size) * local_size;
+	std::vector<cl::Event> launches(3);
+
+	cl::Buffer counts(context, CL_MEM_READ_WRITE, (nr_groups + 1) * sizeof(cl_int));
+
+	kernel_count.setArg(0, records.station);
+	kernel_count.setArg(1, records.date);
+	kernel_count.setArg(2, records.time);
+	kernel_count.setArg(3, (cl_int)records.count);
+	SetFilterArgs(kernel_count, 4, filter);
+	kernel_count.setArg(11, (cl_int)chunk);
+	kernel_count.setArg(12, counts);
+	kernel_count.setArg(13, cl::Local(local_size * sizeof(cl_int)));
+	queue.enqueueNDRangeKernel(kernel_count, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), NULL, &launches[0]);
+
+	kernel_scan.setArg(0, counts);
+	kernel_scan.setArg(1, (cl_int)nr_groups);
+	kernel_scan.setArg(2, cl::Local(local_size * sizeof(cl_int)));
+	queue.enqueueNDRangeKernel(kernel_scan, cl::NullRange, cl::NDRange(local_size), cl::NDRange(local_size), NULL, &launches[1]);
+
+	cl_int total = 0;
+	queue.enqueueReadBuffer(counts, CL_TRUE, nr_groups * sizeof(cl_int), sizeof(cl_int), &total);
+
+	DeviceRecords compacted;
+	compacted.count = (size_t)total;
+	size_t n = std::max((size_t)1, compacted.count);
+	compacted.temperature = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_int));
+	compacted.station = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_ushort));
+	compacted.date = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_int));
+	compacted.time = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_short));
+
+	kernel_scatter.setArg(0, records.temperature);
+	kernel_scatter.setArg(1, records.station);
+	kernel_scatter.setArg(2, records.date);
+	kernel_scatter.setArg(3, records.time);
+	kernel_scatter.setArg(4, (cl_int)records.count);
+	SetFilterArgs(kernel_scatter, 5, filter);
+	kernel_scatter.setArg(12, (cl_int)chunk);
+	kernel_scatter.setArg(13, counts);
+	kernel_scatter.setArg(14, compacted.temperature);
+	kernel_scatter.setArg(15, compacted.station);
+	kernel_scatter.setArg(16, compacted.date);
+	kernel_scatter.setArg(17, compacted.time);
+	kernel_scatter.setArg(18, cl::Local(local_size * sizeof(cl_int)));
+	if (compacted.count > 0)
+		queue.enqueueNDRangeKernel(kernel_scatter, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), NULL, &launches[2]);
+	else
+		launches.pop_back();
+
+	if (events)
+		events->insert(events->end(), launches.begin(), launches.end());
+	return compacted;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+///
+/// Commands ordered only by the events they wait for, not by when they were queued. With an out-of-order queue the
+/// runtime is free to run any commands whose dependencies are done at the same time, on a device without one the
+/// commands are dealt round robin to several in-order queues, which the event wait lists order across.
+///
+/// Every command has to name what it depends on, so results that feed later commands (such as a reduction's result)
+/// stay in device buffers and the host only waits once, in Finish(), for everything at the end.
+///
+class EventGraph
+{
+public:
+	// One queued command, named for tracing
+	struct Node
+	{
+		cl::Event event;
+		std::string name;
+		std::string category;	// kernel, write, fill or read
+	};
+
+	EventGraph(cl::Context& context, size_t fallback_queues = 3)
+		: next(0)
+	{
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		outOfOrder = (device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+		if (outOfOrder)
+			queues.push_back(cl::CommandQueue(context, CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE));
+		else
+		{
+			for (size_t q = 0; q < std::max((size_t)1, fallback_queues); q++)
+				queues.push_back(cl::CommandQueue(context, CL_QUEUE_PROFILING_ENABLE));
+		}
+	}
+
+	bool OutOfOrder() const { return outOfOrder; }
+	size_t QueueCount() const { return queues.size(); }
+
+	///
+	/// The queue for the next command. Anything queued on it has to wait for its dependencies through a wait list,
+	/// and its event has to go to Add() so Finish() waits for it.
+	///
+	cl::CommandQueue& Queue()
+	{
+		return queues[next++ % queues.size()];
+	}
+
+	void Add(const cl::Event& event, const std::string& name, const std::string& category = "kernel")
+	{
+		Node node = { event, name, category };
+		nodes.push_back(node);
+	}
+
+	const std::vector<Node>& Nodes() const { return nodes; }
+
+	cl::Event Kernel(const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local, const std::vector<cl::Event>& after = std::vector<cl::Event>())
+	{
+		cl::Event event;
+		Queue().enqueueNDRangeKernel(kernel, cl::NullRange, global, local, after.empty() ? NULL : &after, &event);
+		Add(event, kernel.getInfo<CL_KERNEL_FUNCTION_NAME>());
+		return event;
+	}
+
+	template <typename T>
+	cl::Event Fill(cl::Buffer& buffer, T value, size_t size, const std::vector<cl::Event>& after = std::vector<cl::Event>())
+	{
+		cl::Event event;
+		Queue().enqueueFillBuffer(buffer, value, 0, size, after.empty() ? NULL : &after, &event);
+		Add(event, "fill", "fill");
+		return event;
+	}
+
+	// Non-blocking, ptr must stay valid (and unchanged) until Finish()
+	cl::Event Write(cl::Buffer& buffer, size_t size, const void* ptr, const std::vector<cl::Event>& after = std::vector<cl::Event>())
+	{
+		cl::Event event;
+		Queue().enqueueWriteBuffer(buffer, CL_FALSE, 0, size, ptr, after.empty() ? NULL : &after, &event);
+		Add(event, "upload", "write");
+		return event;
+	}
+
+	// Non-blocking, ptr must stay valid until Finish()
+	cl::Event Read(cl::Buffer& buffer, size_t size, void* ptr, const std::vector<cl::Event>& after = std::vector<cl::Event>())
+	{
+		cl::Event event;
+		Queue().enqueueReadBuffer(buffer, CL_FALSE, 0, size, ptr, after.empty() ? NULL : &after, &event);
+		Add(event, "read", "read");
+		return event;
+	}
+
+	///
+	/// Submits everything and waits for all of it, the one point the host blocks on
+	///
+	void Finish()
+	{
+		for (size_t q = 0; q < queues.size(); q++)
+			queues[q].flush();
+		std::vector<cl::Event> events;
+		for (size_t i = 0; i < nodes.size(); i++)
+			events.push_back(nodes[i].event);
+		if (!events.empty())
+			cl::Event::waitForEvents(events);
+	}
+
+	///
+	/// Time from the first command starting to the last one ending [ns], after Finish(). Less than the sum of the
+	/// commands' own times when some of them overlapped.
+	///
+	cl_ulong Span() const
+	{
+		cl_ulong start = 0, end = 0;
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			cl_ulong s = nodes[i].event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			cl_ulong e = nodes[i].event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+			if (i == 0 || s < start) start = s;
+			if (i == 0 || e > end) end = e;
+		}
+		return end - start;
+	}
+
+	// Sum of every command's own time [ns], after Finish()
+	cl_ulong Busy() const
+	{
+		cl_ulong total = 0;
+		for (size_t i = 0; i < nodes.size(); i++)
+			total += nodes[i].event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - nodes[i].event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		return total;
+	}
+
+private:
+	std::vector<cl::CommandQueue> queues;
+	std::vector<Node> nodes;
+	size_t next;
+	bool outOfOrder;
+};
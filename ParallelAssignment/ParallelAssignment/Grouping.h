@@ -0,0 +1,199 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Parser.h"
+#include "Statistics.h"
+#include "DeviceRecords.h"
+
+// Columns to group by, combined as a mask (must match GROUP_BY_* in my_kernels3.cl)
+enum GroupBy { GROUP_BY_STATION = 1, GROUP_BY_YEAR = 2, GROUP_BY_MONTH = 4 };
+
+const size_t GROUP_FIELDS = 7;	// count, min, max, sum lo/hi, sum of squares lo/hi per key in the local table
+
+///
+/// Parses a comma separated list such as "station,year" into a GroupBy mask, -1 if a column isn't recognised
+///
+int ParseGroupBy(const std::string& list)
+{
+	int groupBy = 0;
+	std::stringstream stream(list);
+	std::string item;
+	while (std::getline(stream, item, ','))
+	{
+		if (item == "station") groupBy |= GROUP_BY_STATION;
+		else if (item == "year") groupBy |= GROUP_BY_YEAR;
+		else if (item == "month") groupBy |= GROUP_BY_MONTH;
+		else return -1;
+	}
+	return groupBy;
+}
+
+///
+/// One key's totals from group_stats_merge, must match the struct in my_kernels3.cl
+///
+struct GroupTotals
+{
+	cl_long sum;
+	cl_long sumSquares;
+	cl_int count;
+	cl_int min;
+	cl_int max;
+	cl_int pad;
+};
+
+///
+/// One row of the grouped table, the columns that weren't grouped by are -1
+///
+struct GroupRow
+{
+	int station;
+	int year;
+	int month;
+	Stats stats;
+};
+
+struct GroupedStats
+{
+	int groupBy;
+	std::vector<GroupRow> rows;
+	size_t passes;					// more than one when the keys didn't all fit in local memory at once
+	std::vector<cl::Event> events;	// every launch, for profiling
+	std::vector<cl::Event> reads;	// every pass's totals read back, for tracing
+
+	cl_ulong ExecutionTime() const
+	{
+		cl_ulong total = 0;
+		for (size_t i = 0; i < events.size(); i++)
+			total += events[i].getProfilingInfo<CL_PROFILING_COMMAND_END>() - events[i].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		return total;
+	}
+};
+
+///
+/// Statistics for every station/year/month combination in groupBy that has any records, as a keyed reduction over the
+/// device resident columns. group_stats_local makes one pass over the data with a table of exact integer totals per key
+/// in local memory, group_stats_merge then adds up the work groups' tables with one work item per key, so only one
+/// row per key is read back. If the key space is bigger than local memory it is done in windows, one pass each.
+/// records only sets the key space (stations and years), device can hold a subset of them such as CompactRecords() returns.
+///
+GroupedStats RunGroupedStats(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, DeviceRecords& device,
+	const WeatherData& records, int groupBy, size_t local_size, size_t max_groups = 256)
+{
+	GroupedStats grouped;
+	grouped.groupBy = groupBy;
+	grouped.passes = 0;
+	if (device.count == 0)
+		return grouped;
+
+	std::pair<const int*, const int*> dates = std::minmax_element(records.date.begin(), records.date.end());
+	int minYear = *dates.first / 10000;
+	int nYears = *dates.second / 10000 - minYear + 1;
+	int nStations = (int)std::max((size_t)1, records.stations.size());
+
+	size_t nkeys = 1;
+	if (groupBy & GROUP_BY_STATION) nkeys *= nStations;
+	if (groupBy & GROUP_BY_YEAR) nkeys *= nYears;
+	if (groupBy & GROUP_BY_MONTH) nkeys *= 12;
+
+	cl::Device dev = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	size_t window = std::max((size_t)1, std::min(nkeys, (size_t)dev.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / (GROUP_FIELDS * sizeof(cl_uint))));
+	cl::Kernel kernel_local = cl::Kernel(program, "group_stats_local");
+	cl::Kernel kernel_merge = cl::Kernel(program, "group_stats_merge");
+	size_t merge_size = KernelLocalSize(context, kernel_merge, local_size);
+	local_size = KernelLocalSize(context, kernel_local, local_size);
+	size_t nr_groups = std::max((size_t)1, std::min((device.count + local_size - 1) / local_size, max_groups));
+
+	cl::Buffer partials(context, CL_MEM_READ_WRITE, nr_groups * GROUP_FIELDS * window * sizeof(cl_uint));
+	cl::Buffer totals(context, CL_MEM_WRITE_ONLY, window * sizeof(GroupTotals));
+	std::vector<GroupTotals> results(nkeys);
+
+	kernel_local.setArg(0, device.temperature);
+	kernel_local.setArg(1, device.station);
+	kernel_local.setArg(2, device.date);
+	kernel_local.setArg(3, (cl_int)device.count);
+	kernel_local.setArg(4, (cl_int)groupBy);
+	kernel_local.setArg(5, (cl_int)minYear);
+	kernel_local.setArg(6, (cl_int)nYears);
+	kernel_local.setArg(9, partials);
+
+	kernel_merge.setArg(0, partials);
+	kernel_merge.setArg(1, (cl_int)nr_groups);
+	kernel_merge.setArg(3, totals);
+
+	for (size_t keyFrom = 0; keyFrom < nkeys; keyFrom += window)
+	{
+		size_t keys = std::min(window, nkeys - keyFrom);
+		kernel_local.setArg(7, (cl_int)keyFrom);
+		kernel_local.setArg(8, (cl_int)keys);
+		kernel_local.setArg(10, cl::Local(GROUP_FIELDS * keys * sizeof(cl_uint)));
+		kernel_merge.setArg(2, (cl_int)keys);
+
+		grouped.events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel_local, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), NULL, &grouped.events.back());
+		grouped.events.push_back(cl::Event());
+		size_t merge_local = std::min(merge_size, keys);
+		queue.enqueueNDRangeKernel(kernel_merge, cl::NullRange, cl::NDRange(((keys + merge_local - 1) / merge_local) * merge_local), cl::NDRange(merge_local), NULL, &grouped.events.back());
+		grouped.reads.push_back(cl::Event());
+		queue.enqueueReadBuffer(totals, CL_TRUE, 0, keys * sizeof(GroupTotals), &results[keyFrom], NULL, &grouped.reads.back());
+		grouped.passes++;
+	}
+
+	// Unpack the keys in the same order the kernel packed them
+	for (size_t key = 0; key < nkeys; key++)
+	{
+		const GroupTotals& t = results[key];
+		if (t.count == 0)
+			continue;
+
+		GroupRow row;
+		size_t rest = key;
+		row.month = (groupBy & GROUP_BY_MONTH) ? (int)(rest % 12) + 1 : -1;
+		if (groupBy & GROUP_BY_MONTH) rest /= 12;
+		row.year = (groupBy & GROUP_BY_YEAR) ? (int)(rest % nYears) + minYear : -1;
+		if (groupBy & GROUP_BY_YEAR) rest /= nYears;
+		row.station = (groupBy & GROUP_BY_STATION) ? (int)rest : -1;
+
+		double mean = (double)t.sum / t.count;
+		double m2 = (double)t.sumSquares - (double)t.sum * mean;
+		row.stats.merge((size_t)t.count, t.min, t.max, mean, std::max(0.0, m2));
+		grouped.rows.push_back(row);
+	}
+	return grouped;
+}
+
+///
+/// The grouped statistics as a text table, one row per group
+///
+std::string FormatGroupTable(const GroupedStats& grouped, const WeatherData& records)
+{
+	std::stringstream out;
+	out << std::fixed << std::setprecision(2);
+
+	if (grouped.groupBy & GROUP_BY_STATION) out << std::left << std::setw(16) << "Station" << std::right;
+	if (grouped.groupBy & GROUP_BY_YEAR) out << std::setw(6) << "Year";
+	if (grouped.groupBy & GROUP_BY_MONTH) out << std::setw(6) << "Month";
+	out << std::setw(10) << "Count" << std::setw(9) << "Min" << std::setw(9) << "Max" << std::setw(9) << "Mean";
+	out << std::setw(10) << "Variance" << std::setw(9) << "Std Dev" << std::endl;
+
+	for (size_t i = 0; i < grouped.rows.size(); i++)
+	{
+		const GroupRow& row = grouped.rows[i];
+		if (grouped.groupBy & GROUP_BY_STATION) out << std::left << std::setw(16) << records.stations[row.station] << std::right;
+		if (grouped.groupBy & GROUP_BY_YEAR) out << std::setw(6) << row.year;
+		if (grouped.groupBy & GROUP_BY_MONTH) out << std::setw(6) << row.month;
+		out << std::setw(10) << row.stats.count << std::setw(9) << row.stats.Min() << std::setw(9) << row.stats.Max();
+		out << std::setw(9) << row.stats.Mean() << std::setw(10) << row.stats.Variance() << std::setw(9) << row.stats.StdDev() << std::endl;
+	}
+	return out.str();
+}
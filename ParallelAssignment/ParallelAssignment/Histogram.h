@@ -0,0 +1,141 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+
+///
+/// Summary of a histogram: approximate percentiles (in the order they were asked for) and the mode, in degrees
+///
+struct HistogramSummary
+{
+	std::vector<float> percentiles;
+	float mode;
+	cl_uint modeCount;
+};
+
+///
+/// Counts of values (* 100) in bins of binWidth starting at minValue, as built by the histogram_local kernel.
+/// Kept on the host so any number of queries can be answered without going back to the device.
+///
+struct Histogram
+{
+	int minValue;
+	int binWidth;
+	size_t count;
+	std::vector<cl_uint> bins;
+	cl::Event fill, read;	// the bins cleared on the device and read back, for tracing
+
+	// Lowest value that falls in bin b, * 100
+	int BinValue(size_t b) const { return minValue + (int)b * binWidth; }
+
+	///
+	/// Works out every requested percentile and the mode in a single walk over the bins.
+	/// Percentiles use the same linear interpolation between ranks as ReadPercentile() in Sort.h, each rank
+	/// is taken as the value its bin starts at. With the default 0.1 degree bins this is the exact value, as the
+	/// data only has one decimal place, wider bins make it an approximation to within one bin.
+	///
+	HistogramSummary Summarise(const std::vector<double>& percentiles) const
+	{
+		HistogramSummary summary;
+		summary.mode = 0.0f;
+		summary.modeCount = 0;
+		summary.percentiles.assign(percentiles.size(), 0.0f);
+		if (count == 0)
+			return summary;
+
+		// Every percentile needs the values at two ranks, collect them all and visit them in rank order
+		struct RankQuery { size_t rank; size_t percentile; bool upper; };
+		std::vector<RankQuery> queries;
+		std::vector<double> positions(percentiles.size());
+		for (size_t i = 0; i < percentiles.size(); i++)
+		{
+			positions[i] = std::min(std::max(percentiles[i], 0.0), 100.0) / 100.0 * (count - 1);
+			size_t lower = (size_t)std::floor(positions[i]);
+			RankQuery lo = { lower, i, false };
+			RankQuery hi = { std::min(lower + 1, count - 1), i, true };
+			queries.push_back(lo);
+			queries.push_back(hi);
+		}
+		std::sort(queries.begin(), queries.end(), [](const RankQuery& a, const RankQuery& b) { return a.rank < b.rank; });
+
+		std::vector<int> lowerValue(percentiles.size()), upperValue(percentiles.size());
+		size_t next = 0;
+		size_t cumulative = 0;
+		for (size_t b = 0; b < bins.size(); b++)
+		{
+			cumulative += bins[b];
+			while (next < queries.size() && queries[next].rank < cumulative)
+			{
+				(queries[next].upper ? upperValue : lowerValue)[queries[next].percentile] = BinValue(b);
+				next++;
+			}
+
+			if (bins[b] > summary.modeCount)
+			{
+				summary.modeCount = bins[b];
+				summary.mode = BinValue(b) / 100.0f;
+			}
+		}
+
+		for (size_t i = 0; i < percentiles.size(); i++)
+		{
+			double fraction = positions[i] - std::floor(positions[i]);
+			summary.percentiles[i] = (float)((lowerValue[i] + (upperValue[i] - lowerValue[i]) * fraction) / 100.0);
+		}
+		return summary;
+	}
+};
+
+///
+/// Builds a histogram of the first N values of input, which must all be within [minValue, maxValue] (* 100).
+/// Bins are binWidth wide (10 = 0.1 degrees), if that many bins won't fit in the device's local memory the
+/// width is doubled until they do. compact means input holds 16 bit values, which histogram_local16 counts instead.
+///
+Histogram RunHistogram(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, cl::Buffer& input, size_t N,
+	int minValue, int maxValue, size_t local_size, cl::Event* prof_event = NULL, int binWidth = 10, size_t max_groups = 1024,
+	bool compact = false)
+{
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	size_t local_memory = (size_t)device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+	Histogram histogram;
+	histogram.minValue = minValue;
+	histogram.binWidth = binWidth;
+	histogram.count = N;
+	size_t nbins = (size_t)(maxValue - minValue) / binWidth + 1;
+	while (nbins * sizeof(cl_uint) > local_memory)
+	{
+		histogram.binWidth *= 2;
+		nbins = (size_t)(maxValue - minValue) / histogram.binWidth + 1;
+	}
+	histogram.bins.resize(nbins);
+
+	cl::Kernel kernel = cl::Kernel(program, compact ? "histogram_local16" : "histogram_local");
+	local_size = KernelLocalSize(context, kernel, local_size);
+	size_t nr_groups = std::max((size_t)1, std::min((N + local_size - 1) / local_size, max_groups));
+
+	cl::Buffer buffer_bins(context, CL_MEM_READ_WRITE, nbins * sizeof(cl_uint));
+	queue.enqueueFillBuffer(buffer_bins, (cl_uint)0, 0, nbins * sizeof(cl_uint), NULL, &histogram.fill);
+
+	kernel.setArg(0, input);
+	kernel.setArg(1, (cl_int)N);
+	kernel.setArg(2, (cl_int)minValue);
+	kernel.setArg(3, (cl_int)histogram.binWidth);
+	kernel.setArg(4, (cl_int)nbins);
+	kernel.setArg(5, buffer_bins);
+	kernel.setArg(6, cl::Local(nbins * sizeof(cl_uint)));
+
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), NULL, prof_event);
+	queue.enqueueReadBuffer(buffer_bins, CL_TRUE, 0, nbins * sizeof(cl_uint), &histogram.bins[0], NULL, &histogram.read);
+
+	return histogram;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Parser.h"
+
+///
+/// Whether the device works out of host memory (a CPU, or a GPU on the same die), where a buffer wrapped around
+/// host memory is used in place and an upload is only a redundant copy
+///
+bool SharesHostMemory(const cl::Device& device)
+{
+	return device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU || device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+}
+
+///
+/// A device buffer holding column. With zeroCopy it is wrapped around the column's own memory (page aligned, or the
+/// binary cache's mapping for a column loaded from it) with CL_MEM_USE_HOST_PTR, so nothing is uploaded and the column
+/// must outlive the buffer and only be read by the host through a HostMapping while the device may use it. Otherwise
+/// the column is copied into a new buffer, upload (optional) receives the event of that copy.
+///
+template <typename T>
+cl::Buffer ColumnBuffer(cl::Context& context, cl::CommandQueue& queue, Column<T>& column, bool zeroCopy,
+	cl_mem_flags flags = CL_MEM_READ_WRITE, cl::Event* upload = NULL)
+{
+	size_t bytes = column.size() * sizeof(T);
+	if (zeroCopy)
+		return cl::Buffer(context, flags | CL_MEM_USE_HOST_PTR, column.Bytes(), column.data());
+
+	cl::Buffer buffer(context, flags, bytes);
+	queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, bytes, column.data(), NULL, upload);
+	return buffer;
+}
+
+///
+/// Maps the first bytes of a buffer for the host for as long as this lives and unmaps it after. For a ColumnBuffer()
+/// on a device that shares host memory the mapping is the column itself, so nothing is copied either way.
+///
+struct HostMapping
+{
+	cl::CommandQueue queue;
+	cl::Buffer buffer;
+	void* ptr;
+
+	HostMapping(cl::CommandQueue& queue, cl::Buffer& buffer, size_t bytes, cl_map_flags flags = CL_MAP_READ)
+		: queue(queue), buffer(buffer)
+	{
+		ptr = queue.enqueueMapBuffer(buffer, CL_TRUE, flags, 0, bytes);
+	}
+
+	~HostMapping()
+	{
+		cl::Event unmapped;
+		queue.enqueueUnmapMemObject(buffer, ptr, NULL, &unmapped);
+		unmapped.wait();
+	}
+
+private:
+	HostMapping(const HostMapping&);
+	HostMapping& operator=(const HostMapping&);
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+#include "Statistics.h"
+#include "Parser.h"
+#include "ProgramCache.h"
+#include "Tuning.h"
+
+///
+/// One device taking part in a multi-device run, with its own context, queue and program
+///
+struct DeviceShare
+{
+	int platform_id;
+	int device_id;
+	std::string name;
+	cl::Context context;
+	cl::CommandQueue queue;
+	cl::Program program;
+	size_t local_size;		// local_size, or less if that is more than the device allows
+
+	double throughput;		// values per ns measured on the calibration sample
+	size_t offset;			// this device's slice of the data
+	size_t count;
+	cl::Buffer input;
+	cl::Event write, kernel;
+	PendingStats pending;
+	Stats stats;
+};
+
+///
+/// Every (platform, device) pair on the machine, or only those on platform_id if it isn't -1
+///
+std::vector<std::pair<int, int> > GetDeviceIds(int platform_id = -1)
+{
+	std::vector<std::pair<int, int> > ids;
+	vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+
+	for (unsigned int i = 0; i < platforms.size(); i++)
+	{
+		if (platform_id != -1 && (int)i != platform_id)
+			continue;
+
+		vector<cl::Device> devices;
+		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+		for (unsigned int j = 0; j < devices.size(); j++)
+			ids.push_back(std::make_pair((int)i, (int)j));
+	}
+	return ids;
+}
+
+///
+/// Splits data across every device returned by GetDeviceIds(platform_id) and merges their statistics.
+///
+/// Each device first reduces the same calibration sample to measure its upload + kernel throughput, then gets
+/// a contiguous slice of the data in proportion to it. All slices are uploaded and reduced at once (non-blocking,
+/// one queue per device) and the per-device min/max/mean/m2 are merged on the host with Stats::merge.
+/// Devices whose program fails to build are left out. The per-device timings stay in the returned shares.
+/// local_size is the largest work group size used, a device that allows less uses the most it allows.
+///
+std::vector<DeviceShare> RunMultiDevice(const TemperatureColumn& data, size_t N, size_t local_size, Stats& total, int platform_id = -1,
+	size_t calibration_size = 1 << 18)
+{
+	std::vector<DeviceShare> shares;
+	std::vector<std::pair<int, int> > ids = GetDeviceIds(platform_id);
+
+	for (size_t i = 0; i < ids.size(); i++)
+	{
+		DeviceShare share;
+		share.platform_id = ids[i].first;
+		share.device_id = ids[i].second;
+		share.name = GetPlatformName(share.platform_id) + ", " + GetDeviceName(share.platform_id, share.device_id);
+		share.context = GetContext(share.platform_id, share.device_id);
+		share.queue = cl::CommandQueue(share.context, CL_QUEUE_PROFILING_ENABLE);
+		share.local_size = std::min(local_size, DeviceLocalSize(share.context.getInfo<CL_CONTEXT_DEVICES>()[0], sizeof(StatsPartial)));
+
+		try
+		{
+			share.program = BuildProgram(share.context, "my_kernels3.cl");
+		}
+		catch (const cl::Error&)
+		{
+			std::cerr << "Skipping " << share.name << ", the kernels failed to build" << std::endl;
+			continue;
+		}
+		shares.push_back(share);
+	}
+
+	if (shares.empty() || N == 0)
+		return shares;
+
+	// Calibration - time the same sample on every device, one at a time so they don't slow each other down
+	size_t sample = std::min(N, calibration_size);
+	double totalThroughput = 0.0;
+	for (size_t i = 0; i < shares.size(); i++)
+	{
+		DeviceShare& share = shares[i];
+		cl::Buffer buffer(share.context, CL_MEM_READ_ONLY, sample * sizeof(cl_int));
+		cl::Event write, kernel;
+		share.queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, sample * sizeof(cl_int), &data[0], NULL, &write);
+		RunFusedStats(share.context, share.queue, share.program, buffer, sample, share.local_size, &kernel);
+
+		cl_ulong time = std::max((cl_ulong)1, GetExecutionTime(write) + GetExecutionTime(kernel));
+		share.throughput = (double)sample / time;
+		totalThroughput += share.throughput;
+	}
+
+	// Split the data in proportion to throughput, the last device takes whatever rounding leaves over
+	size_t offset = 0;
+	for (size_t i = 0; i < shares.size(); i++)
+	{
+		DeviceShare& share = shares[i];
+		share.offset = offset;
+		share.count = (i + 1 == shares.size()) ? N - offset : std::min(N - offset, (size_t)(N * (share.throughput / totalThroughput)));
+		offset += share.count;
+	}
+
+	// Queue every device's upload and reduction before waiting on any of them so they all run at the same time
+	for (size_t i = 0; i < shares.size(); i++)
+	{
+		DeviceShare& share = shares[i];
+		if (share.count == 0)
+			continue;
+
+		share.input = cl::Buffer(share.context, CL_MEM_READ_ONLY, share.count * sizeof(cl_int));
+		share.queue.enqueueWriteBuffer(share.input, CL_FALSE, 0, share.count * sizeof(cl_int), &data[share.offset], NULL, &share.write);
+		std::vector<cl::Event> uploaded(1, share.write);
+		share.pending = EnqueueFusedStats(share.context, share.queue, share.program, share.input, share.count, share.local_size, &share.kernel, &uploaded);
+	}
+
+	for (size_t i = 0; i < shares.size(); i++)
+	{
+		if (shares[i].count == 0)
+			continue;
+
+		shares[i].stats = shares[i].pending.Finish();
+		total.merge(shares[i].stats);
+	}
+
+	return shares;
+}
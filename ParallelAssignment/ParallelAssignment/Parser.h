@@ -0,0 +1,796 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <stdexcept>
+#include <exception>
+#include <limits>
+#include <new>
+#include <cstdlib>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+///
+/// Allocator for the columns a device can use in place (see HostBuffer.h). Every allocation starts on a page and is
+/// padded to a whole number of 64 byte cache lines, which is what CPU and integrated GPU runtimes want before they
+/// will wrap host memory in a buffer without copying it.
+///
+template <typename T>
+struct PageAllocator
+{
+	typedef T value_type;
+
+	static const size_t PAGE_SIZE = 4096;
+
+	// Bytes actually allocated for bytes, a buffer over the memory can be this long
+	static size_t PaddedSize(size_t bytes) { return std::max((size_t)64, (bytes + 63) / 64 * 64); }
+
+	PageAllocator() {}
+	template <typename U> PageAllocator(const PageAllocator<U>&) {}
+
+	T* allocate(size_t n)
+	{
+		void* p = NULL;
+#ifdef _WIN32
+		p = _aligned_malloc(PaddedSize(n * sizeof(T)), PAGE_SIZE);
+#else
+		if (posix_memalign(&p, PAGE_SIZE, PaddedSize(n * sizeof(T))) != 0)
+			p = NULL;
+#endif
+		if (!p)
+			throw std::bad_alloc();
+		return (T*)p;
+	}
+
+	void deallocate(T* p, size_t)
+	{
+#ifdef _WIN32
+		_aligned_free(p);
+#else
+		free(p);
+#endif
+	}
+};
+
+template <typename T, typename U> bool operator==(const PageAllocator<T>&, const PageAllocator<U>&) { return true; }
+template <typename T, typename U> bool operator!=(const PageAllocator<T>&, const PageAllocator<U>&) { return false; }
+
+///
+/// Memory mapping of a whole file. The mapping is released when the object goes out of scope.
+/// Mapping the file lets the parser threads work directly on the page cache with no intermediate copy or getline buffer.
+/// It is read-only, or with copyOnWrite private and writable: pages written to are copied and the file never changes.
+///
+class MappedFile
+{
+public:
+	MappedFile(const std::string& filename, bool copyOnWrite = false) : bytes(NULL), length(0), writable(copyOnWrite)
+	{
+#ifdef _WIN32
+		fileHandle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		mapHandle = NULL;
+		if (fileHandle == INVALID_HANDLE_VALUE)
+			throw std::runtime_error("Unable to open " + filename);
+
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(fileHandle, &fileSize);
+		length = (size_t)fileSize.QuadPart;
+
+		// Windows refuses to map an empty file, so leave bytes as NULL in that case
+		if (length > 0)
+		{
+			mapHandle = CreateFileMappingA(fileHandle, NULL, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+			if (mapHandle != NULL)
+				bytes = (const char*)MapViewOfFile(mapHandle, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+			if (bytes == NULL)
+			{
+				close();
+				throw std::runtime_error("Unable to map " + filename);
+			}
+		}
+#else
+		fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("Unable to open " + filename);
+
+		struct stat st;
+		fstat(fd, &st);
+		length = (size_t)st.st_size;
+
+		if (length > 0)
+		{
+			void* mapping = mmap(NULL, length, PROT_READ | (copyOnWrite ? PROT_WRITE : 0), MAP_PRIVATE, fd, 0);
+			if (mapping == MAP_FAILED)
+			{
+				close();
+				throw std::runtime_error("Unable to map " + filename);
+			}
+			bytes = (const char*)mapping;
+			madvise(mapping, length, MADV_SEQUENTIAL);
+		}
+#endif
+	}
+
+	~MappedFile() { close(); }
+
+	const char* data() const { return bytes; }
+	size_t size() const { return length; }
+
+	// The mapping for writing, NULL unless it was made copyOnWrite
+	char* writableData() const { return writable ? (char*)bytes : NULL; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	void close()
+	{
+#ifdef _WIN32
+		if (bytes) UnmapViewOfFile(bytes);
+		if (mapHandle) CloseHandle(mapHandle);
+		if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+		mapHandle = NULL;
+		fileHandle = INVALID_HANDLE_VALUE;
+#else
+		if (bytes) munmap((void*)bytes, length);
+		if (fd >= 0) ::close(fd);
+		fd = -1;
+#endif
+		bytes = NULL;
+	}
+
+	const char* bytes;
+	size_t length;
+	bool writable;
+#ifdef _WIN32
+	HANDLE fileHandle;
+	HANDLE mapHandle;
+#else
+	int fd;
+#endif
+};
+
+///
+/// A column of parsed values in memory the device can use in place. It either owns its values (page aligned, see
+/// PageAllocator) or is a view of a column in a copy-on-write MappedFile (see readCache()), sharing ownership of the
+/// mapping so nothing is copied out of it. A view can still be written and shrunk in place, growing one copies it into
+/// memory of its own first. Copying a Column always copies the values.
+///
+template <typename T>
+class Column
+{
+public:
+	typedef T value_type;
+	typedef T* iterator;
+	typedef const T* const_iterator;
+
+	Column() : view(NULL), count(0) {}
+	explicit Column(size_t n) : owned(n), view(NULL), count(0) {}
+	template <typename It> Column(It first, It last) : owned(first, last), view(NULL), count(0) {}
+
+	// A view of count values starting offset bytes into mapping, which has to be copyOnWrite
+	Column(const std::shared_ptr<MappedFile>& mapping, size_t offset, size_t count)
+		: view((T*)(mapping->writableData() + offset)), count(count), mapping(mapping) {}
+
+	Column(const Column& other) : owned(other.begin(), other.end()), view(NULL), count(0) {}
+	Column(Column&& other) : owned(std::move(other.owned)), view(other.view), count(other.count), mapping(std::move(other.mapping))
+	{
+		other.view = NULL;
+		other.count = 0;
+	}
+
+	Column& operator=(Column other)
+	{
+		owned.swap(other.owned);
+		std::swap(view, other.view);
+		std::swap(count, other.count);
+		mapping.swap(other.mapping);
+		return *this;
+	}
+
+	bool Mapped() const { return view != NULL; }
+
+	size_t size() const { return view ? count : owned.size(); }
+	bool empty() const { return size() == 0; }
+	T* data() { return view ? view : owned.data(); }
+	const T* data() const { return view ? view : owned.data(); }
+	T& operator[](size_t i) { return data()[i]; }
+	const T& operator[](size_t i) const { return data()[i]; }
+	iterator begin() { return data(); }
+	iterator end() { return data() + size(); }
+	const_iterator begin() const { return data(); }
+	const_iterator end() const { return data() + size(); }
+
+	void resize(size_t n)
+	{
+		if (view && n <= count)
+			count = n;
+		else
+		{
+			Own();
+			owned.resize(n);
+		}
+	}
+
+	void push_back(const T& value)
+	{
+		Own();
+		owned.push_back(value);
+	}
+
+	// Bytes a buffer wrapped around the values may span, owned columns are padded out (see PageAllocator)
+	size_t Bytes() const
+	{
+		return view ? std::max(sizeof(T), count * sizeof(T)) : PageAllocator<T>::PaddedSize(owned.size() * sizeof(T));
+	}
+
+private:
+	void Own()
+	{
+		if (!view)
+			return;
+		owned.assign(view, view + count);
+		view = NULL;
+		count = 0;
+		mapping.reset();
+	}
+
+	std::vector<T, PageAllocator<T> > owned;
+	T* view;
+	size_t count;
+	std::shared_ptr<MappedFile> mapping;
+};
+
+// The temperatures (degrees * 100), in page aligned memory so the device can work on them where they were parsed
+typedef Column<int> TemperatureColumn;
+
+///
+/// Parses a decimal number such as "-12.3" into a fixed-point int holding the value * 100.
+/// Unlike (int)(std::stof(x) * 100) there is no float round trip, so "17.3" is exactly 1730 rather than 1729.
+/// Any digits past the second decimal place are dropped (truncated towards zero like the int cast).
+/// p is left pointing at the first character after the number.
+///
+inline int parseFixedPoint(const char*& p, const char* end)
+{
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = (*p == '-');
+		p++;
+	}
+
+	int value = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+		value = value * 10 + (*p++ - '0');
+
+	int decimals = 0;
+	if (p < end && *p == '.')
+	{
+		p++;
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			if (decimals < 2)
+			{
+				value = value * 10 + (*p - '0');
+				decimals++;
+			}
+			p++;
+		}
+	}
+	for (; decimals < 2; decimals++)
+		value *= 10;
+
+	return negative ? -value : value;
+}
+
+///
+/// Splits the range [begin, end) into (at most) n chunks of roughly equal size, moving each split point
+/// forward to just past the next newline so that no line is shared between two chunks.
+/// Returns n + 1 offsets, chunk i is [offsets[i], offsets[i + 1]).
+///
+inline std::vector<size_t> splitOnLines(const char* begin, size_t size, size_t n)
+{
+	std::vector<size_t> offsets(n + 1, size);
+	offsets[0] = 0;
+
+	for (size_t i = 1; i < n; i++)
+	{
+		size_t pos = std::max(size * i / n, offsets[i - 1]);
+		while (pos > 0 && pos < size && begin[pos - 1] != '\n')
+			pos++;
+		offsets[i] = pos;
+	}
+	return offsets;
+}
+
+///
+/// Counts the records in a chunk. A record is any line that doesn't start with whitespace,
+/// so blank lines and a trailing newline at the end of the file are skipped, the same as parseTemperatures() does.
+///
+inline bool isRecordStart(char c)
+{
+	return c != '\n' && c != '\r' && c != ' ';
+}
+
+inline size_t countRecords(const char* p, const char* end)
+{
+	size_t count = 0;
+	bool lineStart = true;
+	for (; p < end; p++)
+	{
+		if (lineStart)
+			count += isRecordStart(*p);
+		lineStart = (*p == '\n');
+	}
+	return count;
+}
+
+///
+/// Thrown by parseTemperatures() for a value that doesn't fit the column's type, so a 16 bit read can fall back to
+/// ints without mistaking any other error for it
+///
+struct ValueRangeError : std::runtime_error
+{
+	explicit ValueRangeError(const std::string& message) : std::runtime_error(message) {}
+};
+
+///
+/// Parses the 6th column (air temperature) of every line in [p, end) and writes it to out.
+/// Returns the number of values written, which will equal countRecords() for the same chunk.
+/// T is int, or short for the compact 16 bit storage, where a value that doesn't fit throws.
+///
+template <typename T>
+inline size_t parseTemperatures(const char* p, const char* end, T* out)
+{
+	T* start = out;
+	while (p < end)
+	{
+		const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+		if (lineEnd == NULL)
+			lineEnd = end;
+
+		if (!isRecordStart(*p))
+		{
+			p = lineEnd + 1;
+			continue;
+		}
+
+		// Skip the first 5 columns (station, year, month, day, time)
+		const char* field = p;
+		int spaceCount = 0;
+		while (field < lineEnd && spaceCount < 5)
+		{
+			if (*field++ == ' ')
+				spaceCount++;
+		}
+
+		if (spaceCount < 5)
+			throw std::runtime_error("Malformed line: " + std::string(p, lineEnd));
+
+		int value = parseFixedPoint(field, lineEnd);
+		if (value < std::numeric_limits<T>::min() || value > std::numeric_limits<T>::max())
+			throw ValueRangeError("Value too large for the storage type: " + std::string(p, lineEnd));
+		*out++ = (T)value;
+
+		p = lineEnd + 1;
+	}
+	return out - start;
+}
+
+///
+/// One parsed weather record per index, stored column by column.
+/// Station names are dictionary encoded: station[i] is an index into stations.
+///
+struct WeatherData
+{
+	std::vector<std::string> stations;
+	Column<unsigned short> station;
+	Column<int> date;               // yyyymmdd
+	Column<short> time;             // HHMM
+	TemperatureColumn temperature;  // degrees * 100
+
+	size_t size() const { return temperature.size(); }
+
+	void resize(size_t n)
+	{
+		station.resize(n);
+		date.resize(n);
+		time.resize(n);
+		temperature.resize(n);
+	}
+};
+
+///
+/// Which records a statistic covers: one station (or any), an inclusive date range, an inclusive month range (so
+/// "summer" can span every year) and an inclusive time of day range
+///
+struct RecordFilter
+{
+	std::string stationName;	// empty for every station
+	int station;				// stationName's index in WeatherData::stations once resolved, -1 for every station, -2 for none
+	int dateFrom;				// yyyymmdd
+	int dateTo;
+	int monthFrom;
+	int monthTo;
+	int timeFrom;				// HHMM
+	int timeTo;
+
+	RecordFilter() : station(-1), dateFrom(0), dateTo(99999999), monthFrom(1), monthTo(12), timeFrom(0), timeTo(2359) {}
+
+	bool Any() const
+	{
+		return !stationName.empty() || dateFrom != 0 || dateTo != 99999999 || monthFrom != 1 || monthTo != 12 || timeFrom != 0 || timeTo != 2359;
+	}
+
+	///
+	/// Looks stationName up in a station dictionary, a name that isn't there matches nothing
+	///
+	void ResolveStation(const std::vector<std::string>& stations)
+	{
+		if (stationName.empty())
+		{
+			station = -1;
+			return;
+		}
+		std::vector<std::string>::const_iterator it = std::find(stations.begin(), stations.end(), stationName);
+		station = it == stations.end() ? -2 : (int)(it - stations.begin());
+	}
+
+	// Everything except the station, which the parser checks once per name rather than once per record
+	bool MatchesDateTime(int recordDate, int recordTime) const
+	{
+		int month = recordDate / 100 % 100;
+		return recordDate >= dateFrom && recordDate <= dateTo && month >= monthFrom && month <= monthTo &&
+			recordTime >= timeFrom && recordTime <= timeTo;
+	}
+
+	bool Matches(int recordStation, int recordDate, int recordTime) const
+	{
+		return (station == -1 || recordStation == station) && MatchesDateTime(recordDate, recordTime);
+	}
+};
+
+// Parses "a..b" or a single "a" (meaning a..a) into an inclusive range
+inline bool parseRange(const std::string& value, int& from, int& to)
+{
+	size_t dots = value.find("..");
+	try
+	{
+		if (dots == std::string::npos)
+		{
+			from = to = std::stoi(value);
+		}
+		else
+		{
+			from = std::stoi(value.substr(0, dots));
+			to = std::stoi(value.substr(dots + 2));
+		}
+	}
+	catch (const std::exception&)
+	{
+		return false;
+	}
+	return from <= to;
+}
+
+///
+/// Adds one key=value term to a filter, returns false if it isn't valid.
+/// Terms: station=NAME, year=YYYY[..YYYY], date=YYYYMMDD[..YYYYMMDD], month=M[..M], time=HHMM[..HHMM]
+///
+inline bool parseFilterTerm(const std::string& term, RecordFilter& filter)
+{
+	size_t equals = term.find('=');
+	if (equals == std::string::npos)
+		return false;
+	std::string key = term.substr(0, equals);
+	std::string value = term.substr(equals + 1);
+
+	if (key == "station")
+	{
+		filter.stationName = value;
+		std::transform(filter.stationName.begin(), filter.stationName.end(), filter.stationName.begin(), [](unsigned char c) { return (char)toupper(c); });
+		return !value.empty();
+	}
+	else if (key == "year")
+	{
+		if (!parseRange(value, filter.dateFrom, filter.dateTo))
+			return false;
+		filter.dateFrom = filter.dateFrom * 10000 + 101;
+		filter.dateTo = filter.dateTo * 10000 + 1231;
+		return true;
+	}
+	else if (key == "date")
+		return parseRange(value, filter.dateFrom, filter.dateTo);
+	else if (key == "month")
+		return parseRange(value, filter.monthFrom, filter.monthTo);
+	else if (key == "time")
+		return parseRange(value, filter.timeFrom, filter.timeTo);
+	return false;
+}
+
+///
+/// Drops the records that don't pass filter, for records that were loaded in full (e.g. from the binary cache).
+/// The filter's station must already be resolved against data.stations.
+///
+inline void filterRecords(WeatherData& data, const RecordFilter& filter)
+{
+	size_t kept = 0;
+	for (size_t i = 0; i < data.size(); i++)
+	{
+		if (!filter.Matches(data.station[i], data.date[i], data.time[i]))
+			continue;
+		data.station[kept] = data.station[i];
+		data.date[kept] = data.date[i];
+		data.time[kept] = data.time[i];
+		data.temperature[kept] = data.temperature[i];
+		kept++;
+	}
+	data.resize(kept);
+}
+
+///
+/// Copies the values into 16 bit storage for the compact device representation (see reduce_stats16),
+/// returns false if any of them don't fit
+///
+inline bool narrowTemperatures(const TemperatureColumn& values, Column<short>& out)
+{
+	out.resize(values.size());
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		if (values[i] < std::numeric_limits<short>::min() || values[i] > std::numeric_limits<short>::max())
+			return false;
+		out[i] = (short)values[i];
+	}
+	return true;
+}
+
+///
+/// Parses an unsigned integer column (year, month, day or time) and steps p past it
+///
+inline int parseInt(const char*& p, const char* end)
+{
+	int value = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+		value = value * 10 + (*p++ - '0');
+	return value;
+}
+
+///
+/// Parses all 6 columns of every line in [p, end) into data starting at record index offset.
+/// Station names are looked up in (and added to) the chunk's own dictionary, so threads never share state,
+/// the ids are remapped to the combined dictionary once every chunk has finished.
+/// With a filter only the matching records are kept, packed from offset, and the number kept is returned.
+/// The station is checked once per dictionary entry and the date and time before the temperature is parsed.
+///
+inline size_t parseRecords(const char* p, const char* end, WeatherData& data, size_t offset, std::vector<std::string>& stations,
+	const RecordFilter* filter = NULL)
+{
+	size_t i = offset;
+	unsigned short lastId = 0;
+	std::vector<char> stationMatches;	// per dictionary entry, only used with a filter
+	for (size_t s = 0; s < stations.size(); s++)
+		stationMatches.push_back(!filter || filter->stationName.empty() || filter->stationName == stations[s]);
+	while (p < end)
+	{
+		const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+		if (lineEnd == NULL)
+			lineEnd = end;
+
+		if (!isRecordStart(*p))
+		{
+			p = lineEnd + 1;
+			continue;
+		}
+
+		const char* line = p;
+		const char* nameEnd = (const char*)memchr(p, ' ', lineEnd - p);
+		if (nameEnd == NULL)
+			throw std::runtime_error("Malformed line: " + std::string(line, lineEnd));
+
+		// Records are grouped by station in the source files so the previous id nearly always matches
+		size_t nameLength = nameEnd - p;
+		if (stations.empty() || stations[lastId].size() != nameLength || stations[lastId].compare(0, nameLength, p, nameLength) != 0)
+		{
+			lastId = 0;
+			while (lastId < stations.size() && (stations[lastId].size() != nameLength || stations[lastId].compare(0, nameLength, p, nameLength) != 0))
+				lastId++;
+			if (lastId == stations.size())
+			{
+				stations.push_back(std::string(p, nameLength));
+				stationMatches.push_back(!filter || filter->stationName.empty() || filter->stationName == stations.back());
+			}
+		}
+		p = nameEnd + 1;
+
+		if (filter && !stationMatches[lastId])
+		{
+			p = lineEnd + 1;
+			continue;
+		}
+
+		int year = parseInt(p, lineEnd);
+		int month = parseInt(++p, lineEnd);
+		int day = parseInt(++p, lineEnd);
+		int hhmm = parseInt(++p, lineEnd);
+		if (++p >= lineEnd)
+			throw std::runtime_error("Malformed line: " + std::string(line, lineEnd));
+
+		int date = year * 10000 + month * 100 + day;
+		if (filter && !filter->MatchesDateTime(date, hhmm))
+		{
+			p = lineEnd + 1;
+			continue;
+		}
+
+		data.station[i] = lastId;
+		data.date[i] = date;
+		data.time[i] = (short)hhmm;
+		data.temperature[i] = parseFixedPoint(p, lineEnd);
+		i++;
+
+		p = lineEnd + 1;
+	}
+	return i - offset;
+}
+
+///
+/// Shared driver for the memory-mapped readers. The mapped bytes are split into one chunk per thread on line boundaries,
+/// the threads count their records so each one knows where its output starts, allocate(total) sizes the output,
+/// then parseChunk(thread, begin, end, offset) is run on every chunk in parallel.
+/// Any exception thrown by a worker is rethrown on the calling thread, as the type it was thrown as.
+///
+template <typename Allocate, typename ParseChunk>
+void parseMappedInParallel(const char* begin, size_t size, unsigned int threadCount, Allocate allocate, ParseChunk parseChunk)
+{
+	std::vector<size_t> chunks = splitOnLines(begin, size, threadCount);
+
+	// Pass 1 - count the records in each chunk, then prefix sum the counts to get each chunk's output offset
+	std::vector<size_t> outputOffset(threadCount + 1, 0);
+	std::vector<std::thread> workers;
+	for (unsigned int t = 0; t < threadCount; t++)
+	{
+		workers.push_back(std::thread([&, t]() {
+			outputOffset[t + 1] = countRecords(begin + chunks[t], begin + chunks[t + 1]);
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+	workers.clear();
+
+	for (unsigned int t = 0; t < threadCount; t++)
+		outputOffset[t + 1] += outputOffset[t];
+
+	allocate(outputOffset[threadCount]);
+
+	// Pass 2 - parse every chunk into its slice of the output
+	std::vector<std::exception_ptr> errors(threadCount);
+	for (unsigned int t = 0; t < threadCount; t++)
+	{
+		workers.push_back(std::thread([&, t]() {
+			try
+			{
+				parseChunk(t, begin + chunks[t], begin + chunks[t + 1], outputOffset[t]);
+			}
+			catch (...)
+			{
+				errors[t] = std::current_exception();
+			}
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	for (unsigned int t = 0; t < threadCount; t++)
+	{
+		if (errors[t])
+			std::rethrow_exception(errors[t]);
+	}
+}
+
+///
+/// Memory-mapped replacement for readFile(). Only the temperature column is parsed, straight into
+/// a single preallocated, page aligned column the device can use in place. Values are stored * 100 as ints, same as readFile(),
+/// or as shorts for -z 16 (a value that doesn't fit throws, see parseTemperatures()).
+/// threadCount = 0 uses one thread per hardware thread.
+///
+template <typename T = int>
+Column<T>* readFileMapped(const std::string& filename, unsigned int threadCount = 0)
+{
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	MappedFile file(filename);
+	Column<T>* data = new Column<T>;
+	try
+	{
+		parseMappedInParallel(file.data(), file.size(), threadCount,
+			[&](size_t total) { data->resize(total); },
+			[&](unsigned int, const char* begin, const char* end, size_t offset) { parseTemperatures(begin, end, data->data() + offset); });
+	}
+	catch (...)
+	{
+		delete data;
+		throw;
+	}
+	return data;
+}
+
+///
+/// Memory-mapped reader that keeps every column, not just the temperature.
+/// Each thread builds its own station dictionary which are merged at the end.
+/// With a filter only matching records are kept (see parseRecords()), each chunk's records are then moved down
+/// to close the gaps left by the ones that were dropped.
+///
+WeatherData* readRecordsMapped(const std::string& filename, unsigned int threadCount = 0, const RecordFilter* filter = NULL)
+{
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	MappedFile file(filename);
+	WeatherData* data = new WeatherData;
+	std::vector<std::vector<std::string> > localStations(threadCount);
+	std::vector<size_t> chunkStart(threadCount + 1, 0);
+	std::vector<size_t> chunkKept(threadCount, 0);
+	try
+	{
+		parseMappedInParallel(file.data(), file.size(), threadCount,
+			[&](size_t total) { data->resize(total); chunkStart[threadCount] = total; },
+			[&](unsigned int t, const char* begin, const char* end, size_t offset) {
+				chunkStart[t] = offset;
+				chunkKept[t] = parseRecords(begin, end, *data, offset, localStations[t], filter);
+			});
+	}
+	catch (...)
+	{
+		delete data;
+		throw;
+	}
+
+	// Merge the per-thread dictionaries and rewrite each chunk's ids to the merged ones
+	for (unsigned int t = 0; t < threadCount; t++)
+	{
+		std::vector<unsigned short> remap(localStations[t].size());
+		for (size_t s = 0; s < localStations[t].size(); s++)
+		{
+			size_t id = std::find(data->stations.begin(), data->stations.end(), localStations[t][s]) - data->stations.begin();
+			if (id == data->stations.size())
+				data->stations.push_back(localStations[t][s]);
+			remap[s] = (unsigned short)id;
+		}
+		for (size_t i = chunkStart[t]; i < chunkStart[t] + chunkKept[t]; i++)
+			data->station[i] = remap[data->station[i]];
+	}
+
+	// Without a filter every chunk is full and already in place
+	size_t kept = 0;
+	for (unsigned int t = 0; t < threadCount; t++)
+	{
+		if (kept != chunkStart[t])
+		{
+			size_t from = chunkStart[t], to = from + chunkKept[t];
+			std::copy(data->station.begin() + from, data->station.begin() + to, data->station.begin() + kept);
+			std::copy(data->date.begin() + from, data->date.begin() + to, data->date.begin() + kept);
+			std::copy(data->time.begin() + from, data->time.begin() + to, data->time.begin() + kept);
+			std::copy(data->temperature.begin() + from, data->temperature.begin() + to, data->temperature.begin() + kept);
+		}
+		kept += chunkKept[t];
+	}
+	data->resize(kept);
+	return data;
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+///
+/// On-disk cache of built OpenCL programs, so the kernels are only compiled the first time they run on a device.
+///
+/// Each cache file is <source>.<key hash>.clbin next to the kernel source, and holds the full key (device name,
+/// driver version, build options and a hash of the source) followed by the binary from CL_PROGRAM_BINARIES.
+/// The key is compared in full on load, so a hash collision or a driver update just means a rebuild.
+///
+const char PROGRAM_CACHE_MAGIC[4] = { 'P', 'A', 'P', 'C' };
+
+// 64 bit FNV-1a, fine for telling kernel sources apart (this isn't protecting against anyone)
+uint64_t hashString(const std::string& s)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < s.size(); i++)
+	{
+		hash ^= (unsigned char)s[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+std::string toHex(uint64_t value)
+{
+	std::stringstream stream;
+	stream << std::hex << std::setw(16) << std::setfill('0') << value;
+	return stream.str();
+}
+
+///
+/// Reads a cached binary for key, returns false if there isn't one or it was built for a different key
+///
+bool readProgramBinary(const std::string& cacheName, const std::string& key, std::vector<unsigned char>& binary)
+{
+	std::ifstream file(cacheName, std::ios::binary);
+	char magic[4];
+	uint64_t keySize = 0, binarySize = 0;
+	if (!file.read(magic, 4) || memcmp(magic, PROGRAM_CACHE_MAGIC, 4) != 0 || !file.read((char*)&keySize, sizeof(keySize)) || keySize != key.size())
+		return false;
+
+	std::string storedKey(keySize, '\0');
+	if (!file.read(&storedKey[0], keySize) || storedKey != key || !file.read((char*)&binarySize, sizeof(binarySize)) || binarySize == 0)
+		return false;
+
+	binary.resize((size_t)binarySize);
+	return (bool)file.read((char*)&binary[0], binarySize);
+}
+
+///
+/// Writes a built program's binary for key, through a temporary file so a crashed run can't leave half a binary behind
+///
+bool writeProgramBinary(const std::string& cacheName, const std::string& key, cl::Program& program)
+{
+	std::vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+	if (sizes.empty() || sizes[0] == 0)
+		return false;
+
+	// CL_PROGRAM_BINARIES fills in buffers the caller has already allocated, one per device
+	std::vector<std::vector<char> > binaries(sizes.size());
+	std::vector<char*> pointers(sizes.size());
+	for (size_t i = 0; i < sizes.size(); i++)
+	{
+		binaries[i].resize(std::max((size_t)1, sizes[i]));
+		pointers[i] = &binaries[i][0];
+	}
+	program.getInfo(CL_PROGRAM_BINARIES, &pointers);
+
+	std::string tempName = cacheName + ".tmp";
+	{
+		std::ofstream file(tempName, std::ios::binary | std::ios::trunc);
+		uint64_t keySize = key.size(), binarySize = sizes[0];
+		file.write(PROGRAM_CACHE_MAGIC, 4);
+		file.write((const char*)&keySize, sizeof(keySize));
+		file.write(key.data(), key.size());
+		file.write((const char*)&binarySize, sizeof(binarySize));
+		file.write(&binaries[0][0], sizes[0]);
+		if (!file)
+			return false;
+	}
+	std::remove(cacheName.c_str());
+	return std::rename(tempName.c_str(), cacheName.c_str()) == 0;
+}
+
+///
+/// Builds source_file for the (first) device of context with the given options, loading the binary from the cache
+/// when there is one for this device, driver, options and source, and saving it there after a real build.
+/// fromCache (optional) is set to whether the cached binary was used.
+/// A failed build throws cl::Error as program.build() does, with the log printed the same way Solution.cpp does.
+///
+cl::Program BuildProgram(cl::Context& context, const std::string& source_file, const std::string& options = "", bool* fromCache = NULL)
+{
+	std::ifstream sourceStream(source_file);
+	if (!sourceStream)
+		throw std::runtime_error("Unable to open " + source_file);
+	std::string source((std::istreambuf_iterator<char>(sourceStream)), std::istreambuf_iterator<char>());
+
+	std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+	std::vector<cl::Device> device(1, devices[0]);
+	std::string key = devices[0].getInfo<CL_DEVICE_NAME>() + "\n" + devices[0].getInfo<CL_DRIVER_VERSION>() + "\n" + options + "\n" + toHex(hashString(source));
+	std::string cacheName = source_file + "." + toHex(hashString(key)) + ".clbin";
+
+	if (fromCache)
+		*fromCache = false;
+
+	std::vector<unsigned char> binary;
+	if (readProgramBinary(cacheName, key, binary))
+	{
+		try
+		{
+			cl::Program::Binaries binaries(1, std::make_pair((const void*)&binary[0], binary.size()));
+			cl::Program program(context, device, binaries);
+			program.build(device, options.c_str());
+			if (fromCache)
+				*fromCache = true;
+			return program;
+		}
+		catch (const cl::Error&)
+		{
+			// The driver wouldn't take it back, build from source and replace it
+		}
+	}
+
+	cl::Program::Sources sources(1, std::make_pair(source.c_str(), source.length() + 1));
+	cl::Program program(context, sources);
+	try
+	{
+		program.build(device, options.c_str());
+	}
+	catch (const cl::Error& err)
+	{
+		std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(devices[0]) << std::endl;
+		std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(devices[0]) << std::endl;
+		std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]) << std::endl;
+		throw err;
+	}
+
+	if (!writeProgramBinary(cacheName, key, program))
+		std::cerr << "Unable to write program cache " << cacheName << std::endl;
+	return program;
+}
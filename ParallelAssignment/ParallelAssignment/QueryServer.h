@@ -0,0 +1,157 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+#include "Parser.h"
+#include "Statistics.h"
+#include "DeviceRecords.h"
+#include "Trace.h"
+
+///
+/// One line of the query protocol: a statistic followed by any number of key=value filters, e.g.
+///   minmax station=SCAMPTON year=1990..2000
+///
+struct Query
+{
+	std::string statistic;
+	RecordFilter filter;
+};
+
+///
+/// Parses a query line, returns false and sets error if it isn't valid.
+/// Filters are the terms parseFilterTerm() accepts
+///
+bool ParseQuery(const std::string& line, const WeatherData& records, Query& query, std::string& error)
+{
+	static const char* statistics[] = { "count", "min", "max", "minmax", "mean", "variance", "stddev", "stats" };
+
+	std::stringstream stream(line);
+	if (!(stream >> query.statistic))
+	{
+		error = "empty query";
+		return false;
+	}
+	if (std::find(std::begin(statistics), std::end(statistics), query.statistic) == std::end(statistics))
+	{
+		error = "unknown statistic '" + query.statistic + "'";
+		return false;
+	}
+
+	std::string term;
+	while (stream >> term)
+	{
+		if (!parseFilterTerm(term, query.filter))
+		{
+			error = "bad filter '" + term + "'";
+			return false;
+		}
+	}
+
+	query.filter.ResolveStation(records.stations);
+	if (query.filter.station == -2)
+	{
+		error = "unknown station '" + query.filter.stationName + "'";
+		return false;
+	}
+	return true;
+}
+
+///
+/// Formats the part of a result a statistic asks for
+///
+std::string FormatStatistic(const std::string& statistic, const Stats& stats)
+{
+	std::stringstream out;
+	out << std::fixed << std::setprecision(2);
+	if (stats.count == 0)
+		out << "no matching records";
+	else if (statistic == "count")
+		out << "count = " << stats.count;
+	else if (statistic == "min")
+		out << "min = " << stats.Min();
+	else if (statistic == "max")
+		out << "max = " << stats.Max();
+	else if (statistic == "minmax")
+		out << "min = " << stats.Min() << ", max = " << stats.Max();
+	else if (statistic == "mean")
+		out << "mean = " << stats.Mean();
+	else if (statistic == "variance")
+		out << "variance = " << stats.Variance();
+	else if (statistic == "stddev")
+		out << "stddev = " << stats.StdDev();
+	else
+		out << "count = " << stats.count << ", min = " << stats.Min() << ", max = " << stats.Max() << ", mean = " << stats.Mean()
+			<< ", variance = " << stats.Variance() << ", stddev = " << stats.StdDev();
+	return out.str();
+}
+
+///
+/// Resident query server: the records are uploaded once and stay on the device, then every line read from in is
+/// answered on out until "quit" or the end of the input. A query only costs one reduce_stats(_where) launch and
+/// the read back of its group partials, the context, program and columns are all reused. trace (optional) gets the
+/// upload, and every query as a host phase with its launch and read back.
+///
+void RunQueryServer(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, const WeatherData& records, size_t local_size,
+	std::istream& in, std::ostream& out, Trace* trace = NULL)
+{
+	typedef std::chrono::steady_clock Clock;
+
+	DeviceRecords device = UploadRecords(context, queue, records);
+	queue.finish();
+	if (trace)
+		trace->Device(device.uploads, "upload records", "write");
+
+	out << "Ready, " << records.size() << " records on the device. Statistics: count min max minmax mean variance stddev stats" << std::endl;
+	out << "Filters: station=NAME year=YYYY[..YYYY] date=YYYYMMDD[..YYYYMMDD] month=M[..M] time=HHMM[..HHMM], quit to exit" << std::endl;
+
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.find_first_not_of(" \t") == std::string::npos)
+			continue;
+		if (line == "quit" || line == "exit")
+			break;
+
+		Query query;
+		std::string error;
+		if (!ParseQuery(line, records, query, error))
+		{
+			out << "error: " << error << std::endl;
+			continue;
+		}
+
+		Clock::time_point start = Clock::now();
+		cl::Event kernel;
+		PendingStats pending;
+		Stats stats;
+		{
+			TraceScope tracing(trace, "query " + query.statistic);
+			pending = EnqueueFilteredStats(context, queue, program, device, query.filter, local_size, &kernel);
+			stats = pending.Finish();
+		}
+		auto latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+		if (trace)
+		{
+			trace->Device(kernel, "query " + query.statistic);
+			trace->Device(pending.read, "read partials", "read");
+		}
+
+		out << FormatStatistic(query.statistic, stats) << "	| " << stats.count << " records, kernel " << GetExecutionTime(kernel);
+		out << " [ns], read back " << GetExecutionTime(pending.read) << " [ns], latency " << latency << " [us]" << std::endl;
+	}
+}
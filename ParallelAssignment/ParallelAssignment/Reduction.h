@@ -0,0 +1,270 @@
+#pragma once
+
+#include <string>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "ProgramCache.h"
+
+///
+/// Operations supported by the two stage reduction kernels, the values match REDUCE_* in reduce_template.cl
+///
+enum ReduceOp
+{
+	REDUCE_SUM = 0,
+	REDUCE_MIN = 1,
+	REDUCE_MAX = 2
+};
+
+inline const char* ReduceOpName(ReduceOp op)
+{
+	switch (op)
+	{
+	case REDUCE_MIN: return "min";
+	case REDUCE_MAX: return "max";
+	default: return "sum";
+	}
+}
+
+///
+/// Element types the reduction can be specialised for. Integers are reduced as 64 bit (cl_long) values,
+/// float and double as themselves.
+///
+enum ReduceType
+{
+	REDUCE_INT16,
+	REDUCE_INT32,
+	REDUCE_INT64,
+	REDUCE_FLOAT,
+	REDUCE_DOUBLE
+};
+
+// OpenCL C name of the element type
+inline const char* ReduceTypeName(ReduceType type)
+{
+	switch (type)
+	{
+	case REDUCE_INT16: return "short";
+	case REDUCE_INT64: return "long";
+	case REDUCE_FLOAT: return "float";
+	case REDUCE_DOUBLE: return "double";
+	default: return "int";
+	}
+}
+
+// Size of one element, the input buffer holds N of these
+inline size_t ReduceTypeSize(ReduceType type)
+{
+	switch (type)
+	{
+	case REDUCE_INT16: return sizeof(cl_short);
+	case REDUCE_INT64: return sizeof(cl_long);
+	case REDUCE_FLOAT: return sizeof(cl_float);
+	case REDUCE_DOUBLE: return sizeof(cl_double);
+	default: return sizeof(cl_int);
+	}
+}
+
+// Size of the type the values are reduced in, the result is one of these
+inline size_t ReduceAccumulatorSize(ReduceType type)
+{
+	return type == REDUCE_FLOAT ? sizeof(cl_float) : sizeof(cl_long);
+}
+
+///
+/// Builds the specialisations of reduce_template.cl on demand, one program per element type, operator and work group
+/// size, and keeps them for as long as the registry lives. Every build also goes through BuildProgram(), so each
+/// specialisation is only compiled from source once per device and driver.
+///
+struct ReduceRegistry
+{
+	cl::Context context;
+	std::string sourceFile;
+	std::map<std::string, cl::Program> programs;	// by build options
+	std::map<std::pair<int, int>, size_t> tuned;	// best work group size found by TuneReduction(), by (op, type)
+	size_t builds;									// specialisations compiled from source
+	size_t cacheLoads;								// specialisations loaded from the program cache
+
+	bool subgroups;									// the device has cl_khr_subgroups and OpenCL C 2.0 to use them in
+
+	ReduceRegistry(const cl::Context& context, const std::string& sourceFile = "reduce_template.cl")
+		: context(context), sourceFile(sourceFile), builds(0), cacheLoads(0)
+	{
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		std::string version = device.getInfo<CL_DEVICE_OPENCL_C_VERSION>();
+		subgroups = device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_subgroups") != std::string::npos &&
+			version.compare(0, 9, "OpenCL C ") == 0 && version.size() > 9 && version[9] >= '2';
+	}
+
+	///
+	/// The -D options for one specialisation, see the top of reduce_template.cl.
+	/// Stage 1 always loads 16 bytes at a time, so a 16 bit input is read as short8 and an int one as int4.
+	///
+	static std::string Options(ReduceOp op, ReduceType type, size_t wg_size, bool subgroups = false)
+	{
+		std::stringstream options;
+		options << "-D T=" << ReduceTypeName(type) << " -D VEC=" << 16 / ReduceTypeSize(type);
+		if (type == REDUCE_FLOAT)
+			options << " -D ACC=float -D ACC_MIN=(-INFINITY) -D ACC_MAX=INFINITY";
+		else if (type == REDUCE_DOUBLE)
+			options << " -D ACC=double -D ACC_MIN=(-INFINITY) -D ACC_MAX=INFINITY -D ENABLE_FP64";
+		else
+			options << " -D ACC=long -D ACC_MIN=LONG_MIN -D ACC_MAX=LONG_MAX";
+		options << " -D OP=" << (int)op << " -D WG_SIZE=" << wg_size;
+		if (subgroups)
+			options << " -D SUBGROUPS -cl-std=CL2.0";
+		return options.str();
+	}
+
+	cl::Program& Get(ReduceOp op, ReduceType type, size_t wg_size)
+	{
+		if (wg_size == 0 || (wg_size & (wg_size - 1)) != 0)
+			throw std::invalid_argument("The reduction work group size must be a power of 2");
+
+		std::string options = Options(op, type, wg_size, subgroups);
+		std::map<std::string, cl::Program>::iterator it = programs.find(options);
+		if (it != programs.end())
+			return it->second;
+
+		bool fromCache = false;
+		cl::Program program = BuildProgram(context, sourceFile, options, &fromCache);
+		if (fromCache)
+			cacheLoads++;
+		else
+			builds++;
+		return programs[options] = program;
+	}
+
+	///
+	/// Every power of 2 work group size from 32 up to what the device (and its local memory) allows
+	///
+	std::vector<size_t> WorkGroupSizes(ReduceType type) const
+	{
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		size_t limit = std::min(device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>(),
+			(size_t)device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / ReduceAccumulatorSize(type));
+
+		std::vector<size_t> sizes;
+		for (size_t size = 32; size <= std::min(limit, (size_t)1024); size *= 2)
+			sizes.push_back(size);
+		if (sizes.empty())
+			sizes.push_back(1);
+		return sizes;
+	}
+
+	// The largest size, what every reduction used before they were specialised
+	size_t DefaultWorkGroupSize(ReduceType type) const
+	{
+		return WorkGroupSizes(type).back();
+	}
+};
+
+///
+/// Queues a reduction of the first N values of input (of the registry type) with op and leaves the result, an Acc, in
+/// result on the device: cl_long for the integer types, cl_float or cl_double for the floating point ones.
+///
+/// Stage 1 launches up to max_groups work groups that each write one partial, stage 2 reduces the partials with a
+/// single work group. There are no global atomics and N doesn't have to be a multiple of wg_size, so the input needs
+/// no padding. Stage 1 waits for after (optional) and stage 2 for stage 1, nothing else is assumed about the queue's
+/// order so it can be out of order (see EventGraph). stage1/stage2 receive the launches' events.
+///
+template <typename Acc>
+void EnqueueTwoStageReduce(ReduceRegistry& registry, cl::CommandQueue& queue, ReduceOp op, ReduceType type, cl::Buffer& input, size_t N,
+	size_t wg_size, cl::Buffer& result, cl::Event& stage1, cl::Event& stage2, const std::vector<cl::Event>* after = NULL, size_t max_groups = 1024)
+{
+	if (sizeof(Acc) != ReduceAccumulatorSize(type) || (type == REDUCE_FLOAT || type == REDUCE_DOUBLE) != std::is_floating_point<Acc>::value)
+		throw std::invalid_argument(std::string("Wrong result type for a reduction over ") + ReduceTypeName(type));
+
+	cl::Program& program = registry.Get(op, type, wg_size);
+	size_t nr_groups = std::max((size_t)1, std::min((N + wg_size - 1) / wg_size, max_groups));
+
+	cl::Buffer buffer_partials(registry.context, CL_MEM_READ_WRITE, nr_groups * sizeof(Acc));
+
+	cl::Kernel kernel_stage1 = cl::Kernel(program, "reduce_stage1");
+	kernel_stage1.setArg(0, input);
+	kernel_stage1.setArg(1, (cl_int)N);
+	kernel_stage1.setArg(2, buffer_partials);
+
+	cl::Kernel kernel_stage2 = cl::Kernel(program, "reduce_stage2");
+	kernel_stage2.setArg(0, buffer_partials);
+	kernel_stage2.setArg(1, (cl_int)nr_groups);
+	kernel_stage2.setArg(2, result);
+
+	queue.enqueueNDRangeKernel(kernel_stage1, cl::NullRange, cl::NDRange(nr_groups * wg_size), cl::NDRange(wg_size), after, &stage1);
+	std::vector<cl::Event> partials(1, stage1);
+	queue.enqueueNDRangeKernel(kernel_stage2, cl::NullRange, cl::NDRange(wg_size), cl::NDRange(wg_size), &partials, &stage2);
+}
+
+///
+/// EnqueueTwoStageReduce() and a blocking read of the result. stage1/stage2 (optional) receive the profiling events
+/// of the two launches.
+///
+template <typename Acc>
+Acc RunTwoStageReduce(ReduceRegistry& registry, cl::CommandQueue& queue, ReduceOp op, ReduceType type, cl::Buffer& input, size_t N,
+	size_t wg_size, cl::Event* stage1 = NULL, cl::Event* stage2 = NULL, size_t max_groups = 1024)
+{
+	cl::Buffer buffer_result(registry.context, CL_MEM_WRITE_ONLY, sizeof(Acc));
+	cl::Event first, second;
+	EnqueueTwoStageReduce<Acc>(registry, queue, op, type, input, N, wg_size, buffer_result, first, second, NULL, max_groups);
+	if (stage1)
+		*stage1 = first;
+	if (stage2)
+		*stage2 = second;
+
+	Acc result;
+	std::vector<cl::Event> reduced(1, second);
+	queue.enqueueReadBuffer(buffer_result, CL_TRUE, 0, sizeof(Acc), &result, &reduced);
+	return result;
+}
+
+///
+/// Times every work group size WorkGroupSizes() allows for op over the first N values of input (best of repeats runs,
+/// from the profiling events) and returns the fastest. The answer is kept in the registry, so each op and type is only
+/// measured once per registry, the specialisations it built along the way stay in it too.
+///
+size_t TuneReduction(ReduceRegistry& registry, cl::CommandQueue& queue, ReduceOp op, ReduceType type, cl::Buffer& input, size_t N, int repeats = 3)
+{
+	std::pair<int, int> key((int)op, (int)type);
+	std::map<std::pair<int, int>, size_t>::iterator it = registry.tuned.find(key);
+	if (it != registry.tuned.end())
+		return it->second;
+
+	std::vector<size_t> sizes = registry.WorkGroupSizes(type);
+	size_t best = sizes.back();
+	cl_ulong bestTime = 0;
+	for (size_t s = 0; s < sizes.size(); s++)
+	{
+		cl_ulong fastest = 0;
+		for (int run = 0; run < repeats; run++)
+		{
+			cl::Event stage1, stage2;
+			if (type == REDUCE_FLOAT)
+				RunTwoStageReduce<cl_float>(registry, queue, op, type, input, N, sizes[s], &stage1, &stage2);
+			else if (type == REDUCE_DOUBLE)
+				RunTwoStageReduce<cl_double>(registry, queue, op, type, input, N, sizes[s], &stage1, &stage2);
+			else
+				RunTwoStageReduce<cl_long>(registry, queue, op, type, input, N, sizes[s], &stage1, &stage2);
+
+			cl_ulong time = stage1.getProfilingInfo<CL_PROFILING_COMMAND_END>() - stage1.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			time += stage2.getProfilingInfo<CL_PROFILING_COMMAND_END>() - stage2.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			if (run == 0 || time < fastest)
+				fastest = time;
+		}
+		if (s == 0 || fastest < bestTime)
+		{
+			best = sizes[s];
+			bestTime = fastest;
+		}
+	}
+	return registry.tuned[key] = best;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+
+///
+/// Inclusive prefix sum of the first N longs of data, in place.
+///
+/// scan_blelloch scans blocks of 2 * local_size values in local memory and writes each block's total, if there is more
+/// than one block those totals are scanned the same way (recursively, so any N works) and scan_add_offsets adds them
+/// back. That is O(N) additions overall, against O(N log N) for a Hillis-Steele scan of the whole input.
+/// local_size must be a power of 2, it is lowered to what both kernels allow. Every launch's event is added to events.
+///
+void ScanInclusive(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, cl::Buffer& data, size_t N,
+	size_t local_size, std::vector<cl::Event>& events)
+{
+	if (N == 0)
+		return;
+
+	cl::Kernel kernel_scan = cl::Kernel(program, "scan_blelloch");
+	cl::Kernel kernel_add = cl::Kernel(program, "scan_add_offsets");
+	local_size = KernelLocalSize(context, kernel_scan, KernelLocalSize(context, kernel_add, local_size));
+
+	size_t block = local_size * 2;
+	size_t nr_groups = (N + block - 1) / block;
+	cl::Buffer blockSums(context, CL_MEM_READ_WRITE, nr_groups * sizeof(cl_long));
+
+	kernel_scan.setArg(0, data);
+	kernel_scan.setArg(1, (cl_int)N);
+	kernel_scan.setArg(2, blockSums);
+	kernel_scan.setArg(3, cl::Local(block * sizeof(cl_long)));
+
+	events.push_back(cl::Event());
+	queue.enqueueNDRangeKernel(kernel_scan, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), NULL, &events.back());
+
+	if (nr_groups == 1)
+		return;
+
+	ScanInclusive(context, queue, program, blockSums, nr_groups, local_size, events);
+
+	kernel_add.setArg(0, data);
+	kernel_add.setArg(1, (cl_int)N);
+	kernel_add.setArg(2, blockSums);
+
+	events.push_back(cl::Event());
+	queue.enqueueNDRangeKernel(kernel_add, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), NULL, &events.back());
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Parser.h"
+#include "DeviceRecords.h"
+#include "Scan.h"
+
+///
+/// One record's point of the series, must match the struct in my_kernels3.cl
+///
+struct SeriesPoint
+{
+	cl_long degreeDays;	// * 100, running total for the station up to and including this record's day
+	cl_float mean;		// degrees, over the window
+	cl_int min;			// * 100
+	cl_int max;			// * 100
+	cl_int count;		// records in the window
+};
+
+///
+/// Rolling window statistics and cumulative heating degree days for every record, in station then date/time order.
+/// order[i] is the index in the records the series was worked out from of points[i].
+///
+struct RollingSeries
+{
+	int window;						// days
+	int base;						// degree day base temperature * 100
+	std::vector<size_t> order;
+	std::vector<SeriesPoint> points;
+	std::vector<cl::Event> events;	// every launch, for profiling
+	std::vector<cl::Event> uploads;	// the columns and station starts written to the device, for tracing
+	std::vector<cl::Event> reads;	// the points read back
+
+	cl_ulong ExecutionTime() const
+	{
+		cl_ulong total = 0;
+		for (size_t i = 0; i < events.size(); i++)
+			total += events[i].getProfilingInfo<CL_PROFILING_COMMAND_END>() - events[i].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		return total;
+	}
+};
+
+///
+/// The records sorted by station (in dictionary order) then date and time. The source files are already in this order
+/// so it is normally just 0..N-1, which the caller can check for to reuse columns that are already on the device.
+///
+std::vector<size_t> TimeOrder(const WeatherData& records)
+{
+	std::vector<size_t> order(records.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+
+	auto before = [&](size_t a, size_t b) {
+		if (records.station[a] != records.station[b]) return records.station[a] < records.station[b];
+		if (records.date[a] != records.date[b]) return records.date[a] < records.date[b];
+		return records.time[a] < records.time[b];
+	};
+	if (!std::is_sorted(order.begin(), order.end(), before))
+		std::stable_sort(order.begin(), order.end(), before);
+	return order;
+}
+
+///
+/// Rolling mean, min and max over the window days up to each record and the running total of heating degree days
+/// (how far each day's mean temperature is below base) for every station.
+///
+/// Both running sums come from ScanInclusive() over the whole column, a window's sum is then the difference of two
+/// scan values and a station's running total the difference from the value before its first record, so no segmented
+/// scan is needed. The daily means come from the first scan, so the degree days are only worked out after it. The
+/// window min and max come from a sparse table of log2 N levels built over the column, one launch per level.
+/// rolling_window works out every point in parallel and the series is read back in one go. If the records are already
+/// in time order and temperature holds their temperatures on the device it isn't uploaded again.
+///
+RollingSeries RunRollingSeries(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, const WeatherData& records,
+	int window, int base, size_t local_size, const cl::Buffer* temperature = NULL)
+{
+	RollingSeries series;
+	series.window = window;
+	series.base = base;
+	series.order = TimeOrder(records);
+	size_t N = records.size();
+	if (N == 0)
+		return series;
+
+	bool inOrder = true;
+	for (size_t i = 0; i < N && inOrder; i++)
+		inOrder = series.order[i] == i;
+
+	WeatherData sorted;
+	if (!inOrder)
+	{
+		sorted.stations = records.stations;
+		sorted.resize(N);
+		for (size_t i = 0; i < N; i++)
+		{
+			size_t from = series.order[i];
+			sorted.station[i] = records.station[from];
+			sorted.date[i] = records.date[from];
+			sorted.time[i] = records.time[from];
+			sorted.temperature[i] = records.temperature[from];
+		}
+	}
+	const WeatherData& ordered = inOrder ? records : sorted;
+	DeviceRecords device = UploadRecords(context, queue, ordered, inOrder ? temperature : NULL);
+	series.uploads = device.uploads;
+
+	// Index of every station's first record, stations without any records never get looked up
+	std::vector<cl_int> stationStart(std::max((size_t)1, records.stations.size()), 0);
+	for (size_t i = N; i-- > 0;)
+		stationStart[ordered.station[i]] = (cl_int)i;
+	cl::Buffer buffer_starts(context, CL_MEM_READ_ONLY, stationStart.size() * sizeof(cl_int));
+	series.uploads.push_back(cl::Event());
+	queue.enqueueWriteBuffer(buffer_starts, CL_FALSE, 0, stationStart.size() * sizeof(cl_int), &stationStart[0], NULL, &series.uploads.back());
+
+	cl::Buffer sums(context, CL_MEM_READ_WRITE, N * sizeof(cl_long));
+	cl::Buffer degreeSums(context, CL_MEM_READ_WRITE, N * sizeof(cl_long));
+	cl::Buffer points(context, CL_MEM_WRITE_ONLY, N * sizeof(SeriesPoint));
+	// One work item per record in each of these, each launch is rounded up to whole work groups of its own kernel's size
+	auto launch = [&](cl::Kernel& kernel) {
+		size_t size = KernelLocalSize(context, kernel, local_size);
+		series.events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(((N + size - 1) / size) * size), cl::NDRange(size), NULL, &series.events.back());
+	};
+
+	cl::Kernel kernel_values = cl::Kernel(program, "series_values");
+	kernel_values.setArg(0, device.temperature);
+	kernel_values.setArg(1, (cl_int)N);
+	kernel_values.setArg(2, sums);
+	launch(kernel_values);
+	ScanInclusive(context, queue, program, sums, N, local_size, series.events);
+
+	cl::Kernel kernel_degrees = cl::Kernel(program, "daily_degree_days");
+	kernel_degrees.setArg(0, device.station);
+	kernel_degrees.setArg(1, device.date);
+	kernel_degrees.setArg(2, sums);
+	kernel_degrees.setArg(3, (cl_int)N);
+	kernel_degrees.setArg(4, (cl_int)base);
+	kernel_degrees.setArg(5, degreeSums);
+	launch(kernel_degrees);
+	ScanInclusive(context, queue, program, degreeSums, N, local_size, series.events);
+
+	// Enough levels for a block as long as the whole column, whatever the window holds
+	int levels = 1;
+	while (((size_t)1 << levels) <= N)
+		levels++;
+	cl::Buffer mins(context, CL_MEM_READ_WRITE, levels * N * sizeof(cl_int));
+	cl::Buffer maxs(context, CL_MEM_READ_WRITE, levels * N * sizeof(cl_int));
+	cl::Kernel kernel_level = cl::Kernel(program, "sparse_level");
+	kernel_level.setArg(0, device.temperature);
+	kernel_level.setArg(1, (cl_int)N);
+	kernel_level.setArg(3, mins);
+	kernel_level.setArg(4, maxs);
+	for (int level = 0; level < levels; level++)
+	{
+		kernel_level.setArg(2, (cl_int)level);
+		launch(kernel_level);
+	}
+
+	cl::Kernel kernel_window = cl::Kernel(program, "rolling_window");
+	kernel_window.setArg(0, mins);
+	kernel_window.setArg(1, maxs);
+	kernel_window.setArg(2, device.station);
+	kernel_window.setArg(3, device.date);
+	kernel_window.setArg(4, buffer_starts);
+	kernel_window.setArg(5, sums);
+	kernel_window.setArg(6, degreeSums);
+	kernel_window.setArg(7, (cl_int)N);
+	kernel_window.setArg(8, (cl_int)window);
+	kernel_window.setArg(9, points);
+	launch(kernel_window);
+
+	series.points.resize(N);
+	series.reads.push_back(cl::Event());
+	queue.enqueueReadBuffer(points, CL_TRUE, 0, N * sizeof(SeriesPoint), &series.points[0], NULL, &series.reads.back());
+	return series;
+}
+
+///
+/// Writes the series as CSV, one line per record in station then date/time order. Returns false if the file can't be written.
+///
+bool WriteSeriesCsv(const std::string& filename, const WeatherData& records, const RollingSeries& series)
+{
+	std::ofstream out(filename);
+	if (!out)
+		return false;
+
+	out << std::fixed << std::setprecision(2);
+	out << "station,date,time,temperature,window_count,rolling_mean_" << series.window << "d,rolling_min,rolling_max,degree_days" << std::endl;
+	for (size_t i = 0; i < series.points.size(); i++)
+	{
+		size_t r = series.order[i];
+		const SeriesPoint& p = series.points[i];
+		out << records.stations[records.station[r]] << "," << records.date[r] << "," << std::setw(4) << std::setfill('0') << records.time[r] << std::setfill(' ');
+		out << "," << records.temperature[r] / 100.0 << "," << p.count << "," << p.mean << "," << p.min / 100.0 << "," << p.max / 100.0;
+		out << "," << p.degreeDays / 100.0 << std::endl;
+	}
+	return (bool)out;
+}
@@ -5,6 +5,7 @@
 #include <vector>
 #include <chrono> // Timing the performance of the program
 #include <iomanip> // For std::setprecision() to output numbers to set number of decimal places
+#include <cmath>
 
 #ifdef __APPLE__
 #include <OpenCL/cl.hpp>
@@ -13,15 +14,35 @@
 #endif
 
 #include "Utils.h"
+#include "Parser.h"
+#include "BinaryCache.h"
+#include "Statistics.h"
+#include "Reduction.h"
+#include "Sort.h"
+#include "Histogram.h"
+#include "Streaming.h"
+#include "MultiDevice.h"
+#include "CpuBackend.h"
+#include "ProgramCache.h"
+#include "QueryServer.h"
+#include "Grouping.h"
+#include "Series.h"
+#include "HostBuffer.h"
+#include "EventGraph.h"
+#include "Trace.h"
+#include "DeviceParser.h"
+#include "Tuning.h"
+#include "TopK.h"
+#include "Batch.h"
 
 ///
 /// Function takes the filepath and uses ifstream to read in the contents of that file.
 /// The contents are read as a string but then the final column of data (after the 5th space character) is parsed to a float
 /// The float is * by 100 and saved as an int so it can be passed into OpenCL kernels and still retain the decimal place data
 ///
-vector<int>* readFile(std::string filename)
+TemperatureColumn* readFile(std::string filename)
 {
-	vector<int>* data = new vector<int>;
+	TemperatureColumn* data = new TemperatureColumn;
 	ifstream file (filename);
 	string string;
 	int spaceCount = 0;
@@ -52,13 +73,82 @@ vector<int>* readFile(std::string filename)
 	return data;
 }
 
+///
+/// Splits a comma separated list of numbers, e.g. "1,5,95,99" for the -q option
+///
+std::vector<double> parseList(const std::string& list)
+{
+	std::vector<double> values;
+	std::stringstream stream(list);
+	std::string item;
+	while (std::getline(stream, item, ','))
+	{
+		if (!item.empty())
+			values.push_back(std::stod(item));
+	}
+	return values;
+}
+
+///
+/// Adds a space separated list of filter terms, e.g. "station=SCAMPTON year=1990..2000" for the -w option.
+/// Returns the first term that isn't valid, or an empty string if they all are.
+///
+std::string parseFilter(const std::string& terms, RecordFilter& filter)
+{
+	std::stringstream stream(terms);
+	std::string term;
+	while (stream >> term)
+	{
+		if (!parseFilterTerm(term, filter))
+			return term;
+	}
+	return "";
+}
+
+///
+/// Writes the -j trace and the summary next to it (trace.json gives trace.summary.json)
+///
+void write_trace(const Trace& trace, const std::string& path)
+{
+	std::string summaryPath = path;
+	if (summaryPath.size() > 5 && summaryPath.compare(summaryPath.size() - 5, 5, ".json") == 0)
+		summaryPath.erase(summaryPath.size() - 5);
+	summaryPath += ".summary.json";
+
+	if (trace.WriteChromeTrace(path) && trace.WriteSummary(summaryPath))
+		std::cout << "Trace written to " << path << " (summary " << summaryPath << ")" << std::endl;
+	else
+		std::cerr << "Unable to write the trace to " << path << std::endl;
+}
+
 void print_help() 
 {
 	std::cerr << "Application usage:" << std::endl;
 
 	std::cerr << "  -p : select platform " << std::endl;
-	std::cerr << "  -d : select device" << std::endl;
+	std::cerr << "  -f : batch mode, these files instead of the default one, comma separated with * and ? matching in file names (e.g. \"feeds/*.txt\")," << std::endl;
+	std::cerr << "       parsed side by side on -t threads and reduced on a device queue each (min, max, mean, variance only), the statistics also go to batch.csv" << std::endl;
+	std::cerr << "  -d : select device, or \"all\" to split the data over every device (on the -p platform if given)" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
+	std::cerr << "  -r : file reader, mmap (default), getline or device (the raw text is uploaded and parsed by the device)" << std::endl;
+	std::cerr << "  -t : number of threads for the mmap reader (default: all hardware threads)" << std::endl;
+	std::cerr << "  -c : binary cache of the parsed file, 1 (default) or 0 to always parse the text" << std::endl;
+	std::cerr << "  -q : extra percentiles to report, comma separated (e.g. 5,95)" << std::endl;
+	std::cerr << "  -s : stream the file in chunks of this many records instead of loading it all (min, max, mean, variance only)" << std::endl;
+	std::cerr << "  -b : number of rotating device buffers for -s (default: 2)" << std::endl;
+	std::cerr << "  -e : backend, opencl (default), cpu (native threads + SIMD) or auto (cpu for small inputs or without OpenCL)" << std::endl;
+	std::cerr << "  -i : query server, keeps the records on the device and answers queries read from stdin (e.g. minmax station=SCAMPTON year=1990..2000)" << std::endl;
+	std::cerr << "  -g : also report statistics grouped by station, year and/or month, comma separated (e.g. station,year)" << std::endl;
+	std::cerr << "  -m : also work out a rolling series over this many days per station (mean, min, max) with cumulative degree days" << std::endl;
+	std::cerr << "  -k : base temperature for the degree days of -m (default: 15.5)" << std::endl;
+	std::cerr << "  -o : CSV file for the -m series (default: series.csv)" << std::endl;
+	std::cerr << "  -n : also report this many of the hottest and coldest readings, with their station, date and time" << std::endl;
+	std::cerr << "  -x : work group size the min/max/sum reductions are specialised for, a power of 2 from 32 up to what the device allows, or auto to tune every kernel again (default: the device's tuning profile)" << std::endl;
+	std::cerr << "  -j : write a Chrome trace (chrome://tracing, ui.perfetto.dev) of every host phase and device command to this file, plus a summary" << std::endl;
+	std::cerr << "  -u : transfers, copy, zero (the device uses the parsed host memory in place) or auto (default: zero on CPU and integrated devices)" << std::endl;
+	std::cerr << "  -z : bits per temperature, 32 (default) or 16 to halve the memory the temperatures take and the bytes the kernels read (parsed straight into 16 bits, without the 32 bit binary cache)" << std::endl;
+	std::cerr << "  -w : only use the records matching these filters, station=NAME year=YYYY[..YYYY] date=YYYYMMDD[..YYYYMMDD] month=M[..M] time=HHMM[..HHMM]" << std::endl;
+	std::cerr << "       (e.g. -w \"station=SCAMPTON month=6..8\", not with -s)" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
@@ -69,117 +159,705 @@ int main(int argc, char **argv)
 	int platform_id = 0;
 	int device_id = 0;
 
+	// -d all splits the data over every device, only those on the -p platform if one was given
+	bool allDevices = false;
+	bool platformGiven = false;
+
 	// Type definitions declared and grouped here to find more easily
 	typedef int mytype;
-	typedef std::chrono::steady_clock::time_point TimePoint;
-	typedef std::chrono::high_resolution_clock Clock;
+	typedef std::chrono::steady_clock Clock;
+	typedef Clock::time_point TimePoint;
 
 	// Store the filename and it's absolute path separately and append them after to read the file.
 	// This allows the filename to be displayed without the entire path, and allows either to be changed without the other being affected
 	std::string fileName = "temp_lincolnshire.txt";
 	std::string filePath = "C:/Users/Computing/Documents/GitHub/ParallelAssignment/ParallelAssignment/x64/Debug/";
 	filePath.append(fileName);
+
+	// The memory mapped parser is the default, the original getline reader is kept as a baseline to compare against
+	std::string reader = "mmap";
+	unsigned int readerThreads = 0;
+	bool useCache = true;
+
+	// Batch mode, every file of the list is worked on side by side instead of the one file above
+	std::string batchList;
+	std::string batchPath = "batch.csv";
+
+	// Streaming mode, 0 loads the whole file
+	size_t streamChunk = 0;
+	size_t streamBuffers = 2;
+
+	// Backend for the statistics, the OpenCL path also runs the native CPU backend alongside for comparison
+	std::string backend = "opencl";
+
+	// Query server mode, answers statistics for any subset of the records until stdin is closed
+	bool serve = false;
+
+	// Columns for the grouped statistics table, 0 for none
+	int groupBy = 0;
+
+	// Work group size of the specialised reductions, 0 for the one in the device's tuning profile and -1 to tune again
+	int reduceSize = 0;
+
+	// Rolling series, a window of 0 days turns it off
+	int seriesWindow = 0;
+	float degreeBase = 15.5f;
+	std::string seriesPath = "series.csv";
+
+	// How many of the hottest and coldest readings to report, 0 for none
+	size_t topK = 0;
+
+	// Every phase goes on one timeline from here, written out as a Chrome trace if -j names a file
+	Trace trace;
+	std::string tracePath;
+
+	// How the temperatures get to the device, zero copy wraps the host memory they were parsed into instead of uploading it
+	std::string transfer = "auto";
+
+	// Device storage of the temperatures, 16 bit halves the upload and the bytes the reductions read
+	int storageBits = 32;
+
+	// Record filter, applied while parsing or (for records loaded from the binary cache) by compaction on the device
+	RecordFilter filter;
+	std::string filterText, badFilter;
+	bool deviceFilter = false;
+
+	// Percentiles always reported from the sorted data, -q adds more
+	std::vector<double> percentiles = { 25, 50, 75, 1, 99 };
 	
 	for (int i = 1; i < argc; i++)	
 	{
-		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); platformGiven = true; }
+		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { batchList = argv[++i]; }
+		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1)) && (strcmp(argv[i + 1], "all") == 0)) { allDevices = true; i++; }
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { reader = argv[++i]; }
+		else if ((strcmp(argv[i], "-t") == 0) && (i < (argc - 1))) { readerThreads = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-c") == 0) && (i < (argc - 1))) { useCache = (atoi(argv[++i]) != 0); }
+		else if ((strcmp(argv[i], "-q") == 0) && (i < (argc - 1))) { std::vector<double> extra = parseList(argv[++i]); percentiles.insert(percentiles.end(), extra.begin(), extra.end()); }
+		else if ((strcmp(argv[i], "-s") == 0) && (i < (argc - 1))) { streamChunk = strtoul(argv[++i], NULL, 10); }
+		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { streamBuffers = strtoul(argv[++i], NULL, 10); }
+		else if ((strcmp(argv[i], "-e") == 0) && (i < (argc - 1))) { backend = argv[++i]; }
+		else if ((strcmp(argv[i], "-g") == 0) && (i < (argc - 1))) { groupBy = ParseGroupBy(argv[++i]); }
+		else if ((strcmp(argv[i], "-x") == 0) && (i < (argc - 1))) { reduceSize = strcmp(argv[i + 1], "auto") == 0 ? -1 : atoi(argv[i + 1]); i++; }
+		else if ((strcmp(argv[i], "-m") == 0) && (i < (argc - 1))) { seriesWindow = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { degreeBase = (float)atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-j") == 0) && (i < (argc - 1))) { tracePath = argv[++i]; }
+		else if ((strcmp(argv[i], "-u") == 0) && (i < (argc - 1))) { transfer = argv[++i]; }
+		else if ((strcmp(argv[i], "-z") == 0) && (i < (argc - 1))) { storageBits = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { seriesPath = argv[++i]; }
+		else if ((strcmp(argv[i], "-n") == 0) && (i < (argc - 1))) { topK = strtoul(argv[++i], NULL, 10); }
+		else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { filterText += (filterText.empty() ? "" : " ") + std::string(argv[++i]); if (badFilter.empty()) badFilter = parseFilter(argv[i], filter); }
+		else if (strcmp(argv[i], "-i") == 0) { serve = true; }
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); }
 	}
 	
+	if (groupBy < 0)
+	{
+		std::cerr << "-g takes station, year and/or month" << std::endl;
+		return 1;
+	}
+	if (transfer != "copy" && transfer != "zero" && transfer != "auto")
+	{
+		std::cerr << "-u takes copy, zero or auto" << std::endl;
+		return 1;
+	}
+	if (!badFilter.empty())
+	{
+		std::cerr << "Bad -w filter '" << badFilter << "'" << std::endl;
+		return 1;
+	}
+	if (filter.Any() && streamChunk)
+	{
+		std::cerr << "-w can't be combined with -s" << std::endl;
+		return 1;
+	}
+	if (reader == "device" && (filter.Any() || streamChunk))
+	{
+		std::cerr << "-r device can't be combined with -w or -s" << std::endl;
+		return 1;
+	}
+
+	std::vector<std::string> batchFiles;
+	if (!batchList.empty())
+	{
+		if (streamChunk || allDevices || serve || reader != "mmap" || backend == "cpu")
+		{
+			std::cerr << "-f can't be combined with -s, -d all, -i, -e cpu or another -r reader" << std::endl;
+			return 1;
+		}
+		batchFiles = ExpandFileList(batchList);
+		if (batchFiles.empty())
+		{
+			std::cerr << "No files match -f " << batchList << std::endl;
+			return 1;
+		}
+	}
+
 	// Start the clock here for timing the file reading so it starts right before the reading, and ends straight after.
 	TimePoint timeStart = Clock::now();
 
 	// Host - Read the file and save the data here, this is the input for the kernels.
-	vector<int>* data = readFile(filePath);
+	// With the cache enabled every column is kept, the records are saved to <file>.bin after the first parse
+	// and later runs load that instead of the text, as long as the text file hasn't changed since.
+	// In streaming mode the file is read chunk by chunk later on, alongside the kernels, the device reader leaves it
+	// all to the device once there is one.
+	// With a filter (and no cache to load) the records that don't match are dropped by the parser before their
+	// temperature is even parsed, a cache loaded in full is filtered on the device instead.
+	TemperatureColumn* data = NULL;
+	WeatherData* records = NULL;
+
+	// With -z 16 on one device the temperatures are parsed straight into shorts and never held as ints, the cache is
+	// skipped as it only has ints. compactData is also set further down when ints read some other way are narrowed.
+	// tooWide is set once a 16 bit read has found a value that doesn't fit, so nothing tries to narrow them again.
+	Column<short>* compactData = NULL;
+	bool compactRead = storageBits == 16 && backend == "opencl" && !allDevices && !serve;
+	bool tooWide = false;
+	std::string cachePath = filePath + ".bin";
+	trace.Begin("read file");
+	try
+	{
+		if (streamChunk)
+		{
+			reader = "streamed";
+		}
+		else if (!batchFiles.empty())
+		{
+			// Every file is read in Batch, alongside the other files' kernels
+			reader = "mmap (batch)";
+		}
+		else if (reader == "device")
+		{
+			// Nothing is read here, see Device Parse
+		}
+		else if (filter.Any())
+		{
+			// The cache is never written from a filtered parse, it wouldn't have every record
+			records = useCache ? readCache(cachePath, filePath) : NULL;
+			if (records)
+			{
+				reader = "binary cache";
+				deviceFilter = true;
+			}
+			else
+			{
+				records = readRecordsMapped(filePath, readerThreads, &filter);
+				reader = "mmap (filtered while parsing)";
+			}
+			data = &records->temperature;
+		}
+		else if (reader == "getline")
+		{
+			data = readFile(filePath);
+		}
+		else if (compactRead)
+		{
+			try
+			{
+				compactData = readFileMapped<short>(filePath, readerThreads);
+				reader = "mmap (16 bit)";
+			}
+			catch (const ValueRangeError&)
+			{
+				tooWide = true;
+				std::cerr << "Warning: the temperatures don't fit in 16 bits, keeping them as 32 bit" << std::endl;
+				data = readFileMapped(filePath, readerThreads);
+			}
+		}
+		else if (!useCache)
+		{
+			data = readFileMapped(filePath, readerThreads);
+		}
+		else
+		{
+			records = readCache(cachePath, filePath);
+			if (records)
+			{
+				reader = "binary cache";
+			}
+			else
+			{
+				records = readRecordsMapped(filePath, readerThreads);
+				if (!writeCache(cachePath, filePath, *records))
+					std::cerr << "Unable to write binary cache " << cachePath << std::endl;
+			}
+			data = &records->temperature;
+		}
+	}
+	catch (const std::exception& err)
+	{
+		std::cerr << "ERROR: " << err.what() << std::endl;
+		return 1;
+	}
 	
 	// Stop the timer for the file reading, save the time and let the user know file reading has completed.
 	auto readTime = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - timeStart).count();
-	std::cout << "Reading file complete" << std::endl;
+	trace.End();
+	if (data || compactData)
+		std::cout << "Reading file complete" << std::endl;
 	timeStart = Clock::now();
 
-	int initalSize = data->size();
+	int initalSize = data ? data->size() : compactData ? compactData->size() : 0;
+	if ((data || compactData) && initalSize == 0)
+	{
+		std::cerr << "No records to work on" << (filter.Any() ? " (none match the -w filter)" : "") << std::endl;
+		return 1;
+	}
+
+#pragma region CPU Backend
+
+	// Auto picks the native backend when the input is too small to be worth the OpenCL setup, or when there is no OpenCL to use
+	if (backend == "auto")
+	{
+		backend = "opencl";
+		if (data && (size_t)initalSize < CPU_AUTO_THRESHOLD)
+			backend = "cpu";
+		else if (data)
+		{
+			try
+			{
+				if (GetDeviceIds().empty())
+					backend = "cpu";
+			}
+			catch (const cl::Error&)
+			{
+				backend = "cpu";
+			}
+		}
+	}
+
+	// Only the single device OpenCL path compacts on the device, the rest filter cached records on the host. So does
+	// -z 16, compaction would leave the matching temperatures on the device as ints.
+	if (deviceFilter && (backend == "cpu" || allDevices || serve || storageBits == 16))
+	{
+		filter.ResolveStation(records->stations);
+		filterRecords(*records, filter);
+		initalSize = (int)records->size();
+		deviceFilter = false;
+		if (initalSize == 0)
+		{
+			std::cerr << "No records to work on (none match the -w filter)" << std::endl;
+			return 1;
+		}
+	}
+
+	if (backend == "cpu")
+	{
+		if (!data)
+		{
+			std::cerr << "The cpu backend needs the whole file loaded, it can't be combined with -s or -r device" << std::endl;
+			return 1;
+		}
+
+		TimePoint cpuStart = Clock::now();
+		trace.Begin("cpu statistics");
+		Stats cpu = RunCpuStats(&(*data)[0], initalSize, readerThreads);
+		trace.End();
+		auto pCpu = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - cpuStart).count();
+		auto totalTime = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - timeStart).count() + readTime;
+
+		std::cout << "\n\n##========================== Details ==========================##\n" << std::endl;
+		std::cout << "Weather data file: " << fileName << std::endl;
+		std::cout << "Total data values: " << initalSize << std::endl;
+		std::cout << "File reader: " << reader << std::endl;
+		if (filter.Any())
+			std::cout << "Filter: " << filterText << std::endl;
+		std::cout << "Backend: cpu (" << CpuSimdName() << ")" << std::endl;
+		std::cout << "Read file run time: " << (readTime / 1000.0f) << " seconds" << std::endl;
+		std::cout << "Total run time: " << (totalTime / 1000.0f) << " seconds" << std::endl;
+
+		std::cout << "\n\n##========================== Results ==========================##\n" << std::endl;
+		std::cout << "CPU Stats (single pass)	|	Execution Time [ns]: " << pCpu << std::endl;
+		std::cout << "  Min = " << cpu.Min() << ", Max = " << cpu.Max() << ", Mean = " << std::fixed << std::setprecision(2) << cpu.Mean();
+		std::cout << ", Variance = " << cpu.Variance() << ", Standard Deviation = " << cpu.StdDev() << std::endl;
+		std::cout << "\n" << std::endl;
+		if (!tracePath.empty())
+			write_trace(trace, tracePath);
+		return 0;
+	}
+
+#pragma endregion
 
 	// Detect any potential exceptions
 	try 
 	{
+#pragma region Multi Device
+
+		// Every device gets its own context, queue and program and a share of the data in proportion to how fast it
+		// reduced a calibration sample, the per-device statistics are merged on the host
+		if (allDevices)
+		{
+			if (!data)
+			{
+				std::cerr << "-d all needs the whole file loaded, it can't be combined with -s or -r device" << std::endl;
+				return 1;
+			}
+
+			Stats total;
+			std::vector<DeviceShare> shares;
+			{
+				TraceScope splitting(&trace, "multi device");
+				shares = RunMultiDevice(*data, initalSize, 1024, total, platformGiven ? platform_id : -1);
+			}
+
+			// Every device has a clock of its own, so each one's queue is calibrated before its commands are added
+			for (size_t i = 0; i < shares.size(); i++)
+			{
+				if (shares[i].count == 0)
+					continue;
+				trace.Calibrate(shares[i].queue);
+				trace.Device(shares[i].write, "upload " + shares[i].name, "write");
+				trace.Device(shares[i].kernel, "reduce_stats " + shares[i].name);
+				trace.Device(shares[i].pending.read, "read partials " + shares[i].name, "read");
+			}
+			auto kernelTime = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - timeStart).count();
+			auto totalTime = kernelTime + readTime;
+
+			std::cout << "\n\n##========================== Details ==========================##\n" << std::endl;
+			std::cout << "Weather data file: " << fileName << std::endl;
+			std::cout << "Total data values: " << total.count << std::endl;
+			std::cout << "File reader: " << reader << std::endl;
+			if (filter.Any())
+				std::cout << "Filter: " << filterText << std::endl;
+			std::cout << "Devices: " << shares.size() << std::endl;
+			std::cout << "Read file run time: " << (readTime / 1000.0f) << " seconds" << std::endl;
+			std::cout << "Total run time: " << (totalTime / 1000.0f) << " seconds" << std::endl;
+
+			std::cout << "\n\n##========================== Results ==========================##\n" << std::endl;
+			std::cout << "Min = " << total.Min() << ", Max = " << total.Max() << std::endl;
+			std::cout << "\nMean = " << std::fixed << std::setprecision(2) << total.Mean() << std::endl;
+			std::cout << "\nVariance = " << total.Variance() << std::endl;
+			std::cout << "\nStandard Deviation = " << total.StdDev() << std::endl;
+
+			std::cout << "\n\n##========================== Profiling Data ==========================##\n" << std::endl;
+			for (size_t i = 0; i < shares.size(); i++)
+			{
+				const DeviceShare& share = shares[i];
+				std::cout << share.name << std::endl;
+				std::cout << "	Share		= " << (initalSize ? 100.0 * share.count / initalSize : 0.0) << "% (" << share.count << " values)" << std::endl;
+				if (share.count == 0)
+					continue;
+				std::cout << "	Upload		= " << GetExecutionTime(share.write) << " [ns]" << std::endl;
+				std::cout << "	Kernel		= " << GetExecutionTime(share.kernel) << " [ns]" << std::endl;
+				std::cout << "	Throughput	= " << share.throughput * 1000.0 << " [values/us]" << std::endl;
+			}
+			std::cout << "\n" << std::endl;
+			if (!tracePath.empty())
+				write_trace(trace, tracePath);
+			return 0;
+		}
+
+#pragma endregion
+
 		// Part 2 - Host operations
 		// 2.1 Select computing devices
+		TimePoint startupStart = Clock::now();
+		trace.Begin("create context");
 		cl::Context context = GetContext(platform_id, device_id);
+		trace.End();
 
 		// Display the selected device
 		std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
 
 		// Create a queue to push commands for the device, and enable profiling events to run (for measuring performance time)
 		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+		trace.Calibrate(queue);
 
 		//2.2 Load & build the device code
-		cl::Program::Sources sources;
+		// The built program is cached on disk per device, driver, build options and source, so only the first run compiles it.
+		// A failed build prints the build log and throws.
+		bool programCached = false;
+		trace.Begin("build program");
+		cl::Program program = BuildProgram(context, "my_kernels3.cl", "", &programCached);
+		trace.End();
+
+		auto startupTime = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - startupStart).count();
+		std::string startupSource = programCached ? "program binary from cache" : "program built from source";
+
+		// Launch configurations come from the device's tuning profile. The first run on a device and driver (or -x auto)
+		// times the tuned kernels over their work group sizes and values per work item and saves the fastest, every other
+		// kernel uses the largest work group size the device allows.
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		size_t local_size = DeviceLocalSize(device, sizeof(StatsPartial));
+		ReduceRegistry reductions(context);
+		TuningProfile tuning(device);
+		if (reduceSize < 0 || !tuning.Complete())
+		{
+			TraceScope tracing(&trace, "tune launches");
+			TuneLaunches(context, queue, program, reductions, tuning);
+			if (!tuning.Save())
+				std::cerr << "Unable to write tuning profile " << tuning.Filename() << std::endl;
+		}
 
-		AddSources(sources, "my_kernels3.cl");
+		// On a device that works out of host memory the buffers are wrapped around the page aligned columns the parser
+		// filled, uploading them would only make a second copy in the same memory
+		bool zeroCopy = transfer == "zero" || (transfer == "auto" && SharesHostMemory(device));
 
-		cl::Program program(context, sources);
+#pragma region Streaming
 
-		// Build and debug the kernel code
-		try 
+		// Out-of-core mode: only a few chunk sized buffers are ever allocated, whatever the size of the file
+		if (streamChunk)
 		{
-			program.build();
+			StreamingResult streamed;
+			{
+				TraceScope streaming(&trace, "stream file");
+				streamed = RunStreaming(context, queue, program, filePath, streamChunk, streamBuffers, local_size, readerThreads, 1024, storageBits == 16);
+			}
+			trace.Device(streamed.uploads, "upload chunk", "write");
+			trace.Device(streamed.kernels, "reduce_stats");
+			trace.Device(streamed.reads, "read partials", "read");
+			auto totalTime = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - timeStart).count();
+
+			std::cout << "\n\n##========================== Details ==========================##\n" << std::endl;
+			std::cout << "Weather data file: " << fileName << std::endl;
+			std::cout << "Total data values: " << streamed.stats.count << std::endl;
+			std::cout << "File reader: " << reader << " (" << streamed.chunks << " chunks of " << streamChunk << " records, " << streamBuffers << " buffers)" << std::endl;
+			std::cout << "Device memory: " << streamed.deviceBytes << " bytes" << std::endl;
+			std::cout << "Startup time: " << (startupTime / 1000.0f) << " seconds (" << startupSource << ")" << std::endl;
+			std::cout << "Total run time: " << (totalTime / 1000.0f) << " seconds" << std::endl;
+
+			std::cout << "\n\n##========================== Results ==========================##\n" << std::endl;
+			std::cout << "Min = " << streamed.stats.Min() << ", Max = " << streamed.stats.Max() << std::endl;
+			std::cout << "\nMean = " << std::fixed << std::setprecision(2) << streamed.stats.Mean() << std::endl;
+			std::cout << "\nVariance = " << streamed.stats.Variance() << std::endl;
+			std::cout << "\nStandard Deviation = " << streamed.stats.StdDev() << std::endl;
+
+			std::cout << "\n\n##========================== Profiling Data ==========================##\n" << std::endl;
+			std::cout << "Upload		= " << streamed.uploadTime / ProfilingResolution::PROF_US << " [us]" << std::endl;
+			std::cout << "Kernels		= " << streamed.kernelTime / ProfilingResolution::PROF_US << " [us]" << std::endl;
+			std::cout << "Read back	= " << streamed.readTime / ProfilingResolution::PROF_US << " [us]" << std::endl;
+			std::cout << "\n" << std::endl;
+			if (!tracePath.empty())
+				write_trace(trace, tracePath);
+			return 0;
 		}
-		catch (const cl::Error& err) 
+
+#pragma endregion
+
+#pragma region Batch
+
+		// Many files sharing this context and program, each parsed by a worker of a thread pool and reduced on a queue of
+		// its own, so the parsing of some files overlaps the kernels of others and the startup is only paid once
+		if (!batchFiles.empty())
 		{
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
+			LaunchConfig fallback = { local_size, 1 };
+			BatchResult batch;
+			{
+				TraceScope batching(&trace, "batch");
+				batch = RunBatch(context, program, batchFiles, tuning.Get("reduce_stats", fallback), readerThreads, zeroCopy, storageBits == 16,
+					filter.Any() ? &filter : NULL);
+			}
+			for (size_t i = 0; i < batch.files.size(); i++)
+			{
+				if (batch.files[i].upload())
+					trace.Device(batch.files[i].upload, "upload " + batch.files[i].filename, "write");
+				if (batch.files[i].kernel())
+					trace.Device(batch.files[i].kernel, "reduce " + batch.files[i].filename);
+			}
+			{
+				TraceScope writing(&trace, "write batch csv");
+				if (!WriteBatchCsv(batchPath, batch))
+					std::cerr << "Unable to write " << batchPath << std::endl;
+			}
+			auto totalTime = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - timeStart).count();
+
+			double parseTime = 0.0;
+			for (size_t i = 0; i < batch.files.size(); i++)
+				parseTime += batch.files[i].parseTime;
+
+			std::cout << "\n\n##========================== Details ==========================##\n" << std::endl;
+			std::cout << "Weather data files: " << batch.files.size() << " (" << batch.failed << " failed)" << std::endl;
+			std::cout << "Total data values: " << batch.total.count << std::endl;
+			std::cout << "File reader: " << reader << " (" << batch.workers << " workers, " << batch.threadsPerFile << " threads per file)" << std::endl;
+			if (filter.Any())
+				std::cout << "Filter: " << filterText << std::endl;
+			std::cout << "Startup time: " << (startupTime / 1000.0f) << " seconds (" << startupSource << ")" << std::endl;
+			std::cout << "Total run time: " << (totalTime / 1000.0f) << " seconds" << std::endl;
+
+			// Only the file names are shown here, batch.csv has the paths as they were given
+			std::cout << "\n\n##========================== Results ==========================##\n" << std::endl;
+			std::cout << std::left << std::setw(32) << "File" << std::right << std::setw(10) << "Count" << std::setw(9) << "Min" << std::setw(9) << "Max";
+			std::cout << std::setw(9) << "Mean" << std::setw(10) << "Variance" << std::setw(9) << "Std Dev" << std::endl;
+			std::cout << std::fixed << std::setprecision(2);
+			for (size_t i = 0; i <= batch.files.size(); i++)
+			{
+				bool combined = i == batch.files.size();
+				const Stats& stats = combined ? batch.total : batch.files[i].stats;
+				std::string name = combined ? "Combined" : batch.files[i].filename.substr(batch.files[i].filename.find_last_of("/\\") + 1);
+				std::cout << (combined ? "\n" : "") << std::left << std::setw(32) << name << std::right;
+				if (!combined && !batch.files[i].error.empty())
+					std::cout << "  ERROR: " << batch.files[i].error << std::endl;
+				else if (stats.count == 0)
+					std::cout << std::setw(10) << 0 << std::endl;
+				else
+				{
+					std::cout << std::setw(10) << stats.count << std::setw(9) << stats.Min() << std::setw(9) << stats.Max() << std::setw(9) << stats.Mean();
+					std::cout << std::setw(10) << stats.Variance() << std::setw(9) << stats.StdDev() << std::endl;
+				}
+			}
+			std::cout << "\nStatistics written to " << batchPath << std::endl;
+
+			std::cout << "\n\n##========================== Profiling Data ==========================##\n" << std::endl;
+			std::cout << "Parse		= " << parseTime << " [ms] over every file" << std::endl;
+			std::cout << "Upload		= " << batch.UploadTime() / ProfilingResolution::PROF_US << " [us]" << std::endl;
+			std::cout << "Kernels		= " << batch.KernelTime() / ProfilingResolution::PROF_US << " [us]" << std::endl;
+			std::cout << "\n" << std::endl;
+			if (!tracePath.empty())
+				write_trace(trace, tracePath);
+			return 0;
 		}
 
+#pragma endregion
+
+#pragma region Query Server
 
-		//Part 4 - memory allocation
+		// The filters need every column, not just the temperatures
+		if (serve)
+		{
+			if (!records)
+			{
+				TraceScope reading(&trace, "read records");
+				records = readRecordsMapped(filePath, readerThreads);
+			}
+
+			RunQueryServer(context, queue, program, *records, local_size, std::cin, std::cout, &trace);
+			if (!tracePath.empty())
+				write_trace(trace, tracePath);
+			return 0;
+		}
+
+#pragma endregion
 
-		//the following part adjusts the length of the input vector so it can be run for a specific workgroup size
-		//if the total input length is divisible by the workgroup size
-		//this makes the code more efficient
-		size_t local_size = 1024;
 
-		size_t padding_size = data->size() % local_size;
+#pragma region Filter
 
-		//if the input vector is not a multiple of the local_size
-		//insert additional neutral elements (0 for addition) so that the total will not be affected
-		if (padding_size) 
+		// Records loaded in full from the binary cache are compacted on the device, only the matching records are kept
+		// there and everything below works on those. The matching temperatures are the only thing read back, for the
+		// host side comparisons.
+		DeviceRecords filtered;
+		std::vector<cl::Event> filterEvents;
+		TemperatureColumn filteredData;
+		size_t unfilteredSize = initalSize;
+		if (deviceFilter)
 		{
-			//create an extra vector with neutral values
-			std::vector<int> A_ext(local_size-padding_size, 0);
-			//append that extra vector to our input
-			data->insert(data->end(), A_ext.begin(), A_ext.end());
+			filter.ResolveStation(records->stations);
+			cl::Buffer allTemperatures = zeroCopy ? ColumnBuffer(context, queue, records->temperature, true, CL_MEM_READ_ONLY) : cl::Buffer();
+			DeviceRecords all = UploadRecords(context, queue, *records, zeroCopy ? &allTemperatures : NULL);
+			filtered = CompactRecords(context, queue, program, all, filter, local_size, &filterEvents);
+			trace.Device(all.uploads, "upload records", "write");
+			trace.Device(filterEvents, "filter");
+			if (filtered.count == 0)
+			{
+				std::cerr << "No records to work on (none match the -w filter)" << std::endl;
+				return 1;
+			}
+
+			filteredData.resize(filtered.count);
+			cl::Event filteredRead;
+			queue.enqueueReadBuffer(filtered.temperature, CL_TRUE, 0, filtered.count * sizeof(mytype), &filteredData[0], NULL, &filteredRead);
+			trace.Device(filteredRead, "read filtered", "read");
+			data = &filteredData;
+			initalSize = (int)filtered.count;
 		}
+		uint64_t pFilter = 0;
+		for (size_t i = 0; i < filterEvents.size(); i++)
+			pFilter += GetExecutionTime(filterEvents[i]);
 
-#pragma region Kernel Buffers
+#pragma endregion
+
+#pragma region Device Parse
+
+		// The device reader uploads the file as it is and the device finds and parses every record's temperature into
+		// what becomes buffer_A, the host never holds the column and only reads it through a HostMapping
+		DeviceParse deviceParsed;
+		bool parsedOnDevice = reader == "device";
+		uint64_t pParse = 0, pParseUpload = 0;
+		if (parsedOnDevice)
+		{
+			{
+				TraceScope parsing(&trace, "parse on device");
+				deviceParsed = ParseOnDevice(context, queue, program, filePath, local_size);
+			}
+			trace.Device(deviceParsed.uploads, "upload text", "write");
+			trace.Device(deviceParsed.kernels, "parse text");
+			if (deviceParsed.count == 0)
+			{
+				std::cerr << "No records to work on" << std::endl;
+				return 1;
+			}
+
+			initalSize = (int)deviceParsed.count;
+			for (size_t i = 0; i < deviceParsed.kernels.size(); i++)
+				pParse += GetExecutionTime(deviceParsed.kernels[i]);
+			for (size_t i = 0; i < deviceParsed.uploads.size(); i++)
+				pParseUpload += GetExecutionTime(deviceParsed.uploads[i]);
+			std::cout << "Parsing file on the device complete" << std::endl;
+		}
+
+#pragma endregion
+
+		//Part 4 - memory allocation
+
+		// All of the kernels take the real number of values, so the input no longer has to be padded out to a multiple of local_size
 
-		size_t input_elements = data->size(); // Number of input elements
-		size_t input_size = data->size()*sizeof(mytype); // Size in bytes
-		size_t nr_groups = input_elements / local_size;
+#pragma region Kernel Buffers
 
-		// Host - Output vectors
-		size_t output_size = input_elements*sizeof(mytype); // Size in bytes
+		size_t input_elements = initalSize; // Number of input elements
+		size_t input_size = input_elements*sizeof(mytype); // Size in bytes
 
-		vector<mytype> B(input_elements);		
-		vector<mytype> C(input_elements);
-		vector<mytype> D(input_elements);
-		vector<mytype> E(input_elements);
-		vector<unsigned int> F(input_elements);
-		vector<mytype> G(input_elements);
-		vector<mytype> H(input_elements);
+		// Host - Results of the atomic kernels, they only ever write B[0] so that is all that is allocated and read back
+		size_t output_size = sizeof(mytype); // Size in bytes
+		mytype atomMin, atomMax;
 
+		// With -z 16 the temperatures read as ints (by the getline reader, or with the records for a filter) are narrowed
+		// to shorts here, the getline reader's own column is then let go. Values that don't fit in 16 bits stay ints, as
+		// do temperatures parsed on the device.
+		if (storageBits == 16 && !compactData && !parsedOnDevice && !tooWide)
+		{
+			Column<short>* narrowed = new Column<short>;
+			if (narrowTemperatures(*data, *narrowed))
+			{
+				compactData = narrowed;
+				if (!records)
+				{
+					delete data;
+					data = NULL;
+				}
+			}
+			else
+			{
+				delete narrowed;
+				std::cerr << "Warning: the temperatures don't fit in 16 bits, keeping them as 32 bit" << std::endl;
+			}
+		}
+		else if (storageBits == 16 && parsedOnDevice)
+			std::cerr << "Warning: -z 16 needs the temperatures parsed on the host, keeping them as 32 bit" << std::endl;
+		bool compact = compactData != NULL;
 
-		// Device - Buffers  |  One input buffer and several output buffers
-		cl::Buffer buffer_A(context, CL_MEM_READ_ONLY, input_size);
+		mytype first = 0;
+		if (parsedOnDevice)
+		{
+			cl::Event firstRead;
+			queue.enqueueReadBuffer(deviceParsed.temperature, CL_TRUE, 0, sizeof(mytype), &first, NULL, &firstRead);
+			trace.Device(firstRead, "read first value", "read");
+		}
+		else
+			first = compact ? (*compactData)[0] : (*data)[0];
+
+		// Device - Buffers  |  One input buffer and an output buffer for each atomic kernel
+		// A filter compacted on the device has already left the matching temperatures there, in zero copy mode
+		// buffer_A is *data itself and the host only reads it through a HostMapping from here on, the same as it does
+		// the temperatures parsed on the device. In compact mode buffer_A16 is the only copy on the device, the kernels
+		// without a 16 bit version widen it into a scratch buffer of their own while they run.
+		bool wrapped = zeroCopy && !deviceFilter && !parsedOnDevice;
+		cl::Buffer buffer_A = compact ? cl::Buffer() : deviceFilter ? filtered.temperature : parsedOnDevice ? deviceParsed.temperature :
+			wrapped ? ColumnBuffer(context, queue, *data, true) : cl::Buffer(context, CL_MEM_READ_WRITE, input_size);
+		cl::Buffer buffer_A16 = !compact ? cl::Buffer() : wrapped ? ColumnBuffer(context, queue, *compactData, true, CL_MEM_READ_ONLY) :
+			cl::Buffer(context, CL_MEM_READ_ONLY, input_elements * sizeof(short));
+		cl::Buffer& input = compact ? buffer_A16 : buffer_A;
+		size_t inputBytes = input.getInfo<CL_MEM_SIZE>();
 
-		cl::Buffer buffer_B(context, CL_MEM_READ_WRITE, output_size);
-		cl::Buffer buffer_C(context, CL_MEM_READ_WRITE, output_size);
-		cl::Buffer buffer_D(context, CL_MEM_READ_WRITE, output_size);
-		cl::Buffer buffer_E(context, CL_MEM_READ_WRITE, output_size);
-		cl::Buffer buffer_F(context, CL_MEM_READ_WRITE, output_size);
 		cl::Buffer buffer_G(context, CL_MEM_READ_WRITE, output_size);
 		cl::Buffer buffer_H(context, CL_MEM_READ_WRITE, output_size);
 
@@ -187,66 +865,114 @@ int main(int argc, char **argv)
 
 #pragma region Enqueue buffers + Create kernels
 
-		// Copy array A to and initialise other arrays on device memory
-		queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, input_size, &(*data)[0]);
-
-		// Zero buffer on device memory for output
-		queue.enqueueFillBuffer(buffer_B, 0, 0, output_size);
-		queue.enqueueFillBuffer(buffer_C, 0, 0, output_size);
-		queue.enqueueFillBuffer(buffer_D, 0, 0, output_size);
-		queue.enqueueFillBuffer(buffer_E, 0, 0, output_size);
-		queue.enqueueFillBuffer(buffer_F, 0, 0, output_size);
-		queue.enqueueFillBuffer(buffer_G, 0, 0, output_size);
-		queue.enqueueFillBuffer(buffer_H, 0, 0, output_size);
-
-		// Setup and execute all kernels (i.e. device code)
-		cl::Kernel kernel_1 = cl::Kernel(program, "reduce_find_min");
-		kernel_1.setArg(0, buffer_A);
-		kernel_1.setArg(1, buffer_B);
-		kernel_1.setArg(2, cl::Local(local_size*sizeof(mytype)));//local memory size
-
-		cl::Kernel kernel_2 = cl::Kernel(program, "reduce_find_max");
-		kernel_2.setArg(0, buffer_A);
-		kernel_2.setArg(1, buffer_C);
-		kernel_2.setArg(2, cl::Local(local_size * sizeof(mytype)));
+		// The two stage reductions are built from reduce_template.cl for the storage type and a fixed work group size on first use,
+		// the size tuned on the min reduction is used for all three
+		ReduceType reduceType = compact ? REDUCE_INT16 : REDUCE_INT32;
+		std::vector<size_t> reduceSizes = reductions.WorkGroupSizes(reduceType);
+		if (reduceSize > 0 && std::find(reduceSizes.begin(), reduceSizes.end(), (size_t)reduceSize) == reduceSizes.end())
+		{
+			std::cerr << "-x " << reduceSize << " isn't a work group size this device can run the reductions at, it takes";
+			for (size_t i = 0; i < reduceSizes.size(); i++)
+				std::cerr << (i ? ", " : " ") << reduceSizes[i];
+			std::cerr << " or auto" << std::endl;
+			return 1;
+		}
+		LaunchConfig reduceDefault = { reductions.DefaultWorkGroupSize(reduceType), 1 };
+		size_t reduce_size = reduceSize > 0 ? (size_t)reduceSize : tuning.Get(compact ? "reduce_short" : "reduce_int", reduceDefault).local_size;
+		LaunchConfig fallback = { local_size, 1 };
+		LaunchConfig launch1A = tuning.Get("at_find_min", fallback);
+		LaunchConfig launch2A = tuning.Get("at_find_max", fallback);
+		LaunchConfig launchStats = tuning.Get("reduce_stats", fallback);
+		LaunchConfig launchHistogram = tuning.Get("histogram_local", fallback);
+
+		// Everything from here to the variance goes into one event graph: each command waits only for the commands it
+		// depends on, independent ones (the reductions, the atomics, the fused kernel) can run at the same time, and the
+		// host waits once at the end instead of after every kernel
+		EventGraph graph(context);
+
+		// Copy array A to device memory unless the device is using it in place (or it is already there), as a
+		// non-blocking write in the graph, anything reading it waits for inputReady
+		std::vector<cl::Event> inputReady;
+		if (compact && !wrapped)
+			inputReady.push_back(graph.Write(buffer_A16, input_elements * sizeof(short), compactData->data()));
+		else if (!compact && !deviceFilter && !wrapped && !parsedOnDevice)
+			inputReady.push_back(graph.Write(buffer_A, input_size, &(*data)[0]));
+
+		// The atomic kernels min/max against B[0], so start them from the first value rather than 0
+		std::vector<cl::Event> readyG(inputReady), readyH(inputReady);
+		readyG.push_back(graph.Fill(buffer_G, first, output_size));
+		readyH.push_back(graph.Fill(buffer_H, first, output_size));
 
 // ======================== Atomic Kernels ======================== //
-		cl::Kernel kernel_1A = cl::Kernel(program, "at_find_min");
-		kernel_1A.setArg(0, buffer_A);
+		// The tuned sizes were found on the 32 bit kernels, the 16 bit ones may allow less
+		cl::Kernel kernel_1A = cl::Kernel(program, compact ? "at_find_min16" : "at_find_min");
+		launch1A.local_size = KernelLocalSize(context, kernel_1A, launch1A.local_size);
+		kernel_1A.setArg(0, input);
 		kernel_1A.setArg(1, buffer_G);
-		kernel_1A.setArg(2, cl::Local(local_size * sizeof(mytype)));
+		kernel_1A.setArg(2, cl::Local(launch1A.local_size * sizeof(mytype)));
+		kernel_1A.setArg(3, initalSize);
 
-		cl::Kernel kernel_2A = cl::Kernel(program, "at_find_max");
-		kernel_2A.setArg(0, buffer_A);
+		cl::Kernel kernel_2A = cl::Kernel(program, compact ? "at_find_max16" : "at_find_max");
+		launch2A.local_size = KernelLocalSize(context, kernel_2A, launch2A.local_size);
+		kernel_2A.setArg(0, input);
 		kernel_2A.setArg(1, buffer_H);
-		kernel_2A.setArg(2, cl::Local(local_size * sizeof(mytype)));
+		kernel_2A.setArg(2, cl::Local(launch2A.local_size * sizeof(mytype)));
+		kernel_2A.setArg(3, initalSize);
 // ======================== [END] Atomic Kernels ======================== //
 
-		cl::Kernel kernel_3 = cl::Kernel(program, "reduce_find_sum");
-		kernel_3.setArg(0, buffer_A);
-		kernel_3.setArg(1, buffer_D);
-		kernel_3.setArg(2, cl::Local(local_size * sizeof(mytype)));
-
 #pragma endregion
 
 #pragma region Profile Events + Call Kernels
 
 		// Create the profiling events that will measure the time each kernel takes to run
+		// The tree reductions run in two stages (per group partials, then the partials) so they have two events each
 		// 1A & 2A are the Atomic versions min/max, which are profile_event 1 & 2 respectively
-		cl::Event prof_event1;
+		cl::Event prof_event1, prof_event1B;
 		cl::Event prof_event1A;
-		cl::Event prof_event2;
+		cl::Event prof_event2, prof_event2B;
 		cl::Event prof_event2A;
-		cl::Event prof_event3;
-		cl::Event prof_event4; // These are for the variance kernel and the summing of that set of results
-		cl::Event prof_event5; // They need to be combined to give the total time to the variance result
-
-		// Call all the kernels in sequence - Except for the mean and standard deviation which require results from these to work
-		queue.enqueueNDRangeKernel(kernel_1, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event1);
-		queue.enqueueNDRangeKernel(kernel_2, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event2);
-		queue.enqueueNDRangeKernel(kernel_3, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event3);
-		queue.enqueueNDRangeKernel(kernel_1A, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event1A);
-		queue.enqueueNDRangeKernel(kernel_2A, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event2A);
+		cl::Event prof_event3, prof_event3B;
+
+		// Queue all the kernels, the reductions leave their (single value) results on the device and each read waits for
+		// the kernel it reads from
+		cl_long minResult, maxResult, sumResult;
+		cl::Buffer buffer_min(context, CL_MEM_READ_WRITE, sizeof(cl_long));
+		cl::Buffer buffer_max(context, CL_MEM_READ_WRITE, sizeof(cl_long));
+		cl::Buffer buffer_sum(context, CL_MEM_READ_WRITE, sizeof(cl_long));
+		const std::vector<cl::Event>* reduceAfter = inputReady.empty() ? NULL : &inputReady;
+		EnqueueTwoStageReduce<cl_long>(reductions, graph.Queue(), REDUCE_MIN, reduceType, input, initalSize, reduce_size, buffer_min, prof_event1, prof_event1B, reduceAfter);
+		EnqueueTwoStageReduce<cl_long>(reductions, graph.Queue(), REDUCE_MAX, reduceType, input, initalSize, reduce_size, buffer_max, prof_event2, prof_event2B, reduceAfter);
+		EnqueueTwoStageReduce<cl_long>(reductions, graph.Queue(), REDUCE_SUM, reduceType, input, initalSize, reduce_size, buffer_sum, prof_event3, prof_event3B, reduceAfter);
+		graph.Add(prof_event1, "reduce min"); graph.Add(prof_event2, "reduce max"); graph.Add(prof_event3, "reduce sum");
+		graph.Add(prof_event1B, "reduce min stage 2"); graph.Add(prof_event2B, "reduce max stage 2"); graph.Add(prof_event3B, "reduce sum stage 2");
+		graph.Read(buffer_min, sizeof(cl_long), &minResult, std::vector<cl::Event>(1, prof_event1B));
+		graph.Read(buffer_max, sizeof(cl_long), &maxResult, std::vector<cl::Event>(1, prof_event2B));
+		graph.Read(buffer_sum, sizeof(cl_long), &sumResult, std::vector<cl::Event>(1, prof_event3B));
+
+		// The atomic kernels are one work item per value, so round the global size up to whole work groups
+		prof_event1A = graph.Kernel(kernel_1A, cl::NDRange(launch1A.Groups(input_elements) * launch1A.local_size), cl::NDRange(launch1A.local_size), readyG);
+		prof_event2A = graph.Kernel(kernel_2A, cl::NDRange(launch2A.Groups(input_elements) * launch2A.local_size), cl::NDRange(launch2A.local_size), readyH);
+		graph.Read(buffer_G, output_size, &atomMin, std::vector<cl::Event>(1, prof_event1A));
+		graph.Read(buffer_H, output_size, &atomMax, std::vector<cl::Event>(1, prof_event2A));
+
+		// The fused kernel gets min, max, mean and variance from one pass over buffer_A (buffer_A16 in compact mode).
+		// Variance and standard deviation are taken from it, it keeps a running mean so there is no need to
+		// read the mean back and do a second pass over the data.
+		cl::Event prof_event6;
+		PendingStats pendingFused = EnqueueFusedStats(context, graph.Queue(), program, input, initalSize, launchStats.local_size, &prof_event6,
+			reduceAfter, launchStats.Groups(initalSize), compact);
+		graph.Add(prof_event6, "reduce_stats");
+		graph.Add(pendingFused.read, "read stats", "read");
+
+		// The sort only needs the input, so it goes on the in-order queue now and runs alongside the graph, its
+		// percentiles are read once the graph is done. The phases after it need the graph's min and max or the
+		// records on the host, they still run one after another on the in-order queue.
+		SortedBuffer sorted = RunBitonicSort(context, queue, program, input, initalSize, local_size, compact, reduceAfter);
+		queue.flush();
+
+		// The one point the host waits for the device
+		graph.Finish();
+		trace.Device(graph);
 
 #pragma endregion
 
@@ -255,71 +981,167 @@ int main(int argc, char **argv)
 		// Also stop the profile timers and save the values here
 
 		// Reduce Min
-		queue.enqueueReadBuffer(buffer_B, CL_TRUE, 0, output_size, &B[0]);
-		uint64_t p1 = prof_event1.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event1.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		uint64_t p1 = GetExecutionTime(prof_event1) + GetExecutionTime(prof_event1B);
 
 		// Reduce Max
-		queue.enqueueReadBuffer(buffer_C, CL_TRUE, 0, output_size, &C[0]);
-		uint64_t p2 = prof_event2.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event2.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		uint64_t p2 = GetExecutionTime(prof_event2) + GetExecutionTime(prof_event2B);
 
 		// Mean
-		queue.enqueueReadBuffer(buffer_D, CL_TRUE, 0, output_size, &D[0]);
-		uint64_t p3 = prof_event3.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event3.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		uint64_t p3 = GetExecutionTime(prof_event3) + GetExecutionTime(prof_event3B);
 
-		// Reduce Min
-		queue.enqueueReadBuffer(buffer_G, CL_TRUE, 0, output_size, &G[0]); // For the atomic version
-		uint64_t p1A = prof_event1A.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event1A.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		// Atomic Min
+		uint64_t p1A = GetExecutionTime(prof_event1A);
 
 		// Atomic Max
-		queue.enqueueReadBuffer(buffer_H, CL_TRUE, 0, output_size, &H[0]);
-		uint64_t p2A = prof_event2A.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event2A.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		////queue.enqueueReadBuffer(buffer_I, CL_TRUE, 0, output_size, &I[0]);
+		uint64_t p2A = GetExecutionTime(prof_event2A);
 
 #pragma endregion
 
 		// ===================== Kernel Results =====================
 
-		float minVal = (float)B[0] / 100.0f;
-		float maxVal = (float)C[0] / 100.0f;
-		float atomMinVal = (float)G[0] / 100.0f;
-		float atomMaxVal = (float)H[0] / 100.0f;
-		float mean = ((float)D[0] / data->size()) / 100.0f;
+		float minVal = (float)minResult / 100.0f;
+		float maxVal = (float)maxResult / 100.0f;
+		float atomMinVal = (float)atomMin / 100.0f;
+		float atomMaxVal = (float)atomMax / 100.0f;
+		float mean = (float)((double)sumResult / initalSize / 100.0);
 
 		// ===================== [END] Kernel Results =====================
 
 #pragma region Variance + Std Dev
-		
-		// This section calculates the variance and from that the standard deviation
-		// 1st create kernel_4 and give it the dataset.
-		// 2nd take the returned squared values from kernel_4 in buffer E and pass them to kernel_5 for summing
-
-		// Create new kernel. Initial size is to allow for padding protection on the X - mean calculation
-		cl::Kernel kernel_4 = cl::Kernel(program, "find_variance");
-		kernel_4.setArg(0, buffer_A);
-		kernel_4.setArg(1, buffer_E);
-		kernel_4.setArg(2, (int)(mean * 100));
-		kernel_4.setArg(3, initalSize);
-
-		// Call the kernel, then read the return buffer for results.
-		// Stop profile timer and save the value as well
-		queue.enqueueNDRangeKernel(kernel_4, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event4);
-		queue.enqueueReadBuffer(buffer_E, CL_TRUE, 0, output_size, &E[0]);
-		uint64_t p4 = prof_event4.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event4.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-
-		// Create new sum kernel. This sum divides by 10k to account for the exponential growth of 100^2
-		cl::Kernel kernel_5 = cl::Kernel(program, "reduce_find_sum_variance");
-		kernel_5.setArg(0, buffer_E);
-		kernel_5.setArg(1, buffer_F);
-		kernel_5.setArg(2, cl::Local(local_size * sizeof(mytype)));
-
-		// Call the kernel and read the return buffer
-		queue.enqueueNDRangeKernel(kernel_5, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event5);
-		queue.enqueueReadBuffer(buffer_F, CL_TRUE, 0, output_size, &F[0]);
-		uint64_t p5 = prof_event5.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event5.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+
+		// The fused kernel's partials came back with the rest of the graph
+		Stats fused = pendingFused.Finish();
+		uint64_t p6 = GetExecutionTime(prof_event6);
 
 		// ========== Results ==========
-		float variance = (float)F[0] / F.size();
-		float stdev = sqrt(variance);
+		float variance = fused.Variance();
+		float stdev = fused.StdDev();
+
+#pragma endregion
+
+#pragma region Sort + Percentiles
+
+		// The copy of the data sorted alongside the graph, only the ranks the percentiles need are read back
+		std::vector<cl::Event> percentileReads;
+		std::vector<float> percentileValues = ReadPercentiles(queue, sorted, percentiles, &percentileReads);
+		trace.Device(sorted.copies, "copy for sort", "write");
+		trace.Device(sorted.fills, "sort padding", "fill");
+		trace.Device(sorted.events, "bitonic sort");
+		trace.Device(percentileReads, "read percentiles", "read");
+		uint64_t pSort = sorted.ExecutionTime();
+
+#pragma endregion
+
+#pragma region Histogram
+
+		// A 0.1 degree histogram over the min..max range found above gives the same percentiles for the cost of one
+		// pass over the data, plus the mode. The summary is worked out on the host from the bins.
+		cl::Event prof_event7;
+		Histogram histogram = RunHistogram(context, queue, program, input, initalSize, (int)minResult, (int)maxResult, launchHistogram.local_size,
+			&prof_event7, 10, launchHistogram.Groups(initalSize), compact);
+		trace.Device(histogram.fill, "clear bins", "fill");
+		trace.Device(prof_event7, "histogram_local");
+		trace.Device(histogram.read, "read bins", "read");
+		HistogramSummary histogramSummary = histogram.Summarise(percentiles);
+		uint64_t p7 = GetExecutionTime(prof_event7);
+
+#pragma endregion
+
+#pragma region Extremes
+
+		// The host's records in the same order as buffer_A, so a value's index in it is its record's index. Records
+		// compacted on the device were loaded in full, the host drops the same ones the device did (once).
+		bool recordsMatchDevice = false;
+		auto deviceOrderRecords = [&]() -> WeatherData& {
+			if (!records)
+				records = readRecordsMapped(filePath, readerThreads);
+			if (deviceFilter && !recordsMatchDevice)
+				filterRecords(*records, filter);
+			recordsMatchDevice = true;
+			return *records;
+		};
+
+		// Top k selection of (value, index) pairs on the device, the indices then give each extreme reading's station,
+		// date and time with no second pass over the file
+		Extremes extremes;
+		if (topK > 0)
+		{
+			cl::Event widened;
+			cl::Buffer extremesInput = compact ? WidenBuffer(context, queue, program, buffer_A16, initalSize, local_size, &widened) : buffer_A;
+			extremes = RunExtremes(context, queue, program, extremesInput, initalSize, topK, local_size);
+			if (compact)
+				trace.Device(widened, "widen16");
+			trace.Device(extremes.events, "top k");
+			trace.Device(extremes.reads, "read top k", "read");
+			deviceOrderRecords();
+		}
+
+#pragma endregion
+
+#pragma region CPU Comparison
+
+		// The same statistics from the native backend, printed next to the fused kernel's
+		trace.Begin("cpu comparison");
+		TimePoint cpuStart = Clock::now();
+		Stats cpu;
+		if (compact && wrapped)
+		{
+			HostMapping mapped(queue, buffer_A16, initalSize * sizeof(short));
+			cpu = RunCpuStats((const short*)mapped.ptr, initalSize, readerThreads);
+		}
+		else if (compact)
+			cpu = RunCpuStats(compactData->data(), initalSize, readerThreads);
+		else if (wrapped || parsedOnDevice)
+		{
+			HostMapping mapped(queue, buffer_A, input_size);
+			cpu = RunCpuStats((const mytype*)mapped.ptr, initalSize, readerThreads);
+		}
+		else
+			cpu = RunCpuStats(&(*data)[0], initalSize, readerThreads);
+		trace.End();
+		auto pCpu = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - cpuStart).count();
+
+#pragma endregion
+
+#pragma region Grouped Statistics
+
+		// Keyed reduction over the station and date columns, the temperatures already in buffer_A are reused. In compact
+		// mode the records' own temperatures are uploaded for it and released again after.
+		GroupedStats grouped;
+		if (groupBy)
+		{
+			if (!records)
+				records = readRecordsMapped(filePath, readerThreads);
+
+			DeviceRecords columns = deviceFilter ? filtered : UploadRecords(context, queue, *records, compact ? NULL : &buffer_A);
+			grouped = RunGroupedStats(context, queue, program, columns, *records, groupBy, local_size);
+			if (!deviceFilter)
+				trace.Device(columns.uploads, "upload records", "write");
+			trace.Device(grouped.events, "grouped stats");
+			trace.Device(grouped.reads, "read group totals", "read");
+		}
+
+#pragma endregion
+
+#pragma region Rolling Series
+
+		// Scan based rolling window and cumulative series, buffer_A already holds the temperatures in file order (in
+		// compact mode the series uploads the records' own while it runs)
+		RollingSeries series;
+		if (seriesWindow > 0)
+		{
+			// The series is written out with every record's station and date, so the host needs the same subset the device has
+			deviceOrderRecords();
+
+			series = RunRollingSeries(context, queue, program, *records, seriesWindow, (int)std::lround(degreeBase * 100.0f), local_size, compact ? NULL : &buffer_A);
+			trace.Device(series.uploads, "upload series columns", "write");
+			trace.Device(series.events, "rolling series");
+			trace.Device(series.reads, "read series", "read");
+
+			TraceScope writing(&trace, "write series csv");
+			if (!WriteSeriesCsv(seriesPath, *records, series))
+				std::cerr << "Unable to write " << seriesPath << std::endl;
+		}
 
 #pragma endregion
 
@@ -332,8 +1154,28 @@ int main(int argc, char **argv)
 		// ================================== Printing Details ================================== //
 		std::cout << "\n\n##========================== Details ==========================##\n" << std::endl;
 		std::cout << "Weather data file: " << fileName << std::endl;
-		std::cout << "Total data values: " << (*data).size() << std::endl;
+		std::cout << "Total data values: " << initalSize << std::endl;
+		std::cout << "File reader: " << reader;
+		if (parsedOnDevice)
+			std::cout << " (" << deviceParsed.chunks << " chunks of raw text)";
+		std::cout << std::endl;
+		if (filter.Any())
+		{
+			std::cout << "Filter: " << filterText;
+			if (deviceFilter)
+				std::cout << " (" << initalSize << " of " << unfilteredSize << " records, compacted on the device)";
+			std::cout << std::endl;
+		}
 		std::cout << "Read file run time: " << (readTime / 1000.0f) << " seconds" << std::endl;
+		std::cout << "Startup time: " << (startupTime / 1000.0f) << " seconds (" << startupSource << ")" << std::endl;
+		std::cout << "Transfers: " << (zeroCopy ? "zero copy, the device uses the host memory in place" : "copied to the device") << std::endl;
+		std::cout << "Device storage: " << (compact ? 16 : 32) << " bit temperatures (" << inputBytes << " bytes " << (wrapped ? "of host memory used in place" : "on the device");
+		std::cout << ", " << input_elements * (compact ? sizeof(short) : sizeof(mytype)) << " bytes read per reduction)" << std::endl;
+		std::cout << "Launches: work groups of " << local_size << ", tuned " << (tuning.Loaded() && reduceSize >= 0 ? "on an earlier run" : "on this run") << " (" << tuning.Filename() << "): ";
+		std::cout << "reduce_stats " << launchStats.local_size << " x " << launchStats.per_item << ", histogram_local " << launchHistogram.local_size << " x " << launchHistogram.per_item;
+		std::cout << ", at_find_min " << launch1A.local_size << ", at_find_max " << launch2A.local_size << std::endl;
+		std::cout << "Reductions: " << ReduceTypeName(reduceType) << " with a work group size of " << reduce_size << (reduceSize > 0 ? " (-x)" : " (tuned)");
+		std::cout << ", " << reductions.programs.size() << " variants (" << reductions.builds << " built, " << reductions.cacheLoads << " from cache)" << std::endl;
 		std::cout << "Total run time: " << (totalTime / 1000.0f) << " seconds" << std::endl;
 
 		// ================================== Printing results ================================== //
@@ -343,30 +1185,112 @@ int main(int argc, char **argv)
 		std::cout << "Atomic Min = " << atomMinVal << "	|	Execution Time [ns]: " << p1A << std::endl;
 
 		std::cout << "\nReduce Max = " << maxVal << "		|	Execution Time [ns]: " << p2 << std::endl;
-		std::cout << "Atomic Max = " << maxVal << "		|	Execution Time [ns]: " << p2A << std::endl;
+		std::cout << "Atomic Max = " << atomMaxVal << "		|	Execution Time [ns]: " << p2A << std::endl;
 
 		std::cout << "\nMean = " << std::fixed << std::setprecision(2) << mean << "		|	Execution Time [ns]: " << p3 << std::endl;
 
-		std::cout << "\nVariance = " << std::fixed << std::setprecision(2) << variance << "	|	Execution Time [ns]: " << (p4 + p5) << std::endl;
+		std::cout << "\nVariance = " << std::fixed << std::setprecision(2) << variance << "	|	Execution Time [ns]: " << p6 << std::endl;
 		std::cout << "\nStandard Deviation = " << std::fixed << std::setprecision(2) << stdev << std::endl;
 
-		//std::cout << "\n\nSort: " << I[0] << "  -  " << I[initalSize - 1] << std::endl;
+		std::cout << "\nMedian = " << percentileValues[1] << "		|	Execution Time [ns]: " << pSort << " (sort, " << sorted.events.size() << " launches)" << std::endl;
+		std::cout << "Lower Quartile = " << percentileValues[0] << ", Upper Quartile = " << percentileValues[2] << std::endl;
+		std::cout << "P1 = " << percentileValues[3] << ", P99 = " << percentileValues[4] << std::endl;
+		for (size_t i = 5; i < percentiles.size(); i++)
+			std::cout << "P" << percentiles[i] << " = " << percentileValues[i] << std::endl;
+
+		std::cout << "\nHistogram Mode = " << histogramSummary.mode << " (" << histogramSummary.modeCount << " readings)	|	Execution Time [ns]: " << p7 << std::endl;
+		std::cout << "Histogram Median = " << histogramSummary.percentiles[1] << ", Lower Quartile = " << histogramSummary.percentiles[0];
+		std::cout << ", Upper Quartile = " << histogramSummary.percentiles[2] << std::endl;
+		std::cout << "Histogram P1 = " << histogramSummary.percentiles[3] << ", P99 = " << histogramSummary.percentiles[4];
+		std::cout << "  (" << histogram.bins.size() << " bins of " << histogram.binWidth / 100.0f << " degrees)" << std::endl;
+
+		std::cout << "\nFused Stats (single pass)	|	Execution Time [ns]: " << p6 << std::endl;
+		std::cout << "  Min = " << fused.Min() << ", Max = " << fused.Max() << ", Mean = " << fused.Mean();
+		std::cout << ", Variance = " << fused.Variance() << ", Standard Deviation = " << fused.StdDev() << std::endl;
+
+		std::cout << "CPU Stats (" << CpuSimdName() << ")		|	Execution Time [ns]: " << pCpu << std::endl;
+		std::cout << "  Min = " << cpu.Min() << ", Max = " << cpu.Max() << ", Mean = " << cpu.Mean();
+		std::cout << ", Variance = " << cpu.Variance() << ", Standard Deviation = " << cpu.StdDev() << std::endl;
+
+
+		if (topK > 0)
+		{
+			std::cout << "\n\n##========================== Extremes ==========================##\n" << std::endl;
+			const std::vector<Extreme>* lists[] = { &extremes.hottest, &extremes.coldest };
+			for (int l = 0; l < 2; l++)
+			{
+				std::cout << (l ? "\nColdest " : "Hottest ") << lists[l]->size() << " readings";
+				if (l == 0)
+					std::cout << "	|	Execution Time [ns]: " << extremes.ExecutionTime() << " (" << extremes.events.size() << " launches)";
+				std::cout << std::endl;
+				for (size_t i = 0; i < lists[l]->size(); i++)
+				{
+					int r = (*lists[l])[i].index;
+					std::cout << "  " << std::setw(7) << (*lists[l])[i].value / 100.0f << "  " << std::left << std::setw(16) << records->stations[records->station[r]] << std::right;
+					std::cout << " " << records->date[r] << " " << std::setw(4) << std::setfill('0') << records->time[r] << std::setfill(' ') << std::endl;
+				}
+			}
+		}
+
+		if (groupBy)
+		{
+			std::cout << "\n\n##========================== Grouped Results ==========================##\n" << std::endl;
+			std::cout << FormatGroupTable(grouped, *records);
+			std::cout << "\n" << grouped.rows.size() << " groups	|	Execution Time [ns]: " << grouped.ExecutionTime() << " (" << grouped.passes << " passes)" << std::endl;
+		}
+
+		if (seriesWindow > 0)
+		{
+			std::cout << "\n\n##========================== Rolling Series ==========================##\n" << std::endl;
+			std::cout << series.points.size() << " points (" << series.window << " day window, degree days below " << degreeBase << ") written to " << seriesPath;
+			std::cout << "	|	Execution Time [ns]: " << series.ExecutionTime() << " (" << series.events.size() << " launches)" << std::endl;
+			for (size_t i = 0; i < series.points.size(); i++)
+			{
+				// Each station's last point has its final rolling values and its total degree days
+				if (i + 1 < series.points.size() && records->station[series.order[i + 1]] == records->station[series.order[i]])
+					continue;
+				const SeriesPoint& last = series.points[i];
+				std::cout << "  " << std::left << std::setw(16) << records->stations[records->station[series.order[i]]] << std::right;
+				std::cout << " to " << records->date[series.order[i]] << ": Mean = " << last.mean << ", Min = " << last.min / 100.0f << ", Max = " << last.max / 100.0f;
+				std::cout << " (" << last.count << " readings), Degree Days = " << last.degreeDays / 100.0 << std::endl;
+			}
+		}
 
 		// ================================== Printing Profiling Data ================================== //
 		std::cout << "\n\n##========================== Profiling Data ==========================##\n" << std::endl;
 
-		std::cout << "Reduce Min	= " << GetFullProfilingInfo(prof_event1, ProfilingResolution::PROF_US) << endl;
+		std::cout << "Reduce Min	= " << GetFullProfilingInfo(prof_event1, ProfilingResolution::PROF_US) << " + " << GetFullProfilingInfo(prof_event1B, ProfilingResolution::PROF_US) << endl;
 		std::cout << "Atomic Min	= " << GetFullProfilingInfo(prof_event1A, ProfilingResolution::PROF_US) << endl;
 
-		std::cout << "\nReduce Max	= " << GetFullProfilingInfo(prof_event2, ProfilingResolution::PROF_US) << endl;
+		std::cout << "\nReduce Max	= " << GetFullProfilingInfo(prof_event2, ProfilingResolution::PROF_US) << " + " << GetFullProfilingInfo(prof_event2B, ProfilingResolution::PROF_US) << endl;
 		std::cout << "Atomic Max	= " <<GetFullProfilingInfo(prof_event2A, ProfilingResolution::PROF_US) << endl;
 
-		std::cout << "\nMean		= " <<GetFullProfilingInfo(prof_event3, ProfilingResolution::PROF_US) << endl;
-		std::cout << "Variance	= " << GetFullProfilingInfo(prof_event4, ProfilingResolution::PROF_US) << endl;
+		std::cout << "\nMean		= " <<GetFullProfilingInfo(prof_event3, ProfilingResolution::PROF_US) << " + " << GetFullProfilingInfo(prof_event3B, ProfilingResolution::PROF_US) << endl;
+		std::cout << "Variance	= " << GetFullProfilingInfo(prof_event6, ProfilingResolution::PROF_US) << endl;
+		std::cout << "Graph		= " << (graph.Span() / ProfilingResolution::PROF_US) << " [us] from first start to last end, " << (graph.Busy() / ProfilingResolution::PROF_US);
+		std::cout << " [us] of commands on " << graph.QueueCount() << (graph.OutOfOrder() ? " out-of-order" : " in-order") << " queue(s)" << endl;
+		std::cout << "Histogram	= " << GetFullProfilingInfo(prof_event7, ProfilingResolution::PROF_US) << endl;
+		std::cout << "Sort		= " << (pSort / ProfilingResolution::PROF_US) << " [us] over " << sorted.events.size() << " launches" << endl;
+		if (deviceFilter)
+			std::cout << "Filter		= " << (pFilter / ProfilingResolution::PROF_US) << " [us] over " << filterEvents.size() << " launches" << endl;
+		if (parsedOnDevice)
+		{
+			std::cout << "Parse		= " << (pParse / ProfilingResolution::PROF_US) << " [us] over " << deviceParsed.kernels.size() << " launches, after ";
+			std::cout << (pParseUpload / ProfilingResolution::PROF_US) << " [us] of uploads" << endl;
+		}
+		if (seriesWindow > 0)
+			std::cout << "Series		= " << (series.ExecutionTime() / ProfilingResolution::PROF_US) << " [us] over " << series.events.size() << " launches" << endl;
+		if (topK > 0)
+			std::cout << "Extremes	= " << (extremes.ExecutionTime() / ProfilingResolution::PROF_US) << " [us] over " << extremes.events.size() << " launches" << endl;
+		if (groupBy)
+			std::cout << "Grouped		= " << (grouped.ExecutionTime() / ProfilingResolution::PROF_US) << " [us] over " << grouped.events.size() << " launches" << endl;
 		std::cout << "\n" << endl;
 
 #pragma endregion
 
+		if (!tracePath.empty())
+			write_trace(trace, tracePath);
+
 		std::system("pause");
 
 	}
@@ -374,6 +1298,10 @@ int main(int argc, char **argv)
 	{
 		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
 	}
+	catch (const std::exception& err)
+	{
+		std::cerr << "ERROR: " << err.what() << std::endl;
+	}
 
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <climits>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+
+///
+/// Values sorted on the device by RunBitonicSort(). Only the first count entries are real data,
+/// the rest of the buffer is INT_MAX padding up to a power of 2.
+///
+struct SortedBuffer
+{
+	cl::Buffer buffer;
+	size_t count;
+	size_t padded;
+	std::vector<cl::Event> events;	// every launch of the sort, for profiling
+	std::vector<cl::Event> copies;	// the input copied into buffer, for tracing
+	std::vector<cl::Event> fills;	// the padding
+
+	cl_ulong ExecutionTime() const
+	{
+		cl_ulong total = 0;
+		for (size_t i = 0; i < events.size(); i++)
+			total += events[i].getProfilingInfo<CL_PROFILING_COMMAND_END>() - events[i].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		return total;
+	}
+};
+
+///
+/// Sorts a copy of the first N values of input with a bitonic sort, input itself is left as it was.
+///
+/// The copy is padded with INT_MAX to a power of 2 so the padding sorts to the end. Each work group first sorts
+/// its own block in local memory, then for every larger merge size k the long distance steps run one launch each
+/// in global memory and the last log2(local_size) steps run together in local memory.
+/// local_size must be a power of 2, it is lowered to what the three sort kernels allow. compact means input holds 16 bit values, widen16 widens them into the copy.
+/// Nothing here blocks, the copy waits for wait_list (optional) and the rest is ordered by queue, which must be in-order.
+/// The widening is one of the sort's launches in events.
+///
+SortedBuffer RunBitonicSort(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, cl::Buffer& input, size_t N, size_t local_size,
+	bool compact = false, const std::vector<cl::Event>* wait_list = NULL)
+{
+	SortedBuffer sorted;
+	sorted.count = N;
+	sorted.padded = 1;
+	while (sorted.padded < N)
+		sorted.padded *= 2;
+
+	cl::Kernel kernel_local = cl::Kernel(program, "bitonic_sort_local");
+	cl::Kernel kernel_global = cl::Kernel(program, "bitonic_merge_global");
+	cl::Kernel kernel_merge = cl::Kernel(program, "bitonic_merge_local");
+
+	// A data set smaller than one work group is sorted by a single, smaller, group. Every launch has to use the same
+	// size, the steps are split between global and local memory on it.
+	local_size = std::min(local_size, sorted.padded);
+	local_size = KernelLocalSize(context, kernel_local, KernelLocalSize(context, kernel_global, KernelLocalSize(context, kernel_merge, local_size)));
+
+	sorted.buffer = cl::Buffer(context, CL_MEM_READ_WRITE, sorted.padded * sizeof(cl_int));
+	if (compact)
+	{
+		cl::Kernel kernel_widen = cl::Kernel(program, "widen16");
+		kernel_widen.setArg(0, input);
+		kernel_widen.setArg(1, (cl_int)N);
+		kernel_widen.setArg(2, sorted.buffer);
+		size_t widen_elements = std::max((size_t)1, N / 8);
+		size_t widen_local = KernelLocalSize(context, kernel_widen, local_size);
+		sorted.events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel_widen, cl::NullRange, cl::NDRange(((widen_elements + widen_local - 1) / widen_local) * widen_local), cl::NDRange(widen_local),
+			wait_list, &sorted.events.back());
+	}
+	else
+	{
+		sorted.copies.push_back(cl::Event());
+		queue.enqueueCopyBuffer(input, sorted.buffer, 0, 0, N * sizeof(cl_int), wait_list, &sorted.copies.back());
+	}
+	if (sorted.padded > N)
+	{
+		sorted.fills.push_back(cl::Event());
+		queue.enqueueFillBuffer(sorted.buffer, (cl_int)INT_MAX, N * sizeof(cl_int), (sorted.padded - N) * sizeof(cl_int), NULL, &sorted.fills.back());
+	}
+
+	kernel_local.setArg(0, sorted.buffer);
+	kernel_local.setArg(1, cl::Local(local_size * sizeof(cl_int)));
+
+	kernel_global.setArg(0, sorted.buffer);
+
+	kernel_merge.setArg(0, sorted.buffer);
+	kernel_merge.setArg(2, cl::Local(local_size * sizeof(cl_int)));
+
+	cl::NDRange global(sorted.padded), local(local_size);
+
+	sorted.events.push_back(cl::Event());
+	queue.enqueueNDRangeKernel(kernel_local, cl::NullRange, global, local, NULL, &sorted.events.back());
+
+	for (size_t k = local_size * 2; k <= sorted.padded; k *= 2)
+	{
+		for (size_t j = k / 2; j >= local_size; j /= 2)
+		{
+			kernel_global.setArg(1, (cl_int)j);
+			kernel_global.setArg(2, (cl_int)k);
+			sorted.events.push_back(cl::Event());
+			queue.enqueueNDRangeKernel(kernel_global, cl::NullRange, global, local, NULL, &sorted.events.back());
+		}
+
+		kernel_merge.setArg(1, (cl_int)k);
+		sorted.events.push_back(cl::Event());
+		queue.enqueueNDRangeKernel(kernel_merge, cl::NullRange, global, local, NULL, &sorted.events.back());
+	}
+
+	return sorted;
+}
+
+///
+/// Reads the p-th percentile (0 to 100) from a sorted buffer, interpolating linearly between the two closest ranks.
+/// Only the one or two values needed are read back, not the sorted array. Returns the value still * 100.
+/// The read's event is added to reads (optional).
+///
+double ReadPercentile(cl::CommandQueue& queue, const SortedBuffer& sorted, double p, std::vector<cl::Event>* reads = NULL)
+{
+	if (sorted.count == 0)
+		return 0.0;
+
+	double position = std::min(std::max(p, 0.0), 100.0) / 100.0 * (sorted.count - 1);
+	size_t lower = (size_t)std::floor(position);
+	size_t upper = std::min(lower + 1, sorted.count - 1);
+
+	cl_int values[2];
+	cl::Event read;
+	queue.enqueueReadBuffer(sorted.buffer, CL_TRUE, lower * sizeof(cl_int), (upper - lower + 1) * sizeof(cl_int), values, NULL, &read);
+	if (reads)
+		reads->push_back(read);
+	if (upper == lower)
+		return values[0];
+
+	return values[0] + (values[1] - values[0]) * (position - lower);
+}
+
+///
+/// Reads several percentiles at once, returned in degrees in the same order as requested
+///
+std::vector<float> ReadPercentiles(cl::CommandQueue& queue, const SortedBuffer& sorted, const std::vector<double>& percentiles,
+	std::vector<cl::Event>* reads = NULL)
+{
+	std::vector<float> values;
+	for (size_t i = 0; i < percentiles.size(); i++)
+		values.push_back((float)(ReadPercentile(queue, sorted, percentiles[i], reads) / 100.0));
+	return values;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <climits>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+
+///
+/// One work group's result from the reduce_stats kernel, must match the struct in my_kernels3.cl
+///
+struct StatsPartial
+{
+	cl_int count;
+	cl_int min;
+	cl_int max;
+	cl_float mean;
+	cl_float m2;
+};
+
+///
+/// Combined statistics for a set of values stored * 100.
+/// The partials are merged in double on the host with the same Chan et al. formula the kernel uses.
+///
+struct Stats
+{
+	size_t count;
+	int min;
+	int max;
+	double mean;	// still * 100
+	double m2;		// still * 100^2
+
+	Stats() : count(0), min(INT_MAX), max(INT_MIN), mean(0.0), m2(0.0) {}
+
+	void merge(size_t otherCount, int otherMin, int otherMax, double otherMean, double otherM2)
+	{
+		if (otherCount == 0)
+			return;
+
+		size_t total = count + otherCount;
+		double delta = otherMean - mean;
+		double weight = (double)otherCount / (double)total;
+		mean += delta * weight;
+		m2 += otherM2 + delta * delta * (double)count * weight;
+		min = std::min(min, otherMin);
+		max = std::max(max, otherMax);
+		count = total;
+	}
+
+	void merge(const StatsPartial& p) { merge((size_t)p.count, p.min, p.max, p.mean, p.m2); }
+	void merge(const Stats& s) { merge(s.count, s.min, s.max, s.mean, s.m2); }
+
+	// Results converted back to degrees, the variance is the population variance like the original kernels
+	float Min() const { return min / 100.0f; }
+	float Max() const { return max / 100.0f; }
+	float Mean() const { return (float)(mean / 100.0); }
+	float Variance() const { return count ? (float)(m2 / count / 10000.0) : 0.0f; }
+	float StdDev() const { return std::sqrt(Variance()); }
+};
+
+///
+/// A reduce_stats launch that has been queued but not waited for, see EnqueueFusedStats()
+///
+struct PendingStats
+{
+	cl::Buffer partials;
+	std::shared_ptr<std::vector<StatsPartial> > results;	// shared so the read target stays put if this is copied
+	cl::Event read;
+
+	///
+	/// Waits for the partials to arrive and merges them
+	///
+	Stats Finish()
+	{
+		read.wait();
+		Stats stats;
+		for (size_t i = 0; i < results->size(); i++)
+			stats.merge((*results)[i]);
+		return stats;
+	}
+};
+
+///
+/// Queues the fused reduce_stats kernel over the first N values of input, and a non-blocking read of the group partials.
+/// The number of groups is capped so each work item reduces several values before the local memory stage,
+/// which keeps the partials buffer (and the read back) small. wait_list (optional) is passed on to the kernel.
+/// compact means input holds 16 bit values, which reduce_stats16 reduces instead.
+///
+PendingStats EnqueueFusedStats(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, cl::Buffer& input, size_t N,
+	size_t local_size, cl::Event* prof_event = NULL, const std::vector<cl::Event>* wait_list = NULL, size_t max_groups = 1024,
+	bool compact = false)
+{
+	cl::Kernel kernel = cl::Kernel(program, compact ? "reduce_stats16" : "reduce_stats");
+	local_size = KernelLocalSize(context, kernel, local_size);
+	size_t nr_groups = std::max((size_t)1, std::min((N + local_size - 1) / local_size, max_groups));
+
+	PendingStats pending;
+	pending.partials = cl::Buffer(context, CL_MEM_WRITE_ONLY, nr_groups * sizeof(StatsPartial));
+	pending.results = std::make_shared<std::vector<StatsPartial> >(nr_groups);
+
+	kernel.setArg(0, input);
+	kernel.setArg(1, (cl_int)N);
+	kernel.setArg(2, pending.partials);
+	kernel.setArg(3, cl::Local(local_size * sizeof(StatsPartial)));
+
+	// The read waits for the kernel explicitly, so this also works on an out-of-order queue
+	cl::Event reduced;
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), wait_list, &reduced);
+	if (prof_event)
+		*prof_event = reduced;
+	std::vector<cl::Event> ran(1, reduced);
+	queue.enqueueReadBuffer(pending.partials, CL_FALSE, 0, nr_groups * sizeof(StatsPartial), &(*pending.results)[0], &ran, &pending.read);
+	queue.flush();
+
+	return pending;
+}
+
+///
+/// Runs the fused reduce_stats kernel over the first N values of input and merges the group partials
+///
+Stats RunFusedStats(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, cl::Buffer& input, size_t N,
+	size_t local_size, cl::Event* prof_event = NULL, size_t max_groups = 1024, bool compact = false)
+{
+	return EnqueueFusedStats(context, queue, program, input, N, local_size, prof_event, NULL, max_groups, compact).Finish();
+}
+
+///
+/// A new int buffer holding the first N 16 bit values of input widened by widen16, the scratch copy for a kernel that
+/// only takes int input when the data is kept as 16 bit. It is only as long lived as the caller keeps it.
+///
+cl::Buffer WidenBuffer(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, cl::Buffer& input, size_t N,
+	size_t local_size, cl::Event* prof_event = NULL)
+{
+	cl::Buffer wide(context, CL_MEM_READ_WRITE, std::max((size_t)1, N) * sizeof(cl_int));
+	cl::Kernel kernel = cl::Kernel(program, "widen16");
+	kernel.setArg(0, input);
+	kernel.setArg(1, (cl_int)N);
+	kernel.setArg(2, wide);
+	local_size = KernelLocalSize(context, kernel, local_size);
+	size_t elements = std::max((size_t)1, N / 8);
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(((elements + local_size - 1) / local_size) * local_size), cl::NDRange(local_size), NULL, prof_event);
+	return wide;
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+#include "Parser.h"
+#include "Statistics.h"
+
+///
+/// Result of a streamed run: the merged statistics plus where the time went
+///
+struct StreamingResult
+{
+	Stats stats;
+	size_t chunks;
+	size_t deviceBytes;		// device memory held at any one time, independent of the file size
+	cl_ulong uploadTime;	// summed profiling times [ns]
+	cl_ulong kernelTime;
+	cl_ulong readTime;
+	std::vector<cl::Event> uploads, kernels, reads;	// every chunk's, for tracing
+};
+
+///
+/// Out-of-core statistics: the file is parsed chunk_records lines at a time into a ring of `buffers` host staging
+/// buffers and device buffers, so memory use depends only on the chunk size and never on the size of the file.
+///
+/// Uploads go through their own queue with non-blocking writes, the reduce_stats kernel and the (small) partials
+/// read back go through compute_queue and wait on the upload event. While the device uploads and reduces one
+/// chunk the host is already parsing the next into the following slot, a slot is only reused once its partials
+/// have come back, and those partials are merged into the running totals as they arrive.
+/// compact parses into 16 bit values, which halves the upload and the device buffers (see reduce_stats16).
+///
+StreamingResult RunStreaming(cl::Context& context, cl::CommandQueue& compute_queue, cl::Program& program, const std::string& filename,
+	size_t chunk_records, size_t buffers, size_t local_size, unsigned int threadCount = 0, size_t max_groups = 1024, bool compact = false)
+{
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	buffers = std::max((size_t)2, buffers);
+
+	struct Slot
+	{
+		cl::Buffer input;
+		cl::Buffer partials;
+		std::vector<int> staging;
+		std::vector<short> staging16;	// instead of staging when compact
+		std::vector<StatsPartial> results;
+		cl::Event write, kernel, read;
+		size_t groups;
+		bool busy;
+	};
+
+	StreamingResult result;
+	result.chunks = 0;
+	result.uploadTime = result.kernelTime = result.readTime = 0;
+
+	cl::Kernel kernel = cl::Kernel(program, compact ? "reduce_stats16" : "reduce_stats");
+	local_size = KernelLocalSize(context, kernel, local_size);
+	size_t chunk_groups = std::max((size_t)1, std::min((chunk_records + local_size - 1) / local_size, max_groups));
+	size_t element_size = compact ? sizeof(cl_short) : sizeof(cl_int);
+	result.deviceBytes = buffers * (chunk_records * element_size + chunk_groups * sizeof(StatsPartial));
+
+	cl::CommandQueue upload_queue(context, CL_QUEUE_PROFILING_ENABLE);
+
+	std::vector<Slot> slots(buffers);
+	for (size_t s = 0; s < buffers; s++)
+	{
+		slots[s].input = cl::Buffer(context, CL_MEM_READ_ONLY, chunk_records * element_size);
+		slots[s].partials = cl::Buffer(context, CL_MEM_WRITE_ONLY, chunk_groups * sizeof(StatsPartial));
+		if (compact)
+			slots[s].staging16.resize(chunk_records);
+		else
+			slots[s].staging.resize(chunk_records);
+		slots[s].results.resize(chunk_groups);
+		slots[s].busy = false;
+	}
+
+	kernel.setArg(3, cl::Local(local_size * sizeof(StatsPartial)));
+
+	// Waits for a slot's last chunk to come back and merges it into the totals
+	auto finish = [&](Slot& slot) {
+		if (!slot.busy)
+			return;
+		slot.read.wait();
+		for (size_t g = 0; g < slot.groups; g++)
+			result.stats.merge(slot.results[g]);
+		result.uploadTime += GetExecutionTime(slot.write);
+		result.kernelTime += GetExecutionTime(slot.kernel);
+		result.readTime += GetExecutionTime(slot.read);
+		result.uploads.push_back(slot.write);
+		result.kernels.push_back(slot.kernel);
+		result.reads.push_back(slot.read);
+		slot.busy = false;
+	};
+
+	MappedFile file(filename);
+	const char* p = file.data();
+	const char* end = p + file.size();
+
+	for (size_t next = 0; p < end; next++)
+	{
+		Slot& slot = slots[next % buffers];
+		finish(slot);
+
+		// The chunk is the next chunk_records lines, so it always fits in the slot
+		const char* chunkEnd = p;
+		for (size_t lines = 0; lines < chunk_records && chunkEnd < end; lines++)
+		{
+			const char* newline = (const char*)memchr(chunkEnd, '\n', end - chunkEnd);
+			chunkEnd = newline ? newline + 1 : end;
+		}
+
+		size_t n = 0;
+		parseMappedInParallel(p, chunkEnd - p, threadCount,
+			[&](size_t total) { n = total; },
+			[&](unsigned int, const char* begin, const char* stop, size_t offset) {
+				if (compact)
+					parseTemperatures(begin, stop, slot.staging16.data() + offset);
+				else
+					parseTemperatures(begin, stop, slot.staging.data() + offset);
+			});
+		p = chunkEnd;
+
+		if (n == 0)
+			continue;
+
+		slot.groups = std::max((size_t)1, std::min((n + local_size - 1) / local_size, max_groups));
+		const void* staged = compact ? (const void*)slot.staging16.data() : (const void*)slot.staging.data();
+		upload_queue.enqueueWriteBuffer(slot.input, CL_FALSE, 0, n * element_size, staged, NULL, &slot.write);
+		upload_queue.flush();
+
+		std::vector<cl::Event> uploaded(1, slot.write);
+		kernel.setArg(0, slot.input);
+		kernel.setArg(1, (cl_int)n);
+		kernel.setArg(2, slot.partials);
+		compute_queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(slot.groups * local_size), cl::NDRange(local_size), &uploaded, &slot.kernel);
+		compute_queue.enqueueReadBuffer(slot.partials, CL_FALSE, 0, slot.groups * sizeof(StatsPartial), slot.results.data(), NULL, &slot.read);
+		compute_queue.flush();
+
+		slot.busy = true;
+		result.chunks++;
+	}
+
+	for (size_t s = 0; s < buffers; s++)
+		finish(slots[s]);
+
+	return result;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+
+///
+/// One extreme reading: its value (* 100) and its index in the input, which is the record's index when the input is
+/// buffer_A and the records are in the same order
+///
+struct Extreme
+{
+	int value;
+	int index;
+};
+
+///
+/// The k largest and k smallest readings, largest/smallest first, fewer if there are fewer than k values
+///
+struct Extremes
+{
+	std::vector<Extreme> hottest;
+	std::vector<Extreme> coldest;
+	std::vector<cl::Event> events;	// every launch, for profiling
+	std::vector<cl::Event> reads;	// every read back, for tracing
+
+	cl_ulong ExecutionTime() const
+	{
+		cl_ulong total = 0;
+		for (size_t i = 0; i < events.size(); i++)
+			total += GetExecutionTime(events[i]);
+		return total;
+	}
+};
+
+///
+/// The k values of the first N of input that are largest (or smallest), with their indices, from two passes of
+/// topk_local: the first over blocks of the input with up to max_groups work groups, each keeping its own top k, the
+/// second with one work group over those lists. Ties go to the earlier index. k is capped at local_size, which must be
+/// a power of 2 and is lowered to what topk_local allows. Every launch's event is added to events and every read
+/// back's to reads.
+///
+std::vector<Extreme> RunTopK(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, cl::Buffer& input, size_t N, size_t k,
+	bool largest, size_t local_size, std::vector<cl::Event>& events, std::vector<cl::Event>& reads, size_t max_groups = 256)
+{
+	cl::Kernel kernel = cl::Kernel(program, "topk_local");
+	local_size = KernelLocalSize(context, kernel, local_size);
+	k = std::min(k, local_size);
+	std::vector<Extreme> extremes;
+	if (N == 0 || k == 0)
+		return extremes;
+
+	size_t nr_groups = std::max((size_t)1, std::min((N + local_size - 1) / local_size, max_groups));
+	size_t chunk = (N + nr_groups - 1) / nr_groups;
+	chunk = std::max((size_t)1, (chunk + local_size - 1) / local_size) * local_size;
+
+	cl::Buffer groupValues(context, CL_MEM_READ_WRITE, nr_groups * k * sizeof(cl_int));
+	cl::Buffer groupIndices(context, CL_MEM_READ_WRITE, nr_groups * k * sizeof(cl_int));
+	cl::Buffer topValues(context, CL_MEM_READ_WRITE, k * sizeof(cl_int));
+	cl::Buffer topIndices(context, CL_MEM_READ_WRITE, k * sizeof(cl_int));
+
+	// Pass 1 - each block's top k, indexed by position (indices isn't read, it only has to be a buffer)
+	kernel.setArg(0, input);
+	kernel.setArg(1, input);
+	kernel.setArg(2, (cl_int)0);
+	kernel.setArg(3, (cl_int)N);
+	kernel.setArg(4, (cl_int)chunk);
+	kernel.setArg(5, (cl_int)k);
+	kernel.setArg(6, (cl_int)largest);
+	kernel.setArg(7, groupValues);
+	kernel.setArg(8, groupIndices);
+	kernel.setArg(9, cl::Local(2 * local_size * sizeof(cl_int)));
+	kernel.setArg(10, cl::Local(2 * local_size * sizeof(cl_int)));
+	events.push_back(cl::Event());
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), NULL, &events.back());
+
+	// Pass 2 - the top k of the blocks' lists, which carry their records with them
+	size_t candidates = nr_groups * k;
+	kernel.setArg(0, groupValues);
+	kernel.setArg(1, groupIndices);
+	kernel.setArg(2, (cl_int)1);
+	kernel.setArg(3, (cl_int)candidates);
+	kernel.setArg(4, (cl_int)(((candidates + local_size - 1) / local_size) * local_size));
+	kernel.setArg(7, topValues);
+	kernel.setArg(8, topIndices);
+	events.push_back(cl::Event());
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(local_size), cl::NDRange(local_size), NULL, &events.back());
+
+	std::vector<cl_int> values(k), indices(k);
+	reads.resize(reads.size() + 2);
+	queue.enqueueReadBuffer(topValues, CL_FALSE, 0, k * sizeof(cl_int), &values[0], NULL, &reads[reads.size() - 2]);
+	queue.enqueueReadBuffer(topIndices, CL_TRUE, 0, k * sizeof(cl_int), &indices[0], NULL, &reads.back());
+
+	// Empty entries (index -1) are only left when there are fewer than k values
+	for (size_t i = 0; i < k && indices[i] >= 0; i++)
+	{
+		Extreme extreme = { values[i], indices[i] };
+		extremes.push_back(extreme);
+	}
+	return extremes;
+}
+
+///
+/// RunTopK() for both ends of the input
+///
+Extremes RunExtremes(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, cl::Buffer& input, size_t N, size_t k, size_t local_size)
+{
+	Extremes extremes;
+	extremes.hottest = RunTopK(context, queue, program, input, N, k, true, local_size, extremes.events, extremes.reads);
+	extremes.coldest = RunTopK(context, queue, program, input, N, k, false, local_size, extremes.events, extremes.reads);
+	return extremes;
+}
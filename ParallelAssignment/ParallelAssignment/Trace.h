@@ -0,0 +1,284 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "EventGraph.h"
+
+///
+/// Records host phases and device commands on one nanosecond timeline and writes them out as a Chrome trace
+/// (chrome://tracing or ui.perfetto.dev) plus a summary per phase.
+///
+/// Host phases are timed with steady_clock from when the Trace was made. Device commands are timed by their profiling
+/// events, which use the device's clock: Calibrate() lines the two up with a marker whose queued time (device clock)
+/// is taken as the host time it was enqueued at. Each device command keeps the offset of the last Calibrate() before it
+/// was added, so with several devices each one's queue is calibrated before its commands go in. Device events are only
+/// read when the trace is written, so they have to be complete by then and their queues need profiling enabled.
+///
+class Trace
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	Trace() : origin(Clock::now()), deviceOffset(0) {}
+
+	// Host time since the trace started [ns]
+	cl_long Now() const
+	{
+		return (cl_long)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - origin).count();
+	}
+
+	///
+	/// Starts a host phase, phases can nest and each End() closes the last one begun
+	///
+	void Begin(const std::string& name, const std::string& category = "host")
+	{
+		Span span = { name, category, Now(), 0, 0 };
+		hostSpans.push_back(span);
+		stack.push_back(hostSpans.size() - 1);
+	}
+
+	void End()
+	{
+		if (stack.empty())
+			return;
+		hostSpans[stack.back()].end = Now();
+		hostSpans[stack.back()].depth = (int)stack.size() - 1;
+		stack.pop_back();
+	}
+
+	///
+	/// Works out the offset from the device's clock to the trace's, needed before any device command is written
+	///
+	void Calibrate(cl::CommandQueue& queue)
+	{
+		cl::Event marker;
+		cl_long before = Now();
+		queue.enqueueMarkerWithWaitList(NULL, &marker);
+		marker.wait();
+		deviceOffset = before - (cl_long)marker.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+	}
+
+	// A device command, category is kernel, write, fill or read
+	void Device(const cl::Event& event, const std::string& name, const std::string& category = "kernel")
+	{
+		DeviceCommand command = { event, name, category, deviceOffset };
+		deviceCommands.push_back(command);
+	}
+
+	void Device(const std::vector<cl::Event>& events, const std::string& name, const std::string& category = "kernel")
+	{
+		for (size_t i = 0; i < events.size(); i++)
+			Device(events[i], name, category);
+	}
+
+	// Every command queued through an EventGraph, under the names they were given there
+	void Device(const EventGraph& graph)
+	{
+		for (size_t i = 0; i < graph.Nodes().size(); i++)
+			Device(graph.Nodes()[i].event, graph.Nodes()[i].name, graph.Nodes()[i].category);
+	}
+
+	///
+	/// Writes the trace in the Chrome trace event format. Host phases go on one track (nested phases stack), device
+	/// commands on as many tracks as it takes for none of them to overlap on a track. Returns false if it can't be written.
+	///
+	bool WriteChromeTrace(const std::string& filename) const
+	{
+		std::ofstream out(filename);
+		if (!out)
+			return false;
+
+		std::vector<Span> spans = Spans();
+		out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" << std::endl;
+		out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"ParallelAssignment\"}}," << std::endl;
+		out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"host\"}}";
+
+		// Device tracks: each command goes on the first track that is free by the time it starts
+		std::vector<cl_long> trackEnd;
+		std::vector<size_t> order;
+		for (size_t i = 0; i < spans.size(); i++)
+			order.push_back(i);
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return spans[a].start < spans[b].start; });
+
+		for (size_t o = 0; o < order.size(); o++)
+		{
+			const Span& span = spans[order[o]];
+			int tid = 0;
+			if (span.category != "host")
+			{
+				size_t track = 0;
+				while (track < trackEnd.size() && trackEnd[track] > span.start)
+					track++;
+				if (track == trackEnd.size())
+				{
+					trackEnd.push_back(0);
+					out << "," << std::endl << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track + 1;
+					out << ",\"args\":{\"name\":\"device " << track << "\"}}";
+				}
+				trackEnd[track] = span.end;
+				tid = (int)track + 1;
+			}
+
+			out << "," << std::endl << "{\"name\":\"" << Escape(span.name) << "\",\"cat\":\"" << Escape(span.category) << "\",\"ph\":\"X\"";
+			out << ",\"ts\":" << Microseconds(span.start) << ",\"dur\":" << Microseconds(span.end - span.start);
+			out << ",\"pid\":1,\"tid\":" << tid << "}";
+		}
+		out << std::endl << "]}" << std::endl;
+		return (bool)out;
+	}
+
+	///
+	/// Writes a JSON summary: the wall clock time the trace covers, then for every phase (by category and name) how many
+	/// times it ran and its total, min and max time, slowest first. Returns false if it can't be written.
+	///
+	bool WriteSummary(const std::string& filename) const
+	{
+		std::ofstream out(filename);
+		if (!out)
+			return false;
+
+		struct Totals { size_t count; cl_long total, min, max; };
+		std::map<std::pair<std::string, std::string>, Totals> phases;
+		std::vector<Span> spans = Spans();
+		cl_long first = 0, last = 0, host = 0, device = 0;
+		for (size_t i = 0; i < spans.size(); i++)
+		{
+			cl_long time = spans[i].end - spans[i].start;
+			if (i == 0 || spans[i].start < first) first = spans[i].start;
+			if (i == 0 || spans[i].end > last) last = spans[i].end;
+			if (spans[i].category == "host")
+				host += spans[i].depth == 0 ? time : 0;
+			else
+				device += time;
+
+			std::pair<std::string, std::string> key(spans[i].category, spans[i].name);
+			std::map<std::pair<std::string, std::string>, Totals>::iterator it = phases.find(key);
+			if (it == phases.end())
+			{
+				Totals totals = { 1, time, time, time };
+				phases[key] = totals;
+			}
+			else
+			{
+				it->second.count++;
+				it->second.total += time;
+				it->second.min = std::min(it->second.min, time);
+				it->second.max = std::max(it->second.max, time);
+			}
+		}
+
+		std::vector<std::pair<std::pair<std::string, std::string>, Totals> > sorted(phases.begin(), phases.end());
+		std::stable_sort(sorted.begin(), sorted.end(), [](const std::pair<std::pair<std::string, std::string>, Totals>& a,
+			const std::pair<std::pair<std::string, std::string>, Totals>& b) { return a.second.total > b.second.total; });
+
+		out << "{" << std::endl;
+		out << "  \"wall_ns\": " << last - first << "," << std::endl;
+		out << "  \"host_ns\": " << host << "," << std::endl;
+		out << "  \"device_busy_ns\": " << device << "," << std::endl;
+		out << "  \"phases\": [";
+		for (size_t i = 0; i < sorted.size(); i++)
+		{
+			const Totals& t = sorted[i].second;
+			out << (i ? "," : "") << std::endl << "    {\"category\": \"" << Escape(sorted[i].first.first) << "\", \"name\": \"" << Escape(sorted[i].first.second);
+			out << "\", \"count\": " << t.count << ", \"total_ns\": " << t.total << ", \"min_ns\": " << t.min << ", \"max_ns\": " << t.max << "}";
+		}
+		out << std::endl << "  ]" << std::endl << "}" << std::endl;
+		return (bool)out;
+	}
+
+private:
+	struct Span
+	{
+		std::string name;
+		std::string category;
+		cl_long start;	// [ns] since the trace started
+		cl_long end;
+		int depth;		// how many host phases it is nested in
+	};
+
+	struct DeviceCommand
+	{
+		cl::Event event;
+		std::string name;
+		std::string category;
+		cl_long offset;		// from its device's clock to the trace's
+	};
+
+	Clock::time_point origin;
+	cl_long deviceOffset;
+	std::vector<Span> hostSpans;
+	std::vector<size_t> stack;
+	std::vector<DeviceCommand> deviceCommands;
+
+	// Every finished host phase and every device command, on the trace's clock
+	std::vector<Span> Spans() const
+	{
+		std::vector<Span> spans;
+		for (size_t i = 0; i < hostSpans.size(); i++)
+		{
+			if (hostSpans[i].end >= hostSpans[i].start)
+				spans.push_back(hostSpans[i]);
+		}
+		for (size_t i = 0; i < deviceCommands.size(); i++)
+		{
+			const cl::Event& event = deviceCommands[i].event;
+			Span span = { deviceCommands[i].name, deviceCommands[i].category,
+				(cl_long)event.getProfilingInfo<CL_PROFILING_COMMAND_START>() + deviceCommands[i].offset,
+				(cl_long)event.getProfilingInfo<CL_PROFILING_COMMAND_END>() + deviceCommands[i].offset, 0 };
+			spans.push_back(span);
+		}
+		return spans;
+	}
+
+	// The trace format's timestamps are in microseconds, the fraction keeps the nanoseconds
+	static std::string Microseconds(cl_long ns)
+	{
+		std::string sign = ns < 0 ? "-" : "";
+		ns = ns < 0 ? -ns : ns;
+		std::string fraction = std::to_string(ns % 1000);
+		return sign + std::to_string(ns / 1000) + "." + std::string(3 - fraction.size(), '0') + fraction;
+	}
+
+	static std::string Escape(const std::string& text)
+	{
+		std::string escaped;
+		for (size_t i = 0; i < text.size(); i++)
+		{
+			if (text[i] == '"' || text[i] == '\\')
+				escaped += '\\';
+			escaped += text[i];
+		}
+		return escaped;
+	}
+};
+
+///
+/// Times a host phase for as long as it is in scope
+///
+struct TraceScope
+{
+	Trace* trace;
+
+	TraceScope(Trace* trace, const std::string& name, const std::string& category = "host") : trace(trace)
+	{
+		if (trace)
+			trace->Begin(name, category);
+	}
+
+	~TraceScope()
+	{
+		if (trace)
+			trace->End();
+	}
+};
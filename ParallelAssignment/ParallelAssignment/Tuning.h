@@ -0,0 +1,247 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+#include "Statistics.h"
+#include "Histogram.h"
+#include "Reduction.h"
+
+///
+/// How a kernel is launched: its work group size and how many values each work item takes, which sets the number of
+/// work groups for the kernels that stride over their input (the others take one value per work item)
+///
+struct LaunchConfig
+{
+	size_t local_size;
+	size_t per_item;
+
+	// Work groups for N values, passed as max_groups to the Run/Enqueue functions
+	size_t Groups(size_t N) const
+	{
+		return std::max((size_t)1, (N + local_size * per_item - 1) / (local_size * per_item));
+	}
+};
+
+///
+/// The kernels TuneLaunches() times. reduce_int and reduce_short are the reduce_template.cl reductions (only their
+/// work group size is tuned), the rest are kernels of my_kernels3.cl.
+///
+const char* const TUNED_KERNELS[] = { "reduce_stats", "at_find_min", "at_find_max", "histogram_local", "reduce_int", "reduce_short" };
+
+///
+/// The fastest launch configurations found on one device and driver. Every device's are kept in one text file, a line
+/// per device and kernel (device name, driver version, kernel, work group size and values per work item, tab separated),
+/// so a device is tuned once and then every run on it uses what was found. A driver update replaces its device's lines.
+///
+class TuningProfile
+{
+public:
+	TuningProfile(const cl::Device& device, const std::string& filename = "tuning_profiles.txt")
+		: filename(filename), deviceName(device.getInfo<CL_DEVICE_NAME>()), driver(device.getInfo<CL_DRIVER_VERSION>()), loaded(false)
+	{
+		std::ifstream file(filename);
+		std::string line;
+		while (std::getline(file, line))
+		{
+			std::vector<std::string> fields = Split(line);
+			if (fields.size() != 5 || fields[0] != deviceName || fields[1] != driver)
+				continue;
+
+			LaunchConfig config = { strtoul(fields[3].c_str(), NULL, 10), strtoul(fields[4].c_str(), NULL, 10) };
+			if (config.local_size > 0 && config.per_item > 0)
+				configs[fields[2]] = config;
+		}
+		loaded = Complete();
+	}
+
+	const std::string& Filename() const { return filename; }
+
+	// Whether every kernel was already tuned when the profile was made, rather than by this run
+	bool Loaded() const { return loaded; }
+
+	bool Complete() const
+	{
+		for (size_t i = 0; i < sizeof(TUNED_KERNELS) / sizeof(TUNED_KERNELS[0]); i++)
+		{
+			if (configs.find(TUNED_KERNELS[i]) == configs.end())
+				return false;
+		}
+		return true;
+	}
+
+	LaunchConfig Get(const std::string& kernel, const LaunchConfig& fallback) const
+	{
+		std::map<std::string, LaunchConfig>::const_iterator it = configs.find(kernel);
+		return it == configs.end() ? fallback : it->second;
+	}
+
+	void Set(const std::string& kernel, const LaunchConfig& config)
+	{
+		configs[kernel] = config;
+	}
+
+	///
+	/// Rewrites the file with this device's lines in place of any it had before, other devices' lines are kept.
+	/// Goes through a temporary file like the program cache. Returns false if it can't be written.
+	///
+	bool Save() const
+	{
+		std::vector<std::string> kept;
+		{
+			std::ifstream file(filename);
+			std::string line;
+			while (std::getline(file, line))
+			{
+				std::vector<std::string> fields = Split(line);
+				if (fields.size() == 5 && fields[0] != deviceName)
+					kept.push_back(line);
+			}
+		}
+
+		std::string tempName = filename + ".tmp";
+		{
+			std::ofstream file(tempName, std::ios::trunc);
+			for (size_t i = 0; i < kept.size(); i++)
+				file << kept[i] << "\n";
+			for (std::map<std::string, LaunchConfig>::const_iterator it = configs.begin(); it != configs.end(); ++it)
+				file << deviceName << "\t" << driver << "\t" << it->first << "\t" << it->second.local_size << "\t" << it->second.per_item << "\n";
+			if (!file)
+				return false;
+		}
+		std::remove(filename.c_str());
+		return std::rename(tempName.c_str(), filename.c_str()) == 0;
+	}
+
+private:
+	std::string filename;
+	std::string deviceName;
+	std::string driver;
+	std::map<std::string, LaunchConfig> configs;
+	bool loaded;
+
+	static std::vector<std::string> Split(const std::string& line)
+	{
+		std::vector<std::string> fields;
+		std::stringstream stream(line);
+		std::string field;
+		while (std::getline(stream, field, '\t'))
+			fields.push_back(field);
+		return fields;
+	}
+};
+
+///
+/// Every power of 2 work group size from 32 up to max_local, each with 1, 4, 16 and 64 values per work item when the
+/// kernel strides over its input (one otherwise)
+///
+std::vector<LaunchConfig> LaunchCandidates(size_t max_local, bool strided)
+{
+	std::vector<LaunchConfig> candidates;
+	for (size_t size = std::min((size_t)32, max_local); size <= max_local; size *= 2)
+	{
+		for (size_t per_item = 1; per_item <= (strided ? 64 : 1); per_item *= 4)
+		{
+			LaunchConfig config = { size, per_item };
+			candidates.push_back(config);
+		}
+	}
+	return candidates;
+}
+
+///
+/// Runs launch (which queues the kernel with a configuration and returns its event) for every candidate, repeats
+/// times each, and returns the one with the fastest run from the profiling events
+///
+template <typename Launch>
+LaunchConfig TuneLaunch(const std::vector<LaunchConfig>& candidates, Launch launch, int repeats = 3)
+{
+	LaunchConfig best = candidates.back();
+	cl_ulong bestTime = 0;
+	for (size_t c = 0; c < candidates.size(); c++)
+	{
+		for (int run = 0; run < repeats; run++)
+		{
+			cl::Event event = launch(candidates[c]);
+			event.wait();
+			cl_ulong time = GetExecutionTime(event);
+			if ((c == 0 && run == 0) || time < bestTime)
+			{
+				best = candidates[c];
+				bestTime = time;
+			}
+		}
+	}
+	return best;
+}
+
+///
+/// Times every kernel in TUNED_KERNELS over its candidates on N made up temperatures (-30 to 40 degrees, so the
+/// histogram has a realistic number of bins) and puts the fastest configurations in profile. The reductions go
+/// through TuneReduction(), what it finds replaces anything registry already had.
+///
+void TuneLaunches(cl::Context& context, cl::CommandQueue& queue, cl::Program& program, ReduceRegistry& registry, TuningProfile& profile,
+	size_t N = 1 << 20)
+{
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+
+	std::vector<cl_int> values(N);
+	std::vector<cl_short> values16(N);
+	unsigned int seed = 12345;
+	for (size_t i = 0; i < N; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		values[i] = (cl_int)((seed >> 8) % 7001) - 3000;
+		values16[i] = (cl_short)values[i];
+	}
+	cl::Buffer input(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, N * sizeof(cl_int), &values[0]);
+	cl::Buffer input16(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, N * sizeof(cl_short), &values16[0]);
+	cl::Buffer result(context, CL_MEM_READ_WRITE, sizeof(cl_int));
+
+	cl::Kernel kernel_stats = cl::Kernel(program, "reduce_stats");
+	profile.Set("reduce_stats", TuneLaunch(LaunchCandidates(DeviceLocalSize(device, sizeof(StatsPartial), &kernel_stats), true), [&](const LaunchConfig& config) {
+		cl::Event event;
+		RunFusedStats(context, queue, program, input, N, config.local_size, &event, config.Groups(N));
+		return event;
+	}));
+
+	const char* atomics[] = { "at_find_min", "at_find_max" };
+	for (int a = 0; a < 2; a++)
+	{
+		cl::Kernel kernel = cl::Kernel(program, atomics[a]);
+		kernel.setArg(0, input);
+		kernel.setArg(1, result);
+		kernel.setArg(3, (cl_int)N);
+		profile.Set(atomics[a], TuneLaunch(LaunchCandidates(DeviceLocalSize(device, sizeof(cl_int), &kernel), false), [&](const LaunchConfig& config) {
+			cl::Event event;
+			kernel.setArg(2, cl::Local(config.local_size * sizeof(cl_int)));
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(config.Groups(N) * config.local_size), cl::NDRange(config.local_size), NULL, &event);
+			return event;
+		}));
+	}
+
+	cl::Kernel kernel_histogram = cl::Kernel(program, "histogram_local");
+	profile.Set("histogram_local", TuneLaunch(LaunchCandidates(DeviceLocalSize(device, 0, &kernel_histogram), true), [&](const LaunchConfig& config) {
+		cl::Event event;
+		RunHistogram(context, queue, program, input, N, -3000, 4000, config.local_size, &event, 10, config.Groups(N));
+		return event;
+	}));
+
+	registry.tuned.clear();
+	LaunchConfig reduce_int = { TuneReduction(registry, queue, REDUCE_MIN, REDUCE_INT32, input, N), 1 };
+	LaunchConfig reduce_short = { TuneReduction(registry, queue, REDUCE_MIN, REDUCE_INT16, input16, N), 1 };
+	profile.Set("reduce_int", reduce_int);
+	profile.Set("reduce_short", reduce_short);
+}
@@ -4,6 +4,7 @@
 #include <vector>
 #include <iostream>
 #include <sstream>
+#include <algorithm>
 
 #ifdef __APPLE__
 #include <OpenCL/cl.hpp>
@@ -197,6 +198,34 @@ cl::Context GetContext(int platform_id, int device_id) {
 	return cl::Context();
 }
 
+///
+/// The largest power of 2 work group size up to 1024 that the device allows, with local_bytes of local memory per
+/// work item, and that kernel (optional) allows on it
+///
+size_t DeviceLocalSize(const cl::Device& device, size_t local_bytes = 0, const cl::Kernel* kernel = NULL)
+{
+	size_t limit = std::min((size_t)1024, device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+	if (local_bytes)
+		limit = std::min(limit, (size_t)device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / local_bytes);
+	if (kernel)
+		limit = std::min(limit, kernel->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+
+	size_t size = 1;
+	while (size * 2 <= limit)
+		size *= 2;
+	return size;
+}
+
+///
+/// local_size (a power of 2) clamped to what kernel allows on the context's device. A size only checked against the
+/// device maximum can still be too large for a kernel that uses a lot of registers or local memory, CPU runtimes in
+/// particular report a smaller CL_KERNEL_WORK_GROUP_SIZE for some kernels.
+///
+size_t KernelLocalSize(const cl::Context& context, const cl::Kernel& kernel, size_t local_size)
+{
+	return std::min(local_size, DeviceLocalSize(context.getInfo<CL_CONTEXT_DEVICES>()[0], 0, &kernel));
+}
+
 enum ProfilingResolution {
 	PROF_NS = 1,
 	PROF_US = 1000,
@@ -204,6 +233,10 @@ enum ProfilingResolution {
 	PROF_S = 1000000000
 };
 
+cl_ulong GetExecutionTime(const cl::Event& evnt) {
+	return evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+}
+
 string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolution) {
 	stringstream sstream;
 
@@ -1,162 +1,1066 @@
 ﻿///
-/// This kernel finds the minimum value in the input vector A, by using a reduction pattern 
-/// compare two values from the vector and saving the smallest one. This repeats until the total smallest value 
-/// is stored at the first index position of the returned vector B. 
+/// Atomic min and max, every work item applies its own value to B[0] with a global atomic.
+/// Kept as the baseline the two stage reductions in reduce_template.cl are compared against.
 ///
-__kernel void reduce_find_min(__global const int* A, __global int* B, __local int* scratch) 
+__kernel void at_find_min(__global const int* A, __global int* B, __local int* scratch, int N) 
 {
 	int id = get_global_id(0);
 	int lid = get_local_id(0);
-	int N = get_local_size(0);
 
 	//cache all N values from global memory to local memory
-	scratch[lid] = A[id];
+	//work items past the end of the data (the last group is rounded up) have nothing to add
+	if (id < N)
+		scratch[lid] = A[id];
+
+	barrier(CLK_LOCAL_MEM_FENCE); //wait for all local threads to finish copying from global to local memory
+
+	if (id < N)
+		atomic_min(&B[0],scratch[lid]);
+}
+
+__kernel void at_find_max(__global const int* A, __global int* B, __local int* scratch, int N) 
+{
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+
+	//cache all N values from global memory to local memory
+	//work items past the end of the data (the last group is rounded up) have nothing to add
+	if (id < N)
+		scratch[lid] = A[id];
+
+	barrier(CLK_LOCAL_MEM_FENCE); //wait for all local threads to finish copying from global to local memory
+
+	if (id < N)
+		atomic_max(&B[0],scratch[lid]);
+}
+
+///
+/// at_find_min and at_find_max over 16 bit values, for -z 16 where there is no int copy of the data on the device
+///
+__kernel void at_find_min16(__global const short* A, __global int* B, __local int* scratch, int N) 
+{
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+
+	if (id < N)
+		scratch[lid] = A[id];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < N)
+		atomic_min(&B[0],scratch[lid]);
+}
+
+__kernel void at_find_max16(__global const short* A, __global int* B, __local int* scratch, int N) 
+{
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+
+	if (id < N)
+		scratch[lid] = A[id];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < N)
+		atomic_max(&B[0],scratch[lid]);
+}
+
+///
+/// Partial statistics for one block of values, used by reduce_stats.
+/// The layout must match StatsPartial in Statistics.h.
+/// mean and m2 (sum of squared differences from the mean) are kept Welford style rather than as a raw
+/// sum of squares, so the variance doesn't lose precision when the mean is large compared to the spread.
+///
+typedef struct
+{
+	int count;
+	int min;
+	int max;
+	float mean;
+	float m2;
+} StatsPartial;
+
+///
+/// Chan et al. parallel merge of two partials, either side can be empty
+///
+StatsPartial merge_stats(StatsPartial a, StatsPartial b)
+{
+	if (b.count == 0)
+		return a;
+	if (a.count == 0)
+		return b;
 
-	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
+	StatsPartial r;
+	r.count = a.count + b.count;
+	r.min = min(a.min, b.min);
+	r.max = max(a.max, b.max);
 
-	for (int i = 1; i < N; i *= 2) 
+	float delta = b.mean - a.mean;
+	float weight = (float)b.count / (float)r.count;
+	r.mean = a.mean + delta * weight;
+	r.m2 = a.m2 + b.m2 + delta * delta * (float)a.count * weight;
+	return r;
+}
+
+///
+/// Merges every work item's partial in local memory and writes the group's partial to B
+///
+void reduce_stats_group(StatsPartial s, __global StatsPartial* B, __local StatsPartial* scratch)
+{
+	int lid = get_local_id(0);
+	int size = get_local_size(0);
+
+	scratch[lid] = s;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Sequential addressing, halving the active range each step (works for any group size)
+	while (size > 1)
 	{
-		if (!(lid % (i * 2)) && ((lid + i) < N)) 
-			scratch[lid] = (scratch[lid] < scratch[lid + i]) ? scratch[lid] : scratch[lid + i];
+		int half = (size + 1) / 2;
+		if (lid < size - half)
+			scratch[lid] = merge_stats(scratch[lid], scratch[lid + half]);
 
 		barrier(CLK_LOCAL_MEM_FENCE);
+		size = half;
 	}
 
-	//we add results from all local groups to the first element of the array
-	//serial operation! but works for any group size
-	//copy the cache to output array
 	if (!lid) 
 	{
-		atomic_min(&B[0],scratch[lid]);
+		B[get_group_id(0)] = scratch[0];
+	}
+}
+
+///
+/// An empty partial, the identity of merge_stats
+///
+StatsPartial empty_stats()
+{
+	StatsPartial s;
+	s.count = 0;
+	s.min = INT_MAX;
+	s.max = INT_MIN;
+	s.mean = 0.0f;
+	s.m2 = 0.0f;
+	return s;
+}
+
+///
+/// Welford's update, adds one value to a partial
+///
+StatsPartial add_stats(StatsPartial s, int x)
+{
+	s.count++;
+	s.min = min(s.min, x);
+	s.max = max(s.max, x);
+
+	float delta = (float)x - s.mean;
+	s.mean += delta / (float)s.count;
+	s.m2 += delta * ((float)x - s.mean);
+	return s;
+}
+
+///
+/// The partial of 4 values on their own, the sum is exact so its mean and m2 only take one division
+///
+StatsPartial stats_of4(int4 v)
+{
+	StatsPartial s;
+	s.count = 4;
+	s.min = min(min(v.s0, v.s1), min(v.s2, v.s3));
+	s.max = max(max(v.s0, v.s1), max(v.s2, v.s3));
+	s.mean = (float)(v.s0 + v.s1 + v.s2 + v.s3) / 4.0f;
+	float4 d = convert_float4(v) - s.mean;
+	s.m2 = dot(d, d);
+	return s;
+}
+
+///
+/// Fused single pass statistics: count, min, max, mean and m2 all come from one read of A.
+/// Each work item walks the input with a grid stride of int4 vector loads, so every load is 16 bytes and several
+/// values are reduced per work item before the local memory stage. Each vector is summarised on its own and merged
+/// in, the last N % 4 values are added one at a time. The work group then merges its partials in local memory and
+/// writes one partial per group to B, the host merges the (few) group partials. A doesn't need padding.
+///
+__kernel void reduce_stats(__global const int* A, int N, __global StatsPartial* B, __local StatsPartial* scratch) 
+{
+	int id = get_global_id(0);
+	int stride = get_global_size(0);
+	StatsPartial s = empty_stats();
+
+	for (int i = id; i < N / 4; i += stride)
+		s = merge_stats(s, stats_of4(vload4(i, A)));
+
+	for (int i = (N / 4) * 4 + id; i < N; i += stride)
+		s = add_stats(s, A[i]);
+
+	reduce_stats_group(s, B, scratch);
+}
+
+///
+/// reduce_stats over 16 bit values (degrees * 100 fits in a short), read as short8 so each load is still 16 bytes
+/// but carries twice as many values. Half the memory and half the bandwidth of the int version for the same data.
+///
+__kernel void reduce_stats16(__global const short* A, int N, __global StatsPartial* B, __local StatsPartial* scratch) 
+{
+	int id = get_global_id(0);
+	int stride = get_global_size(0);
+	StatsPartial s = empty_stats();
+
+	for (int i = id; i < N / 8; i += stride)
+	{
+		int8 v = convert_int8(vload8(i, A));
+		s = merge_stats(s, merge_stats(stats_of4(v.lo), stats_of4(v.hi)));
+	}
+
+	for (int i = (N / 8) * 8 + id; i < N; i += stride)
+		s = add_stats(s, A[i]);
+
+	reduce_stats_group(s, B, scratch);
+}
+
+///
+/// Widens 16 bit values to int on the device, into the scratch (or sort) buffer of a kernel that only takes int input
+/// when the data is kept as 16 bit. Each work item converts one short8, work item 0 also does the last N % 8.
+///
+__kernel void widen16(__global const short* A, int N, __global int* B)
+{
+	int i = get_global_id(0);
+	if (i < N / 8)
+		vstore8(convert_int8(vload8(i, A)), i, B);
+
+	if (i == 0)
+	{
+		for (int t = (N / 8) * 8; t < N; t++)
+			B[t] = A[t];
+	}
+}
+
+///
+/// Whether a record passes a filter on the station, date (yyyymmdd), month and time (HHMM) columns.
+/// The ranges are inclusive, station -1 matches every station (and -2, a station that isn't in the data, none).
+///
+bool record_matches(int s, int d, int t, int stationId, int dateFrom, int dateTo, int monthFrom, int monthTo, int timeFrom, int timeTo)
+{
+	int month = (d / 100) % 100;
+	return (stationId == -1 || s == stationId) && d >= dateFrom && d <= dateTo && month >= monthFrom && month <= monthTo &&
+		t >= timeFrom && t <= timeTo;
+}
+
+///
+/// reduce_stats over only the records that pass record_matches(). Used by the query server, where the columns
+/// stay on the device between queries.
+///
+__kernel void reduce_stats_where(__global const int* A, __global const ushort* station, __global const int* date, __global const short* time,
+	int N, int stationId, int dateFrom, int dateTo, int monthFrom, int monthTo, int timeFrom, int timeTo,
+	__global StatsPartial* B, __local StatsPartial* scratch)
+{
+	int id = get_global_id(0);
+	int stride = get_global_size(0);
+
+	StatsPartial s = empty_stats();
+
+	for (int i = id; i < N; i += stride)
+	{
+		if (record_matches(station[i], date[i], time[i], stationId, dateFrom, dateTo, monthFrom, monthTo, timeFrom, timeTo))
+			s = add_stats(s, A[i]);
+	}
+
+	reduce_stats_group(s, B, scratch);
+}
+
+// ======================== Bitonic Sort ======================== //
+
+///
+/// Compares two values of a bitonic sort and swaps them if they're in the wrong order for the direction
+///
+void bitonic_compare(__local int* scratch, int a, int b, bool ascending)
+{
+	int x = scratch[a];
+	int y = scratch[b];
+	if ((x > y) == ascending)
+	{
+		scratch[a] = y;
+		scratch[b] = x;
 	}
 }
 
 ///
-///	This kernel works exactly the same as the min value finder, except with the < symbol reversed
+/// First phase of the bitonic sort: every work group sorts its own block of get_local_size(0) values in local memory.
+/// The direction of each merge depends on the global index, exactly as in the full network, so afterwards the
+/// blocks form the bitonic sequences the global merges below expect. The input must be a power of 2 long.
 ///
-__kernel void reduce_find_max(__global const int* A, __global int* B, __local int* scratch) 
+__kernel void bitonic_sort_local(__global int* A, __local int* scratch)
 {
 	int id = get_global_id(0);
 	int lid = get_local_id(0);
 	int N = get_local_size(0);
 
-	//cache all N values from global memory to local memory
 	scratch[lid] = A[id];
 
-	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	for (int i = 1; i < N; i *= 2) 
+	for (int k = 2; k <= N; k *= 2)
 	{
-		if (!(lid % (i * 2)) && ((lid + i) < N)) 
-			scratch[lid] = (scratch[lid] > scratch[lid + i]) ? scratch[lid] : scratch[lid + i];
+		for (int j = k / 2; j > 0; j /= 2)
+		{
+			int partner = lid ^ j;
+			if (partner > lid)
+				bitonic_compare(scratch, lid, partner, (id & k) == 0);
 
-		barrier(CLK_LOCAL_MEM_FENCE);
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
 	}
 
-	//we add results from all local groups to the first element of the array
-	//serial operation! but works for any group size
-	//copy the cache to output array
-	if (!lid) 
+	A[id] = scratch[lid];
+}
+
+///
+/// One step (k, j) of the bitonic merge where the compare distance j spans more than one work group,
+/// so it has to go through global memory. Each pair is handled by its lower index.
+///
+__kernel void bitonic_merge_global(__global int* A, int j, int k)
+{
+	int id = get_global_id(0);
+	int partner = id ^ j;
+
+	if (partner > id)
 	{
-		atomic_max(&B[0],scratch[lid]);
+		int x = A[id];
+		int y = A[partner];
+		if ((x > y) == ((id & k) == 0))
+		{
+			A[id] = y;
+			A[partner] = x;
+		}
 	}
 }
 
-__kernel void reduce_find_sum(__global const int* A, __global int* B, __local int* scratch) 
+///
+/// The remaining steps of merge k once the compare distance fits in a work group (j < local size),
+/// these all run in local memory in one launch instead of one launch per step.
+///
+__kernel void bitonic_merge_local(__global int* A, int k, __local int* scratch)
 {
 	int id = get_global_id(0);
 	int lid = get_local_id(0);
 	int N = get_local_size(0);
 
-	//cache all N values from global memory to local memory
 	scratch[lid] = A[id];
 
-	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	for (int i = 1; i < N; i *= 2) 
+	for (int j = N / 2; j > 0; j /= 2)
 	{
-		if (!(lid % (i * 2)) && ((lid + i) < N)) 
-			scratch[lid] += scratch[lid + i];
+		int partner = lid ^ j;
+		if (partner > lid)
+			bitonic_compare(scratch, lid, partner, (id & k) == 0);
 
 		barrier(CLK_LOCAL_MEM_FENCE);
 	}
-	//we add results from all local groups to the first element of the array
-	//serial operation! but works for any group size
-	//copy the cache to output array
-	if (!lid) 
+
+	A[id] = scratch[lid];
+}
+
+// ======================== Histogram ======================== //
+
+///
+/// Counts the first N values of A into nbins bins of binWidth, starting at minValue.
+/// Each work group counts into its own private copy of the bins in local memory, so the atomics only contend
+/// inside the group, then merges its non-empty bins into the global histogram H once at the end.
+/// H must be zeroed before the launch.
+///
+__kernel void histogram_local(__global const int* A, int N, int minValue, int binWidth, int nbins, __global uint* H, __local uint* bins)
+{
+	int lid = get_local_id(0);
+	int size = get_local_size(0);
+
+	for (int b = lid; b < nbins; b += size)
+		bins[b] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = get_global_id(0); i < N; i += get_global_size(0))
 	{
-		atomic_add(&B[0],scratch[lid]);
+		int b = clamp((A[i] - minValue) / binWidth, 0, nbins - 1);
+		atomic_inc(&bins[b]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int b = lid; b < nbins; b += size)
+	{
+		if (bins[b])
+			atomic_add(&H[b], bins[b]);
 	}
 }
 
-__kernel void reduce_find_sum_variance(__global const int* A, __global int* B, __local int* scratch) 
+///
+/// histogram_local over 16 bit values
+///
+__kernel void histogram_local16(__global const short* A, int N, int minValue, int binWidth, int nbins, __global uint* H, __local uint* bins)
 {
-	int id = get_global_id(0);
 	int lid = get_local_id(0);
-	int N = get_local_size(0);
+	int size = get_local_size(0);
 
-	//cache all N values from global memory to local memory
-	scratch[lid] = A[id];
+	for (int b = lid; b < nbins; b += size)
+		bins[b] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
+	for (int i = get_global_id(0); i < N; i += get_global_size(0))
+	{
+		int b = clamp((A[i] - minValue) / binWidth, 0, nbins - 1);
+		atomic_inc(&bins[b]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	for (int i = 1; i < N; i *= 2) 
+	for (int b = lid; b < nbins; b += size)
 	{
-		if (!(lid % (i * 2)) && ((lid + i) < N)) 
-			scratch[lid] += scratch[lid + i];
+		if (bins[b])
+			atomic_add(&H[b], bins[b]);
+	}
+}
+
+// ======================== Top-k ======================== //
 
+///
+/// Whether the reading (a, ia) goes before (b, ib) in a top-k list: the larger value first when largest is set, the
+/// smaller otherwise, the earlier record on a tie. An index of -1 is an empty entry and goes after everything.
+///
+int topk_before(int a, int ia, int b, int ib, int largest)
+{
+	if (ia < 0 || ib < 0)
+		return ia >= 0 && ib < 0;
+	if (a != b)
+		return largest ? a > b : a < b;
+	return ia < ib;
+}
+
+///
+/// One compare and exchange step of a bitonic sort over n entries, the first n / 2 work items take one pair each.
+/// Blocks of size entries are put in topk_before() order, or the reverse of it when reverse is set, alternating.
+///
+void topk_step(__local int* values, __local int* slots, int n, int size, int stride, int reverse, int largest)
+{
+	int lid = get_local_id(0);
+	if (lid < n / 2)
+	{
+		int pos = 2 * stride * (lid / stride) + lid % stride;
+		int partner = pos + stride;
+		int forward = ((pos & size) == 0) != reverse;
+		int a = values[pos], ia = slots[pos];
+		int b = values[partner], ib = slots[partner];
+		if (forward ? topk_before(b, ib, a, ia, largest) : topk_before(a, ia, b, ib, largest))
+		{
+			values[pos] = b;
+			slots[pos] = ib;
+			values[partner] = a;
+			slots[partner] = ia;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+///
+/// The k readings of the first N values of A that go first in topk_before() order, per block of chunk values, with
+/// their records: indexed reads the record of every value from indices (a previous pass's output), otherwise it is
+/// the value's position in A. Work group g writes its block's list to outValues/outIndices[g * k], so a second pass
+/// with one work group over those lists gives the overall top k.
+///
+/// The first half of local memory holds the group's best get_local_size(0) so far in order. Each tile of the block
+/// goes in the second half and is sorted the other way, which makes the whole a bitonic sequence, so one bitonic merge
+/// puts the best of both back in the first half. k can be at most the local size, which must be a power of 2.
+///
+__kernel void topk_local(__global const int* A, __global const int* indices, int indexed, int N, int chunk, int k, int largest,
+	__global int* outValues, __global int* outIndices, __local int* values, __local int* slots)
+{
+	int lid = get_local_id(0);
+	int size = get_local_size(0);
+	int start = get_group_id(0) * chunk;
+	int end = min(start + chunk, N);
+
+	values[lid] = 0;
+	slots[lid] = -1;
+
+	for (int tile = start; tile < end; tile += size)
+	{
+		int i = tile + lid;
+		values[size + lid] = i < end ? A[i] : 0;
+		slots[size + lid] = i < end ? (indexed ? indices[i] : i) : -1;
 		barrier(CLK_LOCAL_MEM_FENCE);
+
+		for (int block = 2; block <= size; block *= 2)
+		{
+			for (int stride = block / 2; stride > 0; stride /= 2)
+				topk_step(values + size, slots + size, size, block, stride, 1, largest);
+		}
+		for (int stride = size; stride > 0; stride /= 2)
+			topk_step(values, slots, 2 * size, 2 * size, stride, 0, largest);
+	}
+
+	if (lid < k)
+	{
+		outValues[get_group_id(0) * k + lid] = values[lid];
+		outIndices[get_group_id(0) * k + lid] = slots[lid];
 	}
+}
 
-	// This is because the values are x 100 when read in from file to preserve data
-	// Therefore 100 ^ 2 = 10,000 which needs to be shrunk back to normal size again
-	scratch[lid] = scratch[lid] / 10000.0f;
+// ======================== Grouped Statistics ======================== //
 
-	//we add results from all local groups to the first element of the array
-	//serial operation! but works for any group size
-	//copy the cache to output array
-	if (!lid) 
+// Fields of the local and per group tables, each one nkeys long
+#define GROUP_COUNT 0
+#define GROUP_MIN 1
+#define GROUP_MAX 2
+#define GROUP_SUM_LO 3
+#define GROUP_SUM_HI 4
+#define GROUP_SQ_LO 5
+#define GROUP_SQ_HI 6
+#define GROUP_FIELDS 7
+
+#define GROUP_BY_STATION 1
+#define GROUP_BY_YEAR 2
+#define GROUP_BY_MONTH 4
+
+///
+/// Totals for one group after group_stats_merge, must match GroupTotals in Grouping.h
+///
+typedef struct
+{
+	long sum;
+	long sumSquares;
+	int count;
+	int min;
+	int max;
+	int pad;
+} GroupTotals;
+
+///
+/// Keyed reduction in one pass over the data. Each record's key is made from the columns in groupBy (station, year
+/// and/or month) and every work group accumulates count, min, max, sum and sum of squares per key in local memory.
+/// Only 32 bit local atomics are needed: the 64 bit sums are kept as lo/hi words, the hi word is bumped when the
+/// add into lo carries (and the sum's hi word takes the sign extension of negative values), so they stay exact.
+/// Only keys keyFrom..keyFrom+nkeys-1 are counted, so a key space too big for local memory can be done in windows.
+/// Each group writes its table to P[group][field][key] for group_stats_merge.
+///
+__kernel void group_stats_local(__global const int* A, __global const ushort* station, __global const int* date, int N,
+	int groupBy, int minYear, int nYears, int keyFrom, int nkeys, __global uint* P, __local uint* table)
+{
+	int lid = get_local_id(0);
+	int size = get_local_size(0);
+
+	for (int k = lid; k < nkeys; k += size)
+	{
+		table[GROUP_COUNT * nkeys + k] = 0;
+		table[GROUP_MIN * nkeys + k] = (uint)INT_MAX;
+		table[GROUP_MAX * nkeys + k] = (uint)INT_MIN;
+		table[GROUP_SUM_LO * nkeys + k] = 0;
+		table[GROUP_SUM_HI * nkeys + k] = 0;
+		table[GROUP_SQ_LO * nkeys + k] = 0;
+		table[GROUP_SQ_HI * nkeys + k] = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = get_global_id(0); i < N; i += get_global_size(0))
 	{
-		atomic_add(&B[0],scratch[lid]);
+		int d = date[i];
+		int key = 0;
+		if (groupBy & GROUP_BY_STATION)
+			key = station[i];
+		if (groupBy & GROUP_BY_YEAR)
+			key = key * nYears + (d / 10000 - minYear);
+		if (groupBy & GROUP_BY_MONTH)
+			key = key * 12 + (d / 100) % 100 - 1;
+
+		key -= keyFrom;
+		if (key < 0 || key >= nkeys)
+			continue;
+
+		int x = A[i];
+		uint square = (uint)x * (uint)x;
+		atomic_inc(&table[GROUP_COUNT * nkeys + key]);
+		atomic_min((__local int*)&table[GROUP_MIN * nkeys + key], x);
+		atomic_max((__local int*)&table[GROUP_MAX * nkeys + key], x);
+
+		uint old = atomic_add(&table[GROUP_SUM_LO * nkeys + key], (uint)x);
+		if (old + (uint)x < old)
+			atomic_inc(&table[GROUP_SUM_HI * nkeys + key]);
+		if (x < 0)
+			atomic_dec(&table[GROUP_SUM_HI * nkeys + key]);
+
+		old = atomic_add(&table[GROUP_SQ_LO * nkeys + key], square);
+		if (old + square < old)
+			atomic_inc(&table[GROUP_SQ_HI * nkeys + key]);
 	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	__global uint* out = P + get_group_id(0) * GROUP_FIELDS * nkeys;
+	for (int k = lid; k < GROUP_FIELDS * nkeys; k += size)
+		out[k] = table[k];
 }
 
-__kernel void find_variance(__global const int* A, __global int* B, int mean, int initialSize) 
+///
+/// Second stage of the keyed reduction, one work item per key adds up every group's table
+///
+__kernel void group_stats_merge(__global const uint* P, int groups, int nkeys, __global GroupTotals* T)
 {
-	int id = get_global_id(0);
+	int key = get_global_id(0);
+	if (key >= nkeys)
+		return;
 
-	if(id < initialSize)
-	{ 
-		B[id] = A[id] - mean;
+	GroupTotals t;
+	t.sum = 0;
+	t.sumSquares = 0;
+	t.count = 0;
+	t.min = INT_MAX;
+	t.max = INT_MIN;
+	t.pad = 0;
 
+	for (int g = 0; g < groups; g++)
+	{
+		__global const uint* table = P + g * GROUP_FIELDS * nkeys;
+		t.count += table[GROUP_COUNT * nkeys + key];
+		t.min = min(t.min, (int)table[GROUP_MIN * nkeys + key]);
+		t.max = max(t.max, (int)table[GROUP_MAX * nkeys + key]);
+		t.sum += ((long)(int)table[GROUP_SUM_HI * nkeys + key] << 32) + (long)table[GROUP_SUM_LO * nkeys + key];
+		t.sumSquares += ((long)table[GROUP_SQ_HI * nkeys + key] << 32) + (long)table[GROUP_SQ_LO * nkeys + key];
+	}
+
+	T[key] = t;
+}
+
+// ======================== Stream Compaction ======================== //
+
+///
+/// Hillis-Steele scan of one value per work item, returns the sum of the values before this work item's
+/// and sets total to the sum over the whole group. Every work item in the group must call it.
+///
+int scan_exclusive_local(int value, __local int* scratch, int* total)
+{
+	int lid = get_local_id(0);
+	int size = get_local_size(0);
+
+	scratch[lid] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int offset = 1; offset < size; offset *= 2)
+	{
+		int add = lid >= offset ? scratch[lid - offset] : 0;
 		barrier(CLK_LOCAL_MEM_FENCE);
+		scratch[lid] += add;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	int inclusive = scratch[lid];
+	*total = scratch[size - 1];
+	barrier(CLK_LOCAL_MEM_FENCE);	// before scratch is reused
+	return inclusive - value;
+}
+
+///
+/// Compaction pass 1: work group g counts the records in its block [g * chunk, (g + 1) * chunk) that pass
+/// record_matches() and writes the count to counts[g]
+///
+__kernel void filter_count(__global const ushort* station, __global const int* date, __global const short* time, int N,
+	int stationId, int dateFrom, int dateTo, int monthFrom, int monthTo, int timeFrom, int timeTo,
+	int chunk, __global int* counts, __local int* scratch)
+{
+	int lid = get_local_id(0);
+	int start = get_group_id(0) * chunk;
+	int end = min(start + chunk, N);
+
+	int count = 0;
+	for (int i = start + lid; i < end; i += get_local_size(0))
+		count += record_matches(station[i], date[i], time[i], stationId, dateFrom, dateTo, monthFrom, monthTo, timeFrom, timeTo);
+
+	int total;
+	scan_exclusive_local(count, scratch, &total);
+	if (lid == 0)
+		counts[get_group_id(0)] = total;
+}
 
-		B[id] = (B[id] * B[id]);
+///
+/// Compaction pass 2: exclusive scan of the n block counts in place, run as a single work group.
+/// counts[n] is set to the total, which is the number of records that passed.
+///
+__kernel void scan_counts(__global int* counts, int n, __local int* scratch)
+{
+	int lid = get_local_id(0);
+	int size = get_local_size(0);
+
+	int carry = 0;
+	for (int tile = 0; tile < n; tile += size)
+	{
+		int i = tile + lid;
+		int value = i < n ? counts[i] : 0;
+		int total;
+		int offset = scan_exclusive_local(value, scratch, &total);
+		if (i < n)
+			counts[i] = carry + offset;
+		carry += total;
 	}
+	if (lid == 0)
+		counts[n] = carry;
 }
 
-__kernel void at_find_min(__global const int* A, __global int* B, __local int* scratch) 
+///
+/// Compaction pass 3: every work group walks its block again a tile at a time, a local scan of the pass/fail flags
+/// gives each passing record its place after offsets[g], so the kept records stay in their original order
+///
+__kernel void filter_scatter(__global const int* A, __global const ushort* station, __global const int* date, __global const short* time, int N,
+	int stationId, int dateFrom, int dateTo, int monthFrom, int monthTo, int timeFrom, int timeTo,
+	int chunk, __global const int* offsets,
+	__global int* outA, __global ushort* outStation, __global int* outDate, __global short* outTime, __local int* scratch)
 {
-	int id = get_global_id(0);
 	int lid = get_local_id(0);
+	int size = get_local_size(0);
+	int start = get_group_id(0) * chunk;
+	int end = min(start + chunk, N);
+	int base = offsets[get_group_id(0)];
 
-	//cache all N values from global memory to local memory
-	scratch[lid] = A[id];
+	for (int tile = start; tile < end; tile += size)
+	{
+		int i = tile + lid;
+		int keep = i < end && record_matches(station[i], date[i], time[i], stationId, dateFrom, dateTo, monthFrom, monthTo, timeFrom, timeTo);
 
-	barrier(CLK_LOCAL_MEM_FENCE); //wait for all local threads to finish copying from global to local memory
+		int total;
+		int position = base + scan_exclusive_local(keep, scratch, &total);
+		if (keep)
+		{
+			outA[position] = A[i];
+			outStation[position] = station[i];
+			outDate[position] = date[i];
+			outTime[position] = time[i];
+		}
+		base += total;
+	}
+}
+
+// ======================== Scan ======================== //
+
+///
+/// Work-efficient (Blelloch) inclusive scan of data in place, one block of 2 * get_local_size(0) values per work group.
+/// The up-sweep builds a tree of partial sums in local memory, the down-sweep turns it into the exclusive scan, then each
+/// value is added back to make it inclusive. Every block's total goes to blockSums so the host can scan those and add them
+/// back with scan_add_offsets. The local size must be a power of 2.
+///
+__kernel void scan_blelloch(__global long* data, int N, __global long* blockSums, __local long* scratch)
+{
+	int lid = get_local_id(0);
+	int n = get_local_size(0) * 2;
+	int base = get_group_id(0) * n;
+	int a = base + 2 * lid;
+	int b = a + 1;
+
+	long valueA = a < N ? data[a] : 0;
+	long valueB = b < N ? data[b] : 0;
+	scratch[2 * lid] = valueA;
+	scratch[2 * lid + 1] = valueB;
 
-	atomic_min(&B[0],scratch[lid]);
+	int offset = 1;
+	for (int d = n >> 1; d > 0; d >>= 1)
+	{
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d)
+			scratch[offset * (2 * lid + 2) - 1] += scratch[offset * (2 * lid + 1) - 1];
+		offset *= 2;
+	}
+
+	if (lid == 0)
+	{
+		blockSums[get_group_id(0)] = scratch[n - 1];
+		scratch[n - 1] = 0;
+	}
+
+	for (int d = 1; d < n; d *= 2)
+	{
+		offset >>= 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d)
+		{
+			int left = offset * (2 * lid + 1) - 1;
+			int right = offset * (2 * lid + 2) - 1;
+			long t = scratch[left];
+			scratch[left] = scratch[right];
+			scratch[right] += t;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (a < N) data[a] = scratch[2 * lid] + valueA;
+	if (b < N) data[b] = scratch[2 * lid + 1] + valueB;
 }
 
-__kernel void at_find_max(__global const int* A, __global int* B, __local int* scratch) 
+///
+/// Adds the scanned totals of the blocks before each block to it, the second half of a scan bigger than one block
+///
+__kernel void scan_add_offsets(__global long* data, int N, __global const long* blockSums)
+{
+	int block = get_group_id(0);
+	if (block == 0)
+		return;
+
+	int a = block * get_local_size(0) * 2 + 2 * get_local_id(0);
+	long offset = blockSums[block - 1];
+	if (a < N) data[a] += offset;
+	if (a + 1 < N) data[a + 1] += offset;
+}
+
+// ======================== Rolling Series ======================== //
+
+///
+/// One point of a rolling series, must match SeriesPoint in Series.h
+///
+typedef struct
+{
+	long degreeDays;	// * 100
+	float mean;			// degrees
+	int min;			// * 100
+	int max;			// * 100
+	int count;
+} SeriesPoint;
+
+///
+/// Days since 1970-01-01 for a yyyymmdd date (the proleptic Gregorian calendar, from Howard Hinnant's days_from_civil)
+///
+int day_number(int yyyymmdd)
+{
+	int y = yyyymmdd / 10000;
+	int m = (yyyymmdd / 100) % 100;
+	int d = yyyymmdd % 100;
+	y -= m <= 2;
+	int era = (y >= 0 ? y : y - 399) / 400;
+	int yoe = y - era * 400;
+	int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+///
+/// The values the rolling sums scan, the temperatures widened to long
+///
+__kernel void series_values(__global const int* A, int N, __global long* values)
+{
+	int i = get_global_id(0);
+	if (i >= N)
+		return;
+
+	values[i] = A[i];
+}
+
+///
+/// The values the heating degree days scan, after the rolling sums have been scanned: the first record of every station
+/// day gets how far that day's mean temperature is below base (0 if it isn't, rounded to the nearest 0.01 degree day),
+/// every other record 0, so a station with several readings a day still counts each day once. The day's records are
+/// contiguous, its end is found with a binary search and its sum is the difference of two scan values.
+///
+__kernel void daily_degree_days(__global const ushort* station, __global const int* date, __global const long* sums, int N, int base,
+	__global long* degrees)
+{
+	int i = get_global_id(0);
+	if (i >= N)
+		return;
+
+	if (i > 0 && station[i - 1] == station[i] && date[i - 1] == date[i])
+	{
+		degrees[i] = 0;
+		return;
+	}
+
+	int lo = i + 1;
+	int hi = N;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (station[mid] == station[i] && date[mid] == date[i])
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	long count = lo - i;
+	long deficit = (long)base * count - (sums[lo - 1] - (i > 0 ? sums[i - 1] : 0));
+	degrees[i] = deficit > 0 ? (deficit + count / 2) / count : 0;
+}
+
+///
+/// One level of the sparse table rolling_window takes its min and max from, one work item per record. Level k of mins
+/// and maxs (at k * N) holds the min and max of the 2^k values from each index on, cut short at the end of the column.
+/// Level 0 is A itself, every later level combines two overlapping blocks of the one before, so it is launched once per
+/// level in order.
+///
+__kernel void sparse_level(__global const int* A, int N, int level, __global int* mins, __global int* maxs)
+{
+	int i = get_global_id(0);
+	if (i >= N)
+		return;
+
+	long at = (long)level * N + i;
+	if (level == 0)
+	{
+		mins[at] = A[i];
+		maxs[at] = A[i];
+		return;
+	}
+
+	long below = at - N;
+	int j = min(i + (1 << (level - 1)), N - 1) - i;
+	mins[at] = min(mins[below], mins[below + j]);
+	maxs[at] = max(maxs[below], maxs[below + j]);
+}
+
+///
+/// One work item per record of the time ordered, station grouped columns. The window is the record's own day and the
+/// window - 1 days before it at the same station, its first record is found with a binary search on the dates. The sum
+/// (and so the mean) comes from the difference of two inclusive scan values, min and max from two overlapping power of
+/// 2 blocks of the sparse table (see sparse_level) that between them cover the window. The degree days are the
+/// station's running total up to and including the record's day (see daily_degree_days), the scan value less the one
+/// just before the station's first record.
+///
+__kernel void rolling_window(__global const int* mins, __global const int* maxs, __global const ushort* station, __global const int* date,
+	__global const int* stationStart, __global const long* sums, __global const long* degreeSums, int N, int window,
+	__global SeriesPoint* out)
+{
+	int i = get_global_id(0);
+	if (i >= N)
+		return;
+
+	int first = stationStart[station[i]];
+	int from = day_number(date[i]) - window + 1;
+
+	int lo = first;
+	int hi = i;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (day_number(date[mid]) < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	SeriesPoint p;
+	p.count = i - lo + 1;
+	p.mean = (float)(sums[i] - (lo > 0 ? sums[lo - 1] : 0)) / (100.0f * p.count);
+
+	int level = 31 - clz(p.count);
+	long block = (long)level * N;
+	int last = i - (1 << level) + 1;
+	p.min = min(mins[block + lo], mins[block + last]);
+	p.max = max(maxs[block + lo], maxs[block + last]);
+	p.degreeDays = degreeSums[i] - (first > 0 ? degreeSums[first - 1] : 0);
+	out[i] = p;
+}
+
+// ======================== Text Parsing ======================== //
+
+///
+/// Whether byte i of the text starts a record, the same rule as isRecordStart() in Parser.h: the first byte of a line
+/// that isn't blank and doesn't start with a space
+///
+int is_record_start(__global const char* text, int i)
+{
+	char c = text[i];
+	return (i == 0 || text[i - 1] == '\n') && c != '\n' && c != '\r' && c != ' ';
+}
+
+///
+/// Line finding pass 1: work group g counts the records starting in its block of the text [(firstGroup + g) * chunk,
+/// (firstGroup + g + 1) * chunk) and writes the count to counts[firstGroup + g]. Launched once per uploaded chunk of
+/// the text, so one chunk is counted while the next is still uploading.
+///
+__kernel void line_count(__global const char* text, int size, int chunk, int firstGroup, __global int* counts, __local int* scratch)
 {
-	int id = get_global_id(0);
 	int lid = get_local_id(0);
+	int group = firstGroup + get_group_id(0);
+	int start = group * chunk;
+	int end = min(start + chunk, size);
 
-	//cache all N values from global memory to local memory
-	scratch[lid] = A[id];
+	int count = 0;
+	for (int i = start + lid; i < end; i += get_local_size(0))
+		count += is_record_start(text, i);
 
-	barrier(CLK_LOCAL_MEM_FENCE); //wait for all local threads to finish copying from global to local memory
+	int total;
+	scan_exclusive_local(count, scratch, &total);
+	if (lid == 0)
+		counts[group] = total;
+}
 
-	atomic_max(&B[0],scratch[lid]);
-}
\ No newline at end of file
+///
+/// Line finding pass 2, after scan_counts: every work group walks its block again a tile at a time and writes the
+/// offset of each record start to its place after offsets[g], so lineStarts holds every record's offset in file order
+///
+__kernel void line_scatter(__global const char* text, int size, int chunk, __global const int* offsets, __global int* lineStarts, __local int* scratch)
+{
+	int lid = get_local_id(0);
+	int start = get_group_id(0) * chunk;
+	int end = min(start + chunk, size);
+	int base = offsets[get_group_id(0)];
+
+	for (int tile = start; tile < end; tile += get_local_size(0))
+	{
+		int i = tile + lid;
+		int keep = i < end && is_record_start(text, i);
+
+		int total;
+		int position = base + scan_exclusive_local(keep, scratch, &total);
+		if (keep)
+			lineStarts[position] = i;
+		base += total;
+	}
+}
+
+///
+/// One work item per record: skips the first 5 columns (station, year, month, day, time) of the line at lineStarts[i]
+/// and parses the 6th into A[i] as degrees * 100, digit by digit the same as parseFixedPoint() so the values match the
+/// host parsers exactly. A line with fewer than 6 columns sets *malformed to the lowest such record.
+///
+__kernel void parse_temperatures(__global const char* text, int size, __global const int* lineStarts, int N, __global int* A, __global int* malformed)
+{
+	int i = get_global_id(0);
+	if (i >= N)
+		return;
+
+	int p = lineStarts[i];
+	int spaceCount = 0;
+	while (p < size && text[p] != '\n' && spaceCount < 5)
+	{
+		if (text[p++] == ' ')
+			spaceCount++;
+	}
+	if (spaceCount < 5)
+	{
+		atomic_min(malformed, i);
+		A[i] = 0;
+		return;
+	}
+
+	int negative = 0;
+	if (p < size && (text[p] == '-' || text[p] == '+'))
+		negative = text[p++] == '-';
+
+	int value = 0;
+	while (p < size && text[p] >= '0' && text[p] <= '9')
+		value = value * 10 + (text[p++] - '0');
+
+	int decimals = 0;
+	if (p < size && text[p] == '.')
+	{
+		p++;
+		while (p < size && text[p] >= '0' && text[p] <= '9')
+		{
+			if (decimals < 2)
+			{
+				value = value * 10 + (text[p] - '0');
+				decimals++;
+			}
+			p++;
+		}
+	}
+	for (; decimals < 2; decimals++)
+		value *= 10;
+
+	A[i] = negative ? -value : value;
+}
@@ -0,0 +1,136 @@
+﻿///
+/// Two stage reduction, specialised at build time by ReduceRegistry (Reduction.h) with these options:
+///   -D T=short|int|long|float|double	type of the input values
+///   -D VEC=1|2|4|8					values per vector load in stage 1 (ReduceRegistry uses 16 bytes worth)
+///   -D ACC=long|float|double			type they are reduced in (long for every integer type, so sums can't overflow)
+///   -D ACC_MIN=... -D ACC_MAX=...		lowest and highest ACC values, the identities of max and min
+///   -D OP=0|1|2						REDUCE_SUM, REDUCE_MIN or REDUCE_MAX
+///   -D WG_SIZE=n						work group size, a power of 2. The kernels can only be launched with it, the
+///										scratch array is sized from it and the tree below unrolls completely.
+///   -D ENABLE_FP64					when T or ACC is double
+///   -D SUBGROUPS					when the device has cl_khr_subgroups, the last steps of the tree are one sub-group reduction
+///
+#ifdef ENABLE_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#if defined(SUBGROUPS) && defined(cl_khr_subgroups)
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#define USE_SUBGROUPS
+#endif
+
+#define CAT(a, b) a##b
+#define XCAT(a, b) CAT(a, b)
+
+#define REDUCE_SUM 0
+#define REDUCE_MIN 1
+#define REDUCE_MAX 2
+
+#if OP == REDUCE_MIN
+#define IDENTITY ACC_MAX
+#define COMBINE(a, b) min(a, b)
+#define SUB_GROUP_REDUCE sub_group_reduce_min
+#elif OP == REDUCE_MAX
+#define IDENTITY ACC_MIN
+#define COMBINE(a, b) max(a, b)
+#define SUB_GROUP_REDUCE sub_group_reduce_max
+#else
+#define IDENTITY ((ACC)0)
+#define COMBINE(a, b) ((a) + (b))
+#define SUB_GROUP_REDUCE sub_group_reduce_add
+#endif
+
+// Reduces the VEC values of one vector load to a single ACC, pairwise so the combines don't depend on each other
+#if VEC == 2 || VEC == 4 || VEC == 8
+#define VLOAD XCAT(vload, VEC)
+#define VEC_T XCAT(T, VEC)
+#endif
+#if VEC == 2
+#define REDUCE_VECTOR(v) COMBINE((ACC)(v).s0, (ACC)(v).s1)
+#elif VEC == 4
+#define REDUCE_VECTOR(v) COMBINE(COMBINE((ACC)(v).s0, (ACC)(v).s1), COMBINE((ACC)(v).s2, (ACC)(v).s3))
+#elif VEC == 8
+#define REDUCE_VECTOR(v) COMBINE(COMBINE(COMBINE((ACC)(v).s0, (ACC)(v).s1), COMBINE((ACC)(v).s2, (ACC)(v).s3)), \
+	COMBINE(COMBINE((ACC)(v).s4, (ACC)(v).s5), COMBINE((ACC)(v).s6, (ACC)(v).s7)))
+#endif
+
+///
+/// Reduces one value per work item down to a single value for the work group, valid in work item 0.
+/// Sequential addressing keeps the active work items packed at the start of the group, with WG_SIZE known
+/// the loop has a fixed trip count and is unrolled into log2(WG_SIZE) steps. With sub-groups the tree stops once the
+/// values left fit in the first sub-group, which reduces them in one step with no more barriers.
+///
+ACC reduce_group(ACC value, __local ACC* scratch)
+{
+	int lid = get_local_id(0);
+	scratch[lid] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+#ifdef USE_SUBGROUPS
+	int stop = get_max_sub_group_size();
+#endif
+	int size = WG_SIZE;
+#pragma unroll
+	for (int half = WG_SIZE / 2; half > 0; half >>= 1)
+	{
+#ifdef USE_SUBGROUPS
+		if (size <= stop)
+			break;
+#endif
+		if (lid < half)
+			scratch[lid] = COMBINE(scratch[lid], scratch[lid + half]);
+		barrier(CLK_LOCAL_MEM_FENCE);
+		size = half;
+	}
+
+#ifdef USE_SUBGROUPS
+	if (get_sub_group_id() == 0)
+		return SUB_GROUP_REDUCE(lid < size ? scratch[lid] : IDENTITY);
+#endif
+	return scratch[0];
+}
+
+///
+/// Stage 1: every work item reduces a grid stride slice of the N values into an ACC, VEC at a time with vector loads
+/// (the last N % VEC one at a time), then the group reduces those and writes one partial per group to B
+///
+__kernel __attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+void reduce_stage1(__global const T* A, int N, __global ACC* B)
+{
+	__local ACC scratch[WG_SIZE];
+
+	ACC acc = IDENTITY;
+#ifdef REDUCE_VECTOR
+	for (int i = get_global_id(0); i < N / VEC; i += get_global_size(0))
+	{
+		VEC_T v = VLOAD(i, A);
+		acc = COMBINE(acc, REDUCE_VECTOR(v));
+	}
+	for (int i = (N / VEC) * VEC + get_global_id(0); i < N; i += get_global_size(0))
+		acc = COMBINE(acc, (ACC)A[i]);
+#else
+	for (int i = get_global_id(0); i < N; i += get_global_size(0))
+		acc = COMBINE(acc, (ACC)A[i]);
+#endif
+
+	ACC result = reduce_group(acc, scratch);
+	if (!get_local_id(0))
+		B[get_group_id(0)] = result;
+}
+
+///
+/// Stage 2: the same again over the partials, launched as a single work group to get the final value in B[0]
+///
+__kernel __attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+void reduce_stage2(__global const ACC* A, int N, __global ACC* B)
+{
+	__local ACC scratch[WG_SIZE];
+
+	ACC acc = IDENTITY;
+	for (int i = get_global_id(0); i < N; i += get_global_size(0))
+		acc = COMBINE(acc, A[i]);
+
+	ACC result = reduce_group(acc, scratch);
+	if (!get_local_id(0))
+		B[get_group_id(0)] = result;
+}